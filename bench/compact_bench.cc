@@ -0,0 +1,562 @@
+//**compact_bench** times the parts of the compactor that decide how fast it
+//goes, each on its own, and then the whole thing on the given files, and can
+//hold the results up against a baseline saved from an earlier run.
+//
+//The microbenchmarks work on synthetic docs (see synthetic.hh) of each ID
+//shape, all in memory but for the sorter's spill files:
+//
+// * `merge_sorter.SHAPE`: the docinfo sort, in one in-memory run;
+// * `merge_sorter.spill.SHAPE`: the same with an eighth of the memory, so
+//   it spills runs and merges them;
+// * `sort_linked_list.SHAPE`: the linked list sort it replaced, for scale;
+// * `term.seq_value` and `term.id_value`: encoding each index's values;
+// * `node_builder.seq` and `node_builder.id`: building (and flushing, with
+//   snappy, on this thread) the nodes of each index, to an unlinked file.
+//
+//Each file named on the command line is then compacted by running the
+//compactor (`-x`) on it, with `-F -c 0` so every run does the same work,
+//and its `-M` report gives `compact.FILE`, the whole run's time, with the
+//time of its main phases and its peak RSS.
+//
+//Every result is the best of `-r` runs, and is something where less is
+//better (time per item, or memory). They're printed one per line as
+//_name value unit_, which is also the format `-o` saves them in and `-c`
+//reads a baseline from; any more than `-T` percent worse than the baseline
+//is marked as a regression, and makes the exit status 1.
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <map>
+#include <string>
+#include <vector>
+#include "btree_copy.hh"
+#include "chunk_writer.hh"
+#include "docinfo_term.hh"
+#include "llmsort.h"
+#include "mergesor.h"
+#include "reduces.hh"
+#include "term_encode.hh"
+#include "synthetic.hh"
+using namespace couchstore;
+using namespace couchstore::bench;
+
+//Largest docinfo record, as in the compactor.
+static const unsigned kMaxRecord = 1024;
+//Phases of the compactor's report to show.
+static const char* kPhases[] = { "by_seq", "by_id", "commit" };
+
+struct Options {
+  Options() : records(1000000), reps(3), threshold(10), compactor("./compactor"),
+      spill_dir(NULL), output(NULL), baseline(NULL) { }
+  unsigned long records;
+  unsigned reps;
+  double threshold;
+  const char* compactor;
+  const char* spill_dir;
+  const char* output;
+  const char* baseline;
+};
+
+struct Result {
+  std::string name;
+  double value;
+  std::string unit;
+};
+
+static double now_ns()
+{
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+//Keep the best of the runs of each result.
+static void record(std::vector<Result>* results, const std::string& name,
+                   double value, const char* unit)
+{
+  for(size_t i = 0; i < results->size(); i++)
+  {
+    Result& result = (*results)[i];
+    if(result.name == name)
+    {
+      if(value < result.value) result.value = value;
+      return;
+    }
+  }
+  Result result = { name, value, unit };
+  results->push_back(result);
+}
+
+//## Synthetic docinfos
+//`count` docs of `shape`, in seq order, with the IDs in `ids`.
+class DocInfos {
+ public:
+  DocInfos(IdShape shape, unsigned long count)
+      : infos_(count), ids_(count * kMaxIdSize) {
+    uint64_t random = 1;
+    for(unsigned long i = 0; i < count; i++)
+    {
+      DocInfo& info = infos_[i];
+      memset(&info, 0, sizeof(info));
+      info.id.buf = &ids_[i * kMaxIdSize];
+      info.id.size = make_id(shape, 1, i, info.id.buf);
+      info.db_seq = i + 1;
+      info.rev_seq = 1;
+      info.rev_meta.buf = rev_meta_;
+      info.rev_meta.size = sizeof(rev_meta_);
+      info.bp = i * 4096;
+      info.size = 256 + random_below(&random, 4096);
+      info.deleted = random_below(&random, 20) == 0;
+    }
+    memset(rev_meta_, 0, sizeof(rev_meta_));
+  }
+  size_t size() const {
+    return infos_.size();
+  }
+  DocInfo* operator[](size_t i) {
+    return &infos_[i];
+  }
+  //Doc `i` as the sorter's record, in `record`, returning its size.
+  unsigned toRecord(size_t i, char* record) {
+    const DocInfo& info = infos_[i];
+    disk_docinfo* disk = reinterpret_cast<disk_docinfo*>(record);
+    disk->len = sizeof(disk_docinfo) + info.id.size + info.rev_meta.size;
+    disk->id_len = info.id.size;
+    disk->db_seq = info.db_seq;
+    disk->rev_seq = info.rev_seq;
+    disk->rev_meta_len = info.rev_meta.size;
+    disk->deleted = info.deleted;
+    disk->content_meta = info.content_meta;
+    disk->bp = info.bp;
+    disk->size = info.size;
+    memcpy(record + sizeof(disk_docinfo), info.id.buf, info.id.size);
+    memcpy(record + sizeof(disk_docinfo) + info.id.size, info.rev_meta.buf,
+           info.rev_meta.size);
+    return disk->len;
+  }
+ private:
+  std::vector<DocInfo> infos_;
+  std::vector<char> ids_;
+  char rev_meta_[16];
+};
+
+//## Sorting
+static int count_sorted(void* record, void* ctx)
+{
+  ++*static_cast<unsigned long*>(ctx);
+  return 0;
+}
+
+//Sort the docs through a `merge_sorter` set up as the compactor sets it up,
+//with `run_bytes` for each run, returning ns per record, or 0 if it fails.
+static double time_merge_sorter(DocInfos& docs, size_t run_bytes,
+                                const Options& options)
+{
+  unsigned long sorted = 0;
+  merge_sort_params params;
+  merge_sort_default_params(&params);
+  params.compare = compare_diskdocinfo;
+  params.prefix = prefix_diskdocinfo;
+  params.key = key_diskdocinfo;
+  params.run_sort = MERGE_SORT_RUNS_BY_RADIX;
+  params.output = count_sorted;
+  params.output_pointer = &sorted;
+  params.max_record_size = kMaxRecord;
+  params.run_bytes = run_bytes;
+  params.spill_dir = options.spill_dir;
+  char record[kMaxRecord];
+  double start = now_ns();
+  merge_sorter* sorter = merge_sorter_open(&params);
+  if(sorter == NULL) return 0;
+  int error = 0;
+  for(size_t i = 0; i < docs.size() && !error; i++)
+    error = merge_sorter_add(sorter, record, docs.toRecord(i, record));
+  if(!error)
+    error = merge_sorter_finish(sorter, NULL);
+  merge_sorter_close(sorter);
+  if(error || sorted != docs.size()) return 0;
+  return (now_ns() - start) / docs.size();
+}
+
+struct ListRecord {
+  ListRecord* next;
+  char record[1];
+};
+
+static int compare_list_records(const ListRecord* a, const ListRecord* b,
+                                void* ctx)
+{
+  return compare_diskdocinfo(const_cast<char*>(a->record),
+                             const_cast<char*>(b->record), ctx);
+}
+
+//The space a list node holding a record of `size` bytes takes, 8 byte
+//aligned.
+static size_t list_node_size(size_t size)
+{
+  return (offsetof(ListRecord, record) + size + 7) / 8 * 8;
+}
+
+static double time_linked_list(DocInfos& docs)
+{
+  //The nodes are packed, each as big as its record, so building the input
+  //doesn't cost more memory than the records take.
+  char record[kMaxRecord];
+  size_t total = 0;
+  for(size_t i = 0; i < docs.size(); i++)
+    total += list_node_size(docs.toRecord(i, record));
+  std::vector<char> arena(total);
+  ListRecord* first = NULL;
+  ListRecord** tail = &first;
+  size_t used = 0;
+  for(size_t i = 0; i < docs.size(); i++)
+  {
+    ListRecord* r = reinterpret_cast<ListRecord*>(&arena[used]);
+    used += list_node_size(docs.toRecord(i, r->record));
+    r->next = NULL;
+    *tail = r;
+    tail = &r->next;
+  }
+  double start = now_ns();
+  sort_list(first, 0, compare_list_records, NULL, NULL);
+  return (now_ns() - start) / docs.size();
+}
+
+//## Encoding
+static double time_seq_values(DocInfos& docs, std::vector<char>* buf)
+{
+  double start = now_ns();
+  char* out = &(*buf)[0];
+  for(size_t i = 0; i < docs.size(); i++)
+    out = put_seq_value(term::put_ulonglong(out, docs[i]->db_seq), docs[i]);
+  return (now_ns() - start) / docs.size();
+}
+
+static double time_id_values(DocInfos& docs, std::vector<char>* buf)
+{
+  double start = now_ns();
+  char* out = &(*buf)[0];
+  for(size_t i = 0; i < docs.size(); i++)
+    out = put_id_value(term::put_binary(out, docs[i]->id.buf,
+                                        docs[i]->id.size), docs[i]);
+  return (now_ns() - start) / docs.size();
+}
+
+//## Building nodes
+//A file for the nodes to go to, unlinked, so it goes when it's closed.
+static int open_scratch(const char* dir)
+{
+  char path[PATH_MAX];
+  if(dir == NULL)
+    dir = getenv("TMPDIR");
+  if(dir == NULL || *dir == '\0')
+    dir = "/tmp";
+  snprintf(path, sizeof(path), "%s/compact_bench.XXXXXX", dir);
+  int fd = mkstemp(path);
+  if(fd >= 0)
+    unlink(path);
+  return fd;
+}
+
+//Build a `by_seq` tree of the docs, or their `by_id` tree (as if already in
+//ID order), returning ns per doc, or 0 if it fails.
+static double time_node_builder(DocInfos& docs, bool by_id,
+                                const Options& options)
+{
+  Db db;
+  memset(&db, 0, sizeof(db));
+  db.fd = open_scratch(options.spill_dir);
+  if(db.fd < 0) return 0;
+  int error = 0;
+  double start = now_ns();
+  {
+    ChunkWriter writer(&db);
+    NodeBuilder<CountingReduce> seq_tree(&writer);
+    NodeBuilder<ByIDReduce> id_tree(&writer);
+    seq_tree.setStreaming();
+    id_tree.setStreaming();
+    for(size_t i = 0; i < docs.size() && !error; i++)
+    {
+      DocInfo* info = docs[i];
+      if(by_id)
+      {
+        size_t key_size = term::binary_size(info->id.size);
+        size_t value_size = id_value_size(info);
+        char* item = id_tree.newItem(key_size + value_size);
+        if(item == NULL) { error = ERROR_ALLOC_FAIL; break; }
+        put_id_value(term::put_binary(item, info->id.buf, info->id.size),
+                     info);
+        error = id_tree.commitItem(key_size, value_size,
+                                   ByIDReduce::Item(info->deleted,
+                                                    info->size));
+      }
+      else
+      {
+        size_t key_size = term::ulonglong_size(info->db_seq);
+        size_t value_size = seq_value_size(info);
+        char* item = seq_tree.newItem(key_size + value_size);
+        if(item == NULL) { error = ERROR_ALLOC_FAIL; break; }
+        put_seq_value(term::put_ulonglong(item, info->db_seq), info);
+        error = seq_tree.commitItem(key_size, value_size);
+      }
+    }
+    if(!error && by_id)
+    {
+      NodeBuilder<ByIDReduce>::PointerPtr root;
+      error = id_tree.finishTree(&root);
+    }
+    else if(!error)
+    {
+      NodeBuilder<CountingReduce>::PointerPtr root;
+      error = seq_tree.finishTree(&root);
+    }
+    if(!error)
+      error = writer.flush();
+  }
+  double elapsed = now_ns() - start;
+  close(db.fd);
+  return error ? 0 : elapsed / docs.size();
+}
+
+//## Microbenchmarks
+static void run_micro(const Options& options, std::vector<Result>* results)
+{
+  static const IdShape shapes[] = { kUuidIds, kSequentialIds, kPrefixIds };
+  for(size_t s = 0; s < sizeof(shapes) / sizeof(shapes[0]); s++)
+  {
+    DocInfos docs(shapes[s], options.records);
+    std::string shape = id_shape_name(shapes[s]);
+    //Room for every record, and each one's index entry, in one run.
+    size_t all = options.records * (sizeof(disk_docinfo) + kMaxIdSize + 16 +
+                                    32);
+    for(unsigned rep = 0; rep < options.reps; rep++)
+    {
+      double ns = time_merge_sorter(docs, all, options);
+      if(ns > 0)
+        record(results, "merge_sorter." + shape, ns, "ns/record");
+      ns = time_merge_sorter(docs, all / 8, options);
+      if(ns > 0)
+        record(results, "merge_sorter.spill." + shape, ns, "ns/record");
+      record(results, "sort_linked_list." + shape, time_linked_list(docs),
+             "ns/record");
+    }
+    if(shapes[s] != kUuidIds)
+      continue;
+    //The rest don't much care what the IDs look like.
+    std::vector<char> buf(options.records * 256);
+    for(unsigned rep = 0; rep < options.reps; rep++)
+    {
+      record(results, "term.seq_value", time_seq_values(docs, &buf), "ns/doc");
+      record(results, "term.id_value", time_id_values(docs, &buf), "ns/doc");
+      double ns = time_node_builder(docs, false, options);
+      if(ns > 0)
+        record(results, "node_builder.seq", ns, "ns/doc");
+      ns = time_node_builder(docs, true, options);
+      if(ns > 0)
+        record(results, "node_builder.id", ns, "ns/doc");
+    }
+  }
+}
+
+//## Compacting
+//The number after `"key":` in `json`, searching from `from`.
+static bool json_number(const std::string& json, const std::string& key,
+                        double* value, size_t from = 0)
+{
+  size_t at = json.find("\"" + key + "\":", from);
+  if(at == std::string::npos) return false;
+  *value = strtod(json.c_str() + at + key.size() + 3, NULL);
+  return true;
+}
+
+//Run the compactor on `file`, leaving its report's last line in `*report`.
+static bool run_compactor(const Options& options, const std::string& file,
+                          std::string* report)
+{
+  std::string report_file = file + ".bench.json";
+  pid_t pid = fork();
+  if(pid < 0) return false;
+  if(pid == 0)
+  {
+    //Its own output would only get in the way of ours.
+    int null = open("/dev/null", O_WRONLY);
+    if(null >= 0) dup2(null, 1);
+    execl(options.compactor, options.compactor, "-F", "-c", "0", "-M",
+          report_file.c_str(), file.c_str(), (char*) NULL);
+    _exit(127);
+  }
+  int status;
+  while(waitpid(pid, &status, 0) < 0 && errno == EINTR) { }
+  unlink((file + ".compact").c_str());
+  FILE* in = fopen(report_file.c_str(), "r");
+  if(in == NULL) return false;
+  char line[16384];
+  while(fgets(line, sizeof(line), in))
+    *report = line;
+  fclose(in);
+  unlink(report_file.c_str());
+  return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+static void run_compactions(const Options& options,
+                            const std::vector<std::string>& files,
+                            std::vector<Result>* results)
+{
+  for(size_t f = 0; f < files.size(); f++)
+  {
+    std::string name = files[f];
+    size_t slash = name.rfind('/');
+    if(slash != std::string::npos) name = name.substr(slash + 1);
+    name = "compact." + name;
+    for(unsigned rep = 0; rep < options.reps; rep++)
+    {
+      std::string report;
+      double value;
+      if(!run_compactor(options, files[f], &report))
+      {
+        fprintf(stderr, "Compacting %s failed\n", files[f].c_str());
+        break;
+      }
+      if(json_number(report, "elapsed_ms", &value))
+        record(results, name, value, "ms");
+      for(size_t p = 0; p < sizeof(kPhases) / sizeof(kPhases[0]); p++)
+      {
+        size_t at = report.find(std::string("\"name\":\"") + kPhases[p] + "\"");
+        if(at != std::string::npos && json_number(report, "wall_ms", &value, at))
+          record(results, name + "." + kPhases[p], value, "ms");
+      }
+      if(json_number(report, "peak_rss_kb", &value))
+        record(results, name + ".peak_rss", value, "kB");
+    }
+  }
+}
+
+//## Baselines
+static bool read_baseline(const char* path, std::map<std::string, double>* out)
+{
+  FILE* in = fopen(path, "r");
+  if(in == NULL) return false;
+  char name[256], unit[32];
+  double value;
+  while(fscanf(in, "%255s %lf %31s", name, &value, unit) == 3)
+    (*out)[name] = value;
+  fclose(in);
+  return true;
+}
+
+//Print the results, against the baseline if there is one. Returns the
+//number of regressions.
+static int report(const Options& options, const std::vector<Result>& results,
+                  const std::map<std::string, double>& baseline)
+{
+  int regressions = 0;
+  for(size_t i = 0; i < results.size(); i++)
+  {
+    const Result& result = results[i];
+    printf("%-36s %12.1f %-10s", result.name.c_str(), result.value,
+           result.unit.c_str());
+    std::map<std::string, double>::const_iterator base =
+        baseline.find(result.name);
+    if(base != baseline.end() && base->second > 0)
+    {
+      double change = (result.value / base->second - 1) * 100;
+      bool worse = change > options.threshold;
+      printf(" %12.1f %+7.1f%%%s", base->second, change,
+             worse ? "  REGRESSION" : "");
+      if(worse) regressions++;
+    }
+    else if(options.baseline)
+      printf(" %12s", "new");
+    printf("\n");
+  }
+  return regressions;
+}
+
+static bool save(const char* path, const std::vector<Result>& results)
+{
+  FILE* out = fopen(path, "w");
+  if(out == NULL) return false;
+  for(size_t i = 0; i < results.size(); i++)
+    fprintf(out, "%s %.1f %s\n", results[i].name.c_str(), results[i].value,
+            results[i].unit.c_str());
+  return fclose(out) == 0;
+}
+
+static void usage(const char* prog)
+{
+  printf("Usage: %s [-n records] [-r reps] [-x compactor] [-t dir] "
+         "[-o results] [-c baseline] [-T percent] [file.couch]...\n", prog);
+  printf("  -n  docs for each microbenchmark (default 1000000; 0 skips them)\n");
+  printf("  -r  runs of each benchmark, the best of which counts (default 3)\n");
+  printf("  -x  compactor to run on each file (default ./compactor)\n");
+  printf("  -t  directory for sort spill files and scratch files\n");
+  printf("  -o  save the results here, to compare later runs against\n");
+  printf("  -c  compare the results against these, saved earlier with -o\n");
+  printf("  -T  percent worse than the baseline that counts as a regression\n"
+         "      (default 10)\n");
+}
+
+int main(int argc, char** argv)
+{
+  Options options;
+  int opt;
+  while((opt = getopt(argc, argv, "n:r:x:t:o:c:T:")) != -1)
+  {
+    switch(opt)
+    {
+      case 'n':
+        options.records = strtoul(optarg, NULL, 10);
+        break;
+      case 'r':
+        options.reps = atoi(optarg);
+        if(options.reps == 0) options.reps = 1;
+        break;
+      case 'x':
+        options.compactor = optarg;
+        break;
+      case 't':
+        options.spill_dir = optarg;
+        break;
+      case 'o':
+        options.output = optarg;
+        break;
+      case 'c':
+        options.baseline = optarg;
+        break;
+      case 'T':
+        options.threshold = atof(optarg);
+        break;
+      default:
+        usage(argv[0]);
+        return 1;
+    }
+  }
+  std::vector<std::string> files(argv + optind, argv + argc);
+  std::map<std::string, double> baseline;
+  if(options.baseline && !read_baseline(options.baseline, &baseline))
+  {
+    printf("Can't read baseline %s\n", options.baseline);
+    return 1;
+  }
+  std::vector<Result> results;
+  if(options.records)
+    run_micro(options, &results);
+  run_compactions(options, files, &results);
+  int regressions = report(options, results, baseline);
+  if(options.output && !save(options.output, results))
+  {
+    printf("Can't write %s\n", options.output);
+    return 1;
+  }
+  if(regressions)
+    printf("%d regression%s against %s\n", regressions,
+           regressions == 1 ? "" : "s", options.baseline);
+  return regressions ? 1 : 0;
+}
@@ -0,0 +1,221 @@
+//**make_couch** writes a synthetic .couch file to benchmark the compactor on.
+//
+//It saves `-n` docs, with IDs of the shape `-i` and bodies of sizes drawn from
+//`-b`, in batches of `-B`, committing after each. Then, to leave the file
+//with something for compaction to drop, it saves new revisions of `-u` times
+//as many docs as there are, picked at random, and deletes `-d` of them, also
+//at random. The same options (and `-s` seed) always make the same file.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <set>
+#include <string>
+#include <vector>
+#include <libcouchstore/couch_db.h>
+#include "synthetic.hh"
+using namespace couchstore::bench;
+
+//Couchbase's rev meta: CAS, expiry and flags.
+static const size_t kRevMetaSize = 16;
+
+struct Options {
+  Options() : docs(100000), shape(kUuidIds), churn(0), deletes(0), seed(1),
+      batch(1000) { }
+  uint64_t docs;
+  IdShape shape;
+  SizeDistribution sizes;
+  double churn;
+  double deletes;
+  uint64_t seed;
+  unsigned batch;
+};
+
+//## Saving
+//Docs saved since the last commit, and the memory they point into. A doc is
+//in a batch at most once: one saved again is left for the next.
+class Batch {
+ public:
+  Batch(Db* db, const Options& options)
+      : db_(db), options_(options), docs_(options.batch),
+        infos_(options.batch), ids_(options.batch * kMaxIdSize),
+        bodies_(options.batch), count_(0), saved_(0) {
+    rev_meta_.assign(kRevMetaSize, '\0');
+  }
+  //Save a revision of doc `index`: the `rev`th, or a deletion.
+  int save(uint64_t index, uint64_t rev, bool deleted, uint64_t* random) {
+    if(!indexes_.insert(index).second)
+    {
+      int error = flush();
+      if(error) return error;
+      indexes_.insert(index);
+    }
+    char* id = &ids_[count_ * kMaxIdSize];
+    DocInfo& info = infos_[count_];
+    memset(&info, 0, sizeof(info));
+    info.id.buf = id;
+    info.id.size = make_id(options_.shape, options_.seed, index, id);
+    info.rev_seq = rev;
+    info.rev_meta.buf = &rev_meta_[0];
+    info.rev_meta.size = rev_meta_.size();
+    info.deleted = deleted;
+    Doc& doc = docs_[count_];
+    doc.id = info.id;
+    doc.data.buf = NULL;
+    doc.data.size = 0;
+    if(!deleted)
+    {
+      make_body(random_size(options_.sizes, random), random,
+                &bodies_[count_]);
+      doc.data.buf = &bodies_[count_][0];
+      doc.data.size = bodies_[count_].size();
+    }
+    count_++;
+    return count_ == options_.batch ? flush() : 0;
+  }
+  //Save and commit what's collected.
+  int flush() {
+    if(count_ == 0) return 0;
+    std::vector<Doc*> docs(count_);
+    std::vector<DocInfo*> infos(count_);
+    for(size_t i = 0; i < count_; i++)
+    {
+      //A deletion has no body to save.
+      docs[i] = infos_[i].deleted ? NULL : &docs_[i];
+      infos[i] = &infos_[i];
+    }
+    int error = save_docs(db_, &docs[0], &infos[0], count_, 0);
+    if(!error)
+      error = commit_all(db_, 0);
+    saved_ += count_;
+    count_ = 0;
+    indexes_.clear();
+    return error;
+  }
+  uint64_t saved() const {
+    return saved_;
+  }
+ private:
+  Db* db_;
+  const Options& options_;
+  std::vector<Doc> docs_;
+  std::vector<DocInfo> infos_;
+  std::vector<char> ids_;
+  std::vector<std::string> bodies_;
+  std::string rev_meta_;
+  std::set<uint64_t> indexes_;
+  size_t count_;
+  uint64_t saved_;
+};
+
+static int make_couch(const char* filename, const Options& options)
+{
+  //Start from an empty file, not on the end of an old one.
+  unlink(filename);
+  Db* db;
+  int error = open_db(const_cast<char*>(filename), COUCH_CREATE_FILES, &db);
+  if(error) return error;
+  uint64_t random = options.seed;
+  Batch batch(db, options);
+  //Every doc's latest revision, 0 once it's deleted.
+  std::vector<uint64_t> revs(options.docs, 1);
+  for(uint64_t i = 0; i < options.docs && !error; i++)
+    error = batch.save(i, 1, false, &random);
+  uint64_t updates = (uint64_t) (options.churn * options.docs);
+  for(uint64_t i = 0; i < updates && options.docs && !error; i++)
+  {
+    uint64_t index = random_below(&random, options.docs);
+    if(revs[index])
+      error = batch.save(index, ++revs[index], false, &random);
+  }
+  uint64_t deletes = (uint64_t) (options.deletes * options.docs);
+  for(uint64_t i = 0; i < deletes && options.docs && !error; i++)
+  {
+    uint64_t index = random_below(&random, options.docs);
+    if(revs[index])
+    {
+      error = batch.save(index, revs[index] + 1, true, &random);
+      revs[index] = 0;
+    }
+  }
+  if(!error)
+    error = batch.flush();
+  close_db(db);
+  if(!error)
+    printf("%s: %llu docs, %llu revisions saved\n", filename,
+           (unsigned long long) options.docs,
+           (unsigned long long) batch.saved());
+  return error;
+}
+
+static void usage(const char* prog)
+{
+  printf("Usage: %s [-n docs] [-i shape] [-b sizes] [-u churn] [-d deletes] "
+         "[-s seed] [-B batch] file.couch\n", prog);
+  printf("  -n  docs to save (default 100000)\n");
+  printf("  -i  ID shape: uuid (default), seq (increasing with the seq) or\n"
+         "      prefix (a long shared prefix)\n");
+  printf("  -b  body sizes: fixed:N (default fixed:1024), uniform:MIN:MAX or\n"
+         "      exp:MEAN\n");
+  printf("  -u  updates to make afterwards, as a fraction of docs (default 0)\n");
+  printf("  -d  docs to delete after that, as a fraction (default 0)\n");
+  printf("  -s  random seed (default 1)\n");
+  printf("  -B  docs saved per commit (default 1000)\n");
+}
+
+int main(int argc, char** argv)
+{
+  Options options;
+  int opt;
+  while((opt = getopt(argc, argv, "n:i:b:u:d:s:B:")) != -1)
+  {
+    switch(opt)
+    {
+      case 'n':
+        options.docs = strtoull(optarg, NULL, 10);
+        break;
+      case 'i':
+        if(!parse_id_shape(optarg, &options.shape))
+        {
+          printf("Bad ID shape: %s\n", optarg);
+          usage(argv[0]);
+          return 1;
+        }
+        break;
+      case 'b':
+        if(!parse_sizes(optarg, &options.sizes))
+        {
+          printf("Bad body sizes: %s\n", optarg);
+          usage(argv[0]);
+          return 1;
+        }
+        break;
+      case 'u':
+        options.churn = atof(optarg);
+        break;
+      case 'd':
+        options.deletes = atof(optarg);
+        break;
+      case 's':
+        options.seed = strtoull(optarg, NULL, 10);
+        break;
+      case 'B':
+        options.batch = atoi(optarg);
+        if(options.batch == 0) options.batch = 1;
+        break;
+      default:
+        usage(argv[0]);
+        return 1;
+    }
+  }
+  if(optind >= argc)
+  {
+    printf("Must specify file to write.\n");
+    usage(argv[0]);
+    return 1;
+  }
+  int error = make_couch(argv[optind], options);
+  if(error)
+    printf("Couldn't write %s: %s\n", argv[optind], describe_error(error));
+  return error ? 1 : 0;
+}
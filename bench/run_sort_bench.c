@@ -0,0 +1,180 @@
+/* Benchmark for the in-memory run sorters.
+
+   Times the original linked-list merge sort (sort_linked_list), the
+   comparison sort of prefixed entries (sort_entries) and the MSD radix
+   sort (radix_sort_entries) on runs of increasing size, for two key
+   shapes:
+
+     uuid    random 36 character UUIDs, where the 8-byte prefix almost
+             always settles a comparison
+     prefix  "session::user::" followed by a random decimal number, where
+             every prefix ties and comparisons fall through to memcmp
+
+   and prints the time per record for each, so the run size at which radix
+   sorting starts to pay off can be read off for each key shape.
+
+   Usage: run_sort_bench [max_records]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include "runsort.h"
+
+extern void *sort_linked_list(void *, unsigned,
+  int (*)(void *, void *, void *), void *, unsigned long *);
+
+/* records are a length byte followed by the key */
+struct list_record
+{
+  struct list_record *next;
+  unsigned char record[1];
+};
+
+static int compare_keys(void *p, void *q, void *pointer)
+{
+  unsigned char *a = p, *b = q;
+  unsigned n = a[0] < b[0] ? a[0] : b[0];
+  int cmp = memcmp(a + 1, b + 1, n);
+  if (cmp != 0)
+    return cmp;
+  return a[0] < b[0] ? -1 : a[0] > b[0];
+}
+
+static int compare_list_records(void *p, void *q, void *pointer)
+{
+  return compare_keys(((struct list_record *) p)->record,
+    ((struct list_record *) q)->record, pointer);
+}
+
+static const unsigned char *record_key(void *record, unsigned *length,
+  void *pointer)
+{
+  unsigned char *r = record;
+  *length = r[0];
+  return r + 1;
+}
+
+static unsigned long long record_prefix(unsigned char *r)
+{
+  unsigned long long prefix = 0;
+  unsigned i;
+  for (i = 0; i < 8; i++)
+    prefix = (prefix << 8) | (i < r[0] ? r[1 + i] : 0);
+  return prefix;
+}
+
+static double now(void)
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void make_key(unsigned char *r, int shape)
+{
+  static const char hex[] = "0123456789abcdef";
+  unsigned i;
+  if (shape == 0)
+  {
+    r[0] = 36;
+    for (i = 0; i < 36; i++)
+      r[1 + i] = (i == 8 || i == 13 || i == 18 || i == 23) ? '-' :
+        hex[rand() % 16];
+  }
+  else
+    r[0] = sprintf((char *) r + 1, "session::user::%lu",
+      ((unsigned long) rand() << 16) ^ (unsigned long) rand());
+}
+
+/* fill an arena and entry array with n keys */
+static char *make_run(unsigned long n, int shape, struct sort_entry *entries)
+{
+  char *arena = malloc(n * 64);
+  unsigned long i;
+  for (i = 0; i < n; i++)
+  {
+    unsigned char *r = (unsigned char *) arena + i * 64;
+    make_key(r, shape);
+    entries[i].offset = (unsigned) (i * 64);
+    entries[i].size = r[0] + 1;
+    entries[i].prefix = record_prefix(r);
+  }
+  return arena;
+}
+
+static int check_sorted(struct sort_entry *entries, unsigned long n,
+  char *arena)
+{
+  unsigned long i;
+  for (i = 1; i < n; i++)
+  {
+    if (compare_keys(arena + entries[i - 1].offset,
+      arena + entries[i].offset, NULL) > 0)
+      return 0;
+  }
+  return 1;
+}
+
+int main(int argc, char **argv)
+{
+  unsigned long max_records = argc > 1 ? strtoul(argv[1], NULL, 10) : 1UL << 20;
+  static const char *shapes[] = { "uuid", "prefix" };
+  int shape;
+  printf("%-7s %9s %12s %12s %12s\n", "keys", "records",
+    "list ns/rec", "qsort ns/rec", "radix ns/rec");
+  for (shape = 0; shape < 2; shape++)
+  {
+    unsigned long n;
+    for (n = 16; n <= max_records; n *= 4)
+    {
+      /* repeat small runs so each measurement covers ~1M records */
+      unsigned long reps = n < (1UL << 20) ? (1UL << 20) / n : 1, r;
+      struct sort_entry *entries = malloc(n * sizeof(struct sort_entry));
+      struct sort_entry *work = malloc(n * sizeof(struct sort_entry));
+      struct list_record *nodes = malloc(n * (sizeof(struct list_record) + 64));
+      double list_time = 0, sort_time = 0, radix_time = 0, t;
+      char *arena;
+      int ok = 1;
+      srand(n);
+      arena = make_run(n, shape, entries);
+      for (r = 0; r < reps; r++)
+      {
+        struct list_record *first = NULL;
+        unsigned long i;
+        for (i = 0; i < n; i++)
+        {
+          struct list_record *p = (struct list_record *)
+            ((char *) nodes + i * (sizeof(struct list_record) + 64));
+          memcpy(p->record, arena + entries[i].offset, entries[i].size);
+          p->next = first;
+          first = p;
+        }
+        t = now();
+        sort_linked_list(first, 0, compare_list_records, NULL, NULL);
+        list_time += now() - t;
+
+        memcpy(work, entries, n * sizeof(struct sort_entry));
+        t = now();
+        sort_entries(work, n, arena, compare_keys, NULL);
+        sort_time += now() - t;
+        ok &= check_sorted(work, n, arena);
+
+        memcpy(work, entries, n * sizeof(struct sort_entry));
+        t = now();
+        radix_sort_entries(work, n, arena, compare_keys, record_key, NULL);
+        radix_time += now() - t;
+        ok &= check_sorted(work, n, arena);
+      }
+      printf("%-7s %9lu %12.1f %12.1f %12.1f%s\n", shapes[shape], n,
+        list_time * 1e9 / (n * reps), sort_time * 1e9 / (n * reps),
+        radix_time * 1e9 / (n * reps), ok ? "" : "  UNSORTED");
+      free(arena);
+      free(entries);
+      free(work);
+      free(nodes);
+    }
+  }
+  return 0;
+}
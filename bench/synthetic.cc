@@ -0,0 +1,133 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include "synthetic.hh"
+namespace couchstore
+{
+namespace bench
+{
+bool parse_id_shape(const char* name, IdShape* shape)
+{
+  if(strcmp(name, "uuid") == 0)
+    *shape = kUuidIds;
+  else if(strcmp(name, "seq") == 0)
+    *shape = kSequentialIds;
+  else if(strcmp(name, "prefix") == 0)
+    *shape = kPrefixIds;
+  else
+    return false;
+  return true;
+}
+
+const char* id_shape_name(IdShape shape)
+{
+  switch(shape)
+  {
+    case kUuidIds:
+      return "uuid";
+    case kSequentialIds:
+      return "seq";
+    default:
+      return "prefix";
+  }
+}
+
+size_t make_id(IdShape shape, uint64_t seed, uint64_t index, char* buf)
+{
+  static const char hex[] = "0123456789abcdef";
+  //Each doc's own generator, so its ID doesn't depend on any other's.
+  uint64_t state = seed ^ (index * 0xD1B54A32D192ED03ULL);
+  switch(shape)
+  {
+    case kUuidIds:
+    {
+      uint64_t bits[2] = { next_random(&state), next_random(&state) };
+      for(int i = 0, nibble = 0; i < 36; i++)
+      {
+        if(i == 8 || i == 13 || i == 18 || i == 23)
+          buf[i] = '-';
+        else
+        {
+          buf[i] = hex[(bits[nibble / 16] >> (nibble % 16 * 4)) & 0xF];
+          nibble++;
+        }
+      }
+      return 36;
+    }
+    case kSequentialIds:
+      return sprintf(buf, "doc-%012llu", (unsigned long long) index);
+    default:
+      //An odd multiplier is a bijection on 64 bit numbers, so the IDs are
+      //unique and still look random.
+      return sprintf(buf, "session::user::%llu",
+                     (unsigned long long) ((index + seed) *
+                                           0x9E3779B97F4A7C15ULL));
+  }
+}
+
+//## Body sizes
+bool parse_sizes(const char* spec, SizeDistribution* dist)
+{
+  unsigned long a, b;
+  char tail;
+  if(sscanf(spec, "fixed:%lu%c", &a, &tail) == 1)
+  {
+    dist->kind = SizeDistribution::kFixed;
+    dist->a = dist->b = a;
+  }
+  else if(sscanf(spec, "uniform:%lu:%lu%c", &a, &b, &tail) == 2 && a <= b)
+  {
+    dist->kind = SizeDistribution::kUniform;
+    dist->a = a;
+    dist->b = b;
+  }
+  else if(sscanf(spec, "exp:%lu%c", &a, &tail) == 1 && a > 0)
+  {
+    dist->kind = SizeDistribution::kExponential;
+    dist->a = a;
+    dist->b = a * 16;
+  }
+  else
+    return false;
+  return true;
+}
+
+size_t random_size(const SizeDistribution& dist, uint64_t* state)
+{
+  switch(dist.kind)
+  {
+    case SizeDistribution::kFixed:
+      return dist.a;
+    case SizeDistribution::kUniform:
+      return dist.a + random_below(state, dist.b - dist.a + 1);
+    default:
+    {
+      double size = -log(1.0 - random_fraction(state)) * dist.a;
+      return size > dist.b ? dist.b : (size_t) size;
+    }
+  }
+}
+
+void make_body(size_t size, uint64_t* state, std::string* body)
+{
+  static const char* words[] = {
+    "alpha", "bravo", "charlie", "delta", "echo", "foxtrot", "golf", "hotel",
+    "india", "juliet", "kilo", "lima", "mike", "november", "oscar", "papa",
+    "quebec", "romeo", "sierra", "tango", "uniform", "victor", "whiskey",
+    "xray", "yankee", "zulu", "0", "1", "2", "3", "4", "5", "6", "7", "8", "9"
+  };
+  static const size_t word_count = sizeof(words) / sizeof(words[0]);
+  if(size < 8) size = 8;
+  body->assign("{\"p\":\"");
+  while(body->size() < size - 2)
+  {
+    const char* word = words[random_below(state, word_count)];
+    body->append(word, std::min(strlen(word) + 1, size - 2 - body->size()));
+    (*body)[body->size() - 1] = ' ';
+  }
+  body->append("\"}");
+}
+}
+}
@@ -0,0 +1,90 @@
+#ifndef COUCH_BENCH_SYNTHETIC_H
+#define COUCH_BENCH_SYNTHETIC_H
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+//# Synthetic documents
+//What `make_couch` fills a file with and the benchmarks sort and encode: doc
+//IDs of a few shapes that stress the ID sort differently, and bodies of a
+//chosen size distribution.
+//
+//Everything is derived from a seed with splitmix64 rather than `rand`, so the
+//same options give the same file, byte for byte, on any machine, and numbers
+//from different machines are at least measuring the same work. A doc's ID
+//depends only on the seed and its index, so updates and deletes can name
+//docs without keeping a list of IDs.
+namespace couchstore
+{
+namespace bench
+{
+//Longest ID any shape makes.
+static const size_t kMaxIdSize = 48;
+
+//The next number from a splitmix64 generator whose state is `*state`.
+inline uint64_t next_random(uint64_t* state)
+{
+  uint64_t z = (*state += 0x9E3779B97F4A7C15ULL);
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+  return z ^ (z >> 31);
+}
+
+//A random number below `n`.
+inline uint64_t random_below(uint64_t* state, uint64_t n)
+{
+  return n ? next_random(state) % n : 0;
+}
+
+//A random number in [0, 1).
+inline double random_fraction(uint64_t* state)
+{
+  return (next_random(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+//## IDs
+enum IdShape {
+  //Random 36 character UUIDs: the 8 byte prefix settles nearly every
+  //comparison, and `by_seq` order says nothing about ID order.
+  kUuidIds,
+  //"doc-" and a zero-padded counter, increasing with the seq: the sorter
+  //sees them already in order.
+  kSequentialIds,
+  //"session::user::" and a scrambled number: every prefix ties, so sorting
+  //falls through to the whole key.
+  kPrefixIds
+};
+
+//The shape called `name` (uuid, seq or prefix). Returns false if there's no
+//such shape.
+bool parse_id_shape(const char* name, IdShape* shape);
+const char* id_shape_name(IdShape shape);
+//Write doc `index`'s ID into `buf`, which has room for `kMaxIdSize` bytes, and
+//return its size.
+size_t make_id(IdShape shape, uint64_t seed, uint64_t index, char* buf);
+
+//## Body sizes
+struct SizeDistribution {
+  enum Kind {
+    kFixed,
+    kUniform,
+    kExponential
+  };
+  SizeDistribution() : kind(kFixed), a(1024), b(1024) { }
+  Kind kind;
+  //The size (fixed), the bounds (uniform), or the mean (exponential, which
+  //is capped at `b`, 16 times the mean).
+  size_t a;
+  size_t b;
+};
+
+//Set `dist` from `spec`: `fixed:N`, `uniform:MIN:MAX` or `exp:MEAN`. Returns
+//false if it doesn't parse.
+bool parse_sizes(const char* spec, SizeDistribution* dist);
+size_t random_size(const SizeDistribution& dist, uint64_t* state);
+//A JSON object of `size` bytes (at least 8), of words picked at random from
+//a small vocabulary, so snappy has something, but not everything, to
+//squeeze out of it, as with real documents.
+void make_body(size_t size, uint64_t* state, std::string* body);
+}
+}
+#endif
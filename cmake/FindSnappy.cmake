@@ -0,0 +1,6 @@
+include(LibFindMacros)
+find_path(Snappy_INCLUDE_DIR snappy-c.h)
+find_library(Snappy_LIBRARY snappy)
+set(Snappy_PROCESS_INCLUDES Snappy_INCLUDE_DIR)
+set(Snappy_PROCESS_LIBS Snappy_LIBRARY)
+libfind_process(Snappy)
@@ -2,153 +2,167 @@
 #include <string.h>
 #include <signal.h>
 #include "btree_copy.hh"
+#include "node_compressor.hh"
+#include "metrics.hh"
 #include <ei.h>
 #include <libcouchstore/couch_db.h>
 #include <list>
 #include <utility>
 namespace couchstore
 {
+char* NodeArena::reserve(size_t n)
+{
+  if(used_ + n > capacity_)
+  {
+    size_t capacity = capacity_ ? capacity_ : 4096;
+    while(capacity < used_ + n)
+      capacity *= 2;
+    char* buf = static_cast<char*>(realloc(buf_, capacity));
+    if(buf == NULL) return NULL;
+    buf_ = buf;
+    capacity_ = capacity;
+  }
+  return buf_ + used_;
+}
+
+//## Adding items
+bool NodeBuilderBase::appendItem(size_t key_size, size_t value_size)
+{
+  //The key and value are already raw erlang terms, so the item just needs the
+  //header of the tuple holding them.
+  term::Tuple<2>::put(arena_.data() + arena_.used());
+  last_key_ = arena_.used() + kItemHeader;
+  last_key_size_ = key_size;
+  arena_.commit(kItemHeader + key_size + value_size);
+  items_++;
+  nodesize_ += key_size + value_size + 2;
+  //A pointer node always takes at least two pointers, however small its
+  //limit, or the levels above the leaves would never narrow to a root.
+  return nodesize_ > limit_ && (type_ == kKVNode || items_ > 1);
+}
+
+int NodeBuilderBase::appendItems(NodeBuilderBase& other)
+{
+  size_t len = other.arena_.used() - kNodeHeader;
+  if(len == 0) return 0;
+  char* buf = arena_.reserve(len);
+  if(buf == NULL) return ERROR_ALLOC_FAIL;
+  memcpy(buf, other.arena_.data() + kNodeHeader, len);
+  last_key_ = arena_.used() + other.last_key_ - kNodeHeader;
+  last_key_size_ = other.last_key_size_;
+  arena_.commit(len);
+  items_ += other.items_;
+  nodesize_ += other.nodesize_;
+  subtreesize_ += other.subtreesize_;
+  return 0;
+}
+
+//A compressed-size limit is turned into an encoded size by the compression
+//ratio of the nodes written so far, or taken as is until there are some.
+void NodeBuilderBase::updateLimit()
+{
+  const NodeLimit& limit = type_ == kKVNode ? sizing_.leaf : sizing_.interior;
+  const NodeBytes& bytes = type_ == kKVNode ? leaf_bytes_ : interior_bytes_;
+  limit_ = limit.bytes;
+  if(limit.compressed && bytes.compressed > 0)
+    limit_ = limit.bytes * bytes.raw / bytes.compressed;
+}
+
 //## Writing out a node
-int NodeBuilder::flush()
+int NodeBuilderBase::writeNode(const shared_ptr<NodePointerBase>& pointer)
 {
-  if(nodesize_ == 0) return 0;
-  //The size of a BTree node is the sum of the size of the KV/KP Pairs, plus
-  //the size of a tuple header and 7 byte atom (_kv\_node_ or _kp\_node_), a list header
-  //and list tail, and an Erlang term version byte.
-  Buffer nodebuf(nodesize_ + 19);
-  int bufpos = 0;
-  ei_encode_version(nodebuf.buf, &bufpos);
-  ei_encode_tuple_header(nodebuf.buf, &bufpos, 2);
+  //The node's items are already in the arena, so put the rest of the node
+  //around them: an Erlang term version byte, a tuple header and 7 byte atom
+  //(_kv\_node_ or _kp\_node_) and a list header in front, and the list tail
+  //after.
+  char header[kNodeHeader];
+  int header_size = 0;
+  ei_encode_version(header, &header_size);
+  ei_encode_tuple_header(header, &header_size, 2);
   if(type_ == kKVNode)
-    ei_encode_atom_len(nodebuf.buf, &bufpos, "kv_node", 7);
+    ei_encode_atom_len(header, &header_size, "kv_node", 7);
+  else
+    ei_encode_atom_len(header, &header_size, "kp_node", 7);
+  ei_encode_list_header(header, &header_size, items_);
+  char* tail = arena_.reserve(1);
+  if(tail == NULL) return ERROR_ALLOC_FAIL;
+  int tail_size = 0;
+  ei_encode_empty_list(tail, &tail_size);
+  arena_.commit(tail_size);
+  sized_buf nodebuf;
+  nodebuf.buf = arena_.data() + kNodeHeader - header_size;
+  nodebuf.size = arena_.used() - (kNodeHeader - header_size);
+  memcpy(nodebuf.buf, header, header_size);
+  //Write the node to disk, compressed with snappy, here or on the
+  //compressor's threads.
+  int error = 0;
+  NodeBytes* bytes = type_ == kKVNode ? &leaf_bytes_ : &interior_bytes_;
+  if(compressor_)
+  {
+    pointer->placed_ = false;
+    error = compressor_->submit(&nodebuf, pointer, type_, bytes);
+  }
   else
-    ei_encode_atom_len(nodebuf.buf, &bufpos, "kp_node", 7);
-  // ### Encode the item list
-  ei_encode_list_header(nodebuf.buf, &bufpos, items_.size());
-  for(std::vector<KVPair>::iterator it = items_.begin(); it != items_.end(); ++it)
   {
-    //Encode the Key/Value pair as an erlang tuple. The Key and Value are
-    //already raw erlang terms, so we just need to write a tuple header, then
-    //the two terms.
-    ei_encode_tuple_header(nodebuf.buf, &bufpos, 2);
-    memcpy(nodebuf.buf + bufpos, (*it).first->buf, (*it).first->size);
-    bufpos += (*it).first->size;
-    memcpy(nodebuf.buf + bufpos, (*it).second->buf, (*it).second->size);
-    bufpos += (*it).second->size;
+    off_t write_position;
+    size_t compressed_size;
+    error = writer_->write_compressed(&nodebuf, &write_position,
+                                      &compressed_size);
+    pointer->pointer_ = write_position;
+    bytes->raw += nodebuf.size;
+    bytes->compressed += compressed_size;
+    if(!error)
+      Metrics::get().node(type_ == kKVNode, nodebuf.size, compressed_size);
   }
-  ei_encode_empty_list(nodebuf.buf, &bufpos);
-  nodebuf.size = bufpos;
-  off_t write_position;
-  //Write the node to disk, compressed with snappy.
-  if(db_write_buf_compressed(db_, &nodebuf, &write_position) < 0)
-    return ERROR_WRITE;
-  //Create the node pointer
-  pointers_.push_back(shared_ptr<NodePointer>
-                      (new NodePointer(write_position, reduce_->clone(),
-                                       subtreesize_ + nodesize_ + 19,
-                                       items_.back().first)));
+  if(error) return error;
   subtreesize_ = 0;
   nodesize_ = 0;
-  items_.clear();
-  pointer_items_.clear();
-  reduce_->reset();
+  clear();
+  updateLimit();
   return 0;
 }
 
-int NodePointer::encodedSize()
+int NodeBuilderBase::drain()
 {
-  char dummy[10];
-  memset(dummy, 0, 10);
-  //Size of the reduce value term plus a tuple header.
-  int size = 2 + encoded_reduce_->size;
-  int pos = 0;
-  ei_encode_ulonglong(dummy, &pos, pointer_);
-  size += pos;
-  pos = 0;
-  ei_encode_ulonglong(dummy, &pos, subtreesize_);
-  return size + pos;
+  return compressor_ ? compressor_->drain() : 0;
 }
 
-void NodePointer::encode(char* buf)
+node_pointer* NodePointerBase::newRoot(size_t reduce_size)
 {
-  int pos = 0;
-  ei_encode_tuple_header(buf, &pos, 3);
-  ei_encode_ulonglong(buf, &pos, pointer_);
-  memcpy(buf + pos, encoded_reduce_->buf, encoded_reduce_->size);
-  pos += encoded_reduce_->size;
-  ei_encode_ulonglong(buf, &pos, subtreesize_);
+  node_pointer* root = (node_pointer*) malloc(sizeof(node_pointer) +
+                                              reduce_size);
+  root->key.buf = NULL;
+  root->key.size = 0;
+  root->reduce_value.size = reduce_size;
+  root->reduce_value.buf = ((char*) root + sizeof(node_pointer));
+  root->pointer = pointer_;
+  root->subtreesize = subtreesize_;
+  return root;
 }
 
-void NodePointer::setAsRoot(node_pointer** root)
+//## Comparing seqs
+int seq_cmp(void* k1, void* k2)
 {
-  sized_buf* reduce = reduce_value_->encode();
-  *root = (node_pointer*) malloc(sizeof(node_pointer) + reduce->size);
-  (*root)->key.buf = NULL;
-  (*root)->key.size = 0;
-  (*root)->reduce_value.size = reduce->size;
-  (*root)->reduce_value.buf = ((char*) (*root) + sizeof(node_pointer));
-  memcpy((*root)->reduce_value.buf, reduce->buf, reduce->size);
-  (*root)->pointer = pointer_;
-  (*root)->subtreesize = subtreesize_;
+  uint64_t s1 = *static_cast<uint64_t*>(k1);
+  uint64_t s2 = *static_cast<uint64_t*>(k2);
+  if(s1 < s2) return -1;
+  if(s1 > s2) return 1;
+  return 0;
 }
-//## Creating the pointer nodes.
-//Once we've written out all of the leaf _kv\_node_s, we create layers of
-//pointer nodes in the same manner: collect enough pointers to write out a node,
-//then write it out to disk, saving a pointer to it, and repeat until the result
-//list of pointers has only a single pointer in it, then save that pointer into
-//the DB header.
-shared_ptr<NodePointer> build_pointers(NodeBuilder& builder)
+
+void* seq_from_ext(compare_info* c, char* buf, int pos)
 {
-  NodeBuilder builder_2(builder.db_, builder.reduce_, kKPNode);
-  builder.setType(kKPNode);
-  shared_ptr<NodePointer> final;
-  while(true)
-  {
-    builder.dumpPointers(builder_2);
-    builder_2.flush();
-    if(builder_2.pointers()->size() > 1)
-    {
-      builder_2.dumpPointers(builder);
-      builder.flush();
-      if(builder.pointers()->size() > 1)
-        continue;
-      else
-      {
-        final = builder.pointers()->front();
-        break;
-      }
-    } else
-    {
-      final = builder_2.pointers()->front();
-      break;
-    }
-  }
-  return final;
+  unsigned long long seq = 0;
+  ei_decode_ulonglong(buf, &pos, &seq);
+  *static_cast<uint64_t*>(c->arg) = seq;
+  return c->arg;
 }
 
 //## Callback functions for on-disk merge sort
-//We need to sort the temporary file of DocInfos we created while scanning the
-//`by_seq` index by ID, so we can create a `by_id` index.
+//We need to sort the DocInfos we collect while scanning the `by_seq` index by
+//ID, so we can create a `by_id` index.
 //
 //Using [this on-disk sort implementation](http://www.efgh.com/software/mergesor.htm)
-int read_diskdocinfo(FILE* fp, void* buffer, void* ctx)
-{
-  disk_docinfo* info = (disk_docinfo*) buffer;
-  int read = fread(buffer, sizeof(disk_docinfo), 1, fp);
-  if(read < 1) return 0;
-  int rest = fread((char*) buffer + sizeof(disk_docinfo),
-                   info->len - sizeof(disk_docinfo), 1, fp);
-  if(rest < 1) return 0;
-  return info->len;
-}
-
-int write_diskdocinfo(FILE* fp, void* buffer, void* ctx)
-{
-  disk_docinfo* info = (disk_docinfo*) buffer;
-  /* printf("Write info with id %.*s\n", info->id_len, (char*) buffer + sizeof(disk_docinfo)); */
-  return fwrite(buffer, info->len, 1, fp);
-}
-
 int compare_diskdocinfo(void* d1, void* d2, void* ctx)
 {
   disk_docinfo* if1 = (disk_docinfo*) d1;
@@ -174,4 +188,26 @@ int compare_diskdocinfo(void* d1, void* d2, void* ctx)
   }
   return cmp;
 }
+
+unsigned long long prefix_diskdocinfo(void* d, void* ctx)
+{
+  disk_docinfo* info = (disk_docinfo*) d;
+  unsigned char bytes[8] = { 0 };
+  memcpy(bytes, (char*) d + sizeof(disk_docinfo),
+         info->id_len < 8 ? info->id_len : 8);
+  return ((unsigned long long) bytes[0] << 56) |
+         ((unsigned long long) bytes[1] << 48) |
+         ((unsigned long long) bytes[2] << 40) |
+         ((unsigned long long) bytes[3] << 32) |
+         ((unsigned long long) bytes[4] << 24) |
+         ((unsigned long long) bytes[5] << 16) |
+         ((unsigned long long) bytes[6] << 8) |
+         (unsigned long long) bytes[7];
+}
+
+const unsigned char* key_diskdocinfo(void* d, unsigned* length, void* ctx)
+{
+  *length = ((disk_docinfo*) d)->id_len;
+  return (unsigned char*) d + sizeof(disk_docinfo);
+}
 }
@@ -1,9 +1,14 @@
 #ifndef COUCH_BTREE_COPY_H
 #define COUCH_BTREE_COPY_H
 #include <libcouchstore/couch_common.h>
+#include <libcouchstore/couch_btree.h>
+#include <string.h>
+#include <deque>
 #include <utility>
 #include <vector>
 #include "wrap.hh"
+#include "term_encode.hh"
+#include "chunk_writer.hh"
 #include <tr1/memory>
 #define SHARED_PTR_NS std::tr1
 //# B-tree Copy
@@ -12,10 +17,9 @@
 namespace couchstore
 {
 using SHARED_PTR_NS::shared_ptr;
+class NodeCompressor;
 static const uint64_t kChunkThreshold = 1279;
 typedef shared_ptr<Buffer> BufPtr;
-typedef std::pair<BufPtr, BufPtr> KVPair;
-typedef std::vector<KVPair> KVVec;
 
 enum NodeType{
   kKVNode,
@@ -38,45 +42,75 @@ struct disk_docinfo {
 };
 #pragma pack()
 
-//## Reduce function interface.
-class Reduce {
+//## Reduce policies
+//`NodeBuilder` and `NodePointer` are templated on the tree's reduce, `R`, a
+//value type (see reduces.hh) with:
+//
+// * `R::Item`, whatever the reduce needs of a leaf item besides its encoded
+//   key and value, passed in with the item;
+// * `add(const R::Item&)`, for each item added to a leaf node;
+// * `add(const R&)`, for each pointer added to a pointer node, with the
+//   reduce of the node it points to;
+// * `reset()`, starting a new node;
+// * `encodedSize()` and `encode(buf)`, writing the reduce value as an Erlang
+//   term and returning its end.
+//
+//Reduces are copied around by value and called directly, so for the ones we
+//have, adding up a node's reduce is a few inlined additions.
+template<class R> class NodeBuilder;
+
+//## Node Pointer for Copying B-tree
+//We use this instead of the regular couchstore node\_pointer so we can keep
+//the non-serialized version of the reduce around, so that our reduces don't
+//have to do erlang term parsing. Everything but the reduce is here, so the
+//`NodeCompressor` can place a node without knowing its tree's reduce.
+class NodePointerBase {
  public:
-  //Reduce called adding a kv pair to a leaf node
-  virtual void operator()(KVPair& kv_pair) = 0;
-  //Reduce called adding a pointer to a pointer node
-  virtual void operator()(Reduce* reduce) = 0;
-  //Clone the reduce value (the internal accumulators, but not any temporary
-  //buffer used for encoding) so that it can be added to a NodePointer and
-  //rereduced over.
-  virtual Reduce* clone() = 0;
-  //Encode reduce value as a sized_buf (will not need more than one result from
-  //this at a time, so it's okay to use a single buffer to return this)
-  virtual sized_buf* encode() = 0;
-  //Clear the reduce's accumulators (starting a new node)
-  virtual void reset() = 0;
-  virtual ~Reduce() { };
+  //The node was written in a region starting at `from`, which has since been
+  //copied to `to`.
+  void rebase(uint64_t from, uint64_t to) {
+    pointer_ = pointer_ - from + to;
+  }
+  //Where the node is in the file, once it's been placed.
+  uint64_t pointer() const {
+    return pointer_;
+  }
  protected:
-  Reduce() { }
+  friend class NodeBuilderBase;
+  friend class NodeCompressor;
+  template<class> friend class NodeBuilder;
+  NodePointerBase(uint64_t pointer, uint64_t subtreesize, BufPtr key) :
+    pointer_(pointer), placed_(true), subtreesize_(subtreesize), key_(key) { }
+  //A couchstore `node_pointer` for this node with room after it for a
+  //`reduce_size` byte reduce value, to go in the DB header.
+  node_pointer* newRoot(size_t reduce_size);
+  uint64_t pointer_;
+  //False while the node is still waiting to be compressed and written, and
+  //`pointer_` isn't known.
+  bool placed_;
+  uint64_t subtreesize_;
+  BufPtr key_;
  private:
-  DISALLOW_COPY_AND_ASSIGN(Reduce);
+  DISALLOW_COPY_AND_ASSIGN(NodePointerBase);
 };
 
-//## Node Pointer for Copying B-tree
-//We use this instead of the regular couchstore node\_pointer so we can keep
-//the non-serialized version of the reduce around, so that our Reduces don't
-//have to do erlang term parsing.
-class NodePointer {
+template<class R>
+class NodePointer : public NodePointerBase {
  public:
-  NodePointer(uint64_t pointer, Reduce* reduceval, uint64_t subtreesize, BufPtr key) :
-      pointer_(pointer), reduce_value_(reduceval),
-      subtreesize_(subtreesize), key_(key) {
-        encoded_reduce_ = reduce_value_->encode();
-      }
-  ~NodePointer() {
-    delete reduce_value_;
+  NodePointer(uint64_t pointer, const R& reduce, uint64_t subtreesize,
+              BufPtr key) :
+      NodePointerBase(pointer, subtreesize, key), reduce_(reduce) { }
+  //_{Pointer, Reduce, SubtreeSize}_
+  size_t encodedSize() const {
+    return term::Tuple<3>::size + term::ulonglong_size(pointer_) +
+           reduce_.encodedSize() + term::ulonglong_size(subtreesize_);
+  }
+  char* encode(char* buf) const {
+    buf = term::Tuple<3>::put(buf);
+    buf = term::put_ulonglong(buf, pointer_);
+    buf = reduce_.encode(buf);
+    return term::put_ulonglong(buf, subtreesize_);
   }
-  void encode(char* buf);
-  int encodedSize();
   void makeBySeqRoot(DBHandle &db) {
     setAsRoot(&(db.get()->header.by_seq_root));
   }
@@ -86,59 +120,240 @@ class NodePointer {
   void makeLocalDocsRoot(DBHandle &db) {
     setAsRoot(&(db.get()->header.local_docs_root));
   }
- protected:
-  friend class NodeBuilder;
-  uint64_t pointer_;
-  sized_buf* encoded_reduce_;
-  Reduce* reduce_value_;
-  uint64_t subtreesize_;
-  BufPtr key_;
  private:
-  void setAsRoot(node_pointer**);
-  DISALLOW_COPY_AND_ASSIGN(NodePointer);
+  template<class> friend class NodeBuilder;
+  //Replaces (and frees) any root already there.
+  void setAsRoot(node_pointer** root) {
+    free(*root);
+    *root = newRoot(reduce_.encodedSize());
+    reduce_.encode((*root)->reduce_value.buf);
+  }
+  R reduce_;
+};
+
+//## Node arena
+//Bump allocator for the bytes of the node being built. It only ever grows,
+//and is emptied rather than freed each time a node is written, so once it's
+//big enough for a node, building more nodes doesn't touch the heap.
+class NodeArena {
+ public:
+  NodeArena() : buf_(NULL), capacity_(0), used_(0) { }
+  ~NodeArena() {
+    free(buf_);
+  }
+  //Room for `n` more bytes after those in use, or NULL if out of memory. Only
+  //good until the next `reserve`, which may move everything.
+  char* reserve(size_t n);
+  void commit(size_t n) {
+    used_ += n;
+  }
+  char* data() {
+    return buf_;
+  }
+  size_t used() {
+    return used_;
+  }
+  //Drop everything but the first `keep` bytes.
+  void reset(size_t keep) {
+    used_ = keep;
+  }
+ private:
+  char* buf_;
+  size_t capacity_;
+  size_t used_;
+  DISALLOW_COPY_AND_ASSIGN(NodeArena);
+};
+
+//## Node sizing
+//When a node is full: once its items come to more than `bytes`, either as
+//encoded or, if `compressed`, as they're expected to be once compressed,
+//going by how well the tree's nodes of the same kind have compressed so far.
+struct NodeLimit {
+  NodeLimit(uint64_t bytes = kChunkThreshold, bool compressed = false)
+      : bytes(bytes), compressed(compressed) { }
+  uint64_t bytes;
+  bool compressed;
+};
+
+//Limits for one tree's leaf (`kv_node`) and interior (`kp_node`) nodes.
+struct NodeSizing {
+  NodeLimit leaf;
+  NodeLimit interior;
+};
+
+//Bytes of a builder's nodes written so far, before and after compression.
+struct NodeBytes {
+  NodeBytes() : raw(0), compressed(0) { }
+  uint64_t raw;
+  uint64_t compressed;
 };
 
 //## B-tree Node Builder
 //This class is responsible for the collection of K/V pairs in a B-Tree node
-//(both `kv_node`s and `kp_node`s), and writing out the node once the size it
-//would be before compression passes `kChunkThreshold`
-class NodeBuilder {
+//(both `kv_node`s and `kp_node`s), and writing out the node once it passes
+//the limit its `NodeSizing` sets for its type (by default, `kChunkThreshold`
+//bytes before compression).
+//
+//Items are encoded straight into the node's arena, each with its tuple header
+//in front, just as they'll be written, after room for the node's own header.
+//Writing the node out is then just filling in that header.
+//
+//`NodeBuilderBase` is the part that doesn't depend on the reduce: the node's
+//bytes, how full it is, and writing it out. `NodeBuilder` adds the reduce and
+//what's done with the pointers to the nodes written.
+class NodeBuilderBase {
+ public:
+  //Encode an item in place: `newItem` returns room for up to `max_size` bytes
+  //of key and value terms, to be written there back to back, then passed to
+  //`commitItem` with their sizes.
+  char* newItem(size_t max_size) {
+    char* item = arena_.reserve(max_size + kItemHeader);
+    return item ? item + kItemHeader : NULL;
+  }
+  void setType(NodeType type)
+  {
+    type_ = type;
+    updateLimit();
+  }
+  void setSizing(const NodeSizing& sizing) {
+    sizing_ = sizing;
+    updateLimit();
+  }
+  //Have nodes compressed and written by `compressor`, which must write to
+  //this builder's `ChunkWriter`. Their pointers' positions are then only
+  //good after a `drain`.
+  void setCompressor(NodeCompressor* compressor) {
+    compressor_ = compressor;
+  }
+  //Wait for every node flushed so far to be written.
+  int drain();
+ protected:
+  NodeBuilderBase(ChunkWriter* writer, NodeType type) : nodesize_(0),
+    writer_(writer), compressor_(NULL), type_(type), limit_(kChunkThreshold),
+    subtreesize_(0), streaming_(false), written_(0) { clear(); }
+  ~NodeBuilderBase() { }
+  //The header of the 2-tuple each item is.
+  static const size_t kItemHeader = term::Tuple<2>::size;
+  //Room kept at the front of the arena for the node's header.
+  static const size_t kNodeHeader = 32;
+  void clear() {
+    arena_.reset(kNodeHeader);
+    items_ = 0;
+  }
+  //Take the item just encoded into the node. Returns true if that fills it.
+  bool appendItem(size_t key_size, size_t value_size);
+  //Take a copy of the items `other` has collected, after any already here.
+  int appendItems(NodeBuilderBase& other);
+  //The node's last key, which the pointer to it is keyed by.
+  BufPtr lastKey() {
+    return BufPtr(new Buffer(arena_.data() + last_key_, last_key_size_));
+  }
+  //Write out the items collected so far as a node, with `pointer` set to
+  //where it goes (once it's placed, if it goes through the compressor), and
+  //start a new one.
+  int writeNode(const shared_ptr<NodePointerBase>& pointer);
+  //Write to the same file in the same way as `other`.
+  void configureLike(const NodeBuilderBase& other) {
+    compressor_ = other.compressor_;
+    sizing_ = other.sizing_;
+    updateLimit();
+  }
+  //Work out `limit_` for the current node type.
+  void updateLimit();
+  uint64_t nodesize_;
+  ChunkWriter* writer_;
+  NodeCompressor* compressor_;
+  NodeType type_;
+  NodeSizing sizing_;
+  //Encoded size past which the node is full.
+  uint64_t limit_;
+  //What's been written of each type of node, for estimating compression.
+  NodeBytes leaf_bytes_;
+  NodeBytes interior_bytes_;
+  NodeArena arena_;
+  size_t items_;
+  //Where the last item's key is in the arena.
+  size_t last_key_;
+  size_t last_key_size_;
+  uint64_t subtreesize_;
+  bool streaming_;
+  //Nodes written at this level.
+  uint64_t written_;
+ private:
+  DISALLOW_COPY_AND_ASSIGN(NodeBuilderBase);
+};
+
+template<class R>
+class NodeBuilder : public NodeBuilderBase {
  public:
-  NodeBuilder(Db* db, Reduce* reduce) : nodesize_(0), db_(db), reduce_(reduce),
-    type_(kKVNode), subtreesize_(0) { }
-  NodeBuilder(Db* db, Reduce* reduce, NodeType type) : nodesize_(0), db_(db),
-    reduce_(reduce), type_(type), subtreesize_(0) { }
-  ~NodeBuilder() { }
-  int addItem(KVPair kv_pair) {
-    (*reduce_)(kv_pair);
-    items_.push_back(kv_pair);
-    nodesize_ += kv_pair.first->size + kv_pair.second->size + 2;
-    if(nodesize_ > kChunkThreshold)
-      return flush();
-    else
-      return 0;
-  }
-  int addItem(shared_ptr<NodePointer> ptr) {
-    (*reduce_)(ptr->reduce_value_);
-    pointer_items_.push_back(ptr);
-    BufPtr value (new Buffer(ptr->encodedSize()));
-    ptr->encode(value->buf);
-    items_.push_back(KVPair(ptr->key_, value));
-    nodesize_ += ptr->key_->size + value->size + 2;
+  typedef typename R::Item Item;
+  typedef NodePointer<R> Pointer;
+  typedef shared_ptr<Pointer> PointerPtr;
+  NodeBuilder(ChunkWriter* writer, NodeType type = kKVNode) :
+    NodeBuilderBase(writer, type), parent_(NULL) { }
+  //Nodes still with the compressor are written before the builder goes.
+  ~NodeBuilder() {
+    drain();
+    delete parent_;
+  }
+  //Add a K/V pair whose key and value are already encoded as terms.
+  int addItem(const sized_buf& key, const sized_buf& value,
+              const Item& item = Item()) {
+    char* buf = newItem(key.size + value.size);
+    if(buf == NULL) return ERROR_ALLOC_FAIL;
+    memcpy(buf, key.buf, key.size);
+    memcpy(buf + key.size, value.buf, value.size);
+    return commitItem(key.size, value.size, item);
+  }
+  //Take an item written at `newItem`.
+  int commitItem(size_t key_size, size_t value_size,
+                 const Item& item = Item()) {
+    reduce_.add(item);
+    return appendItem(key_size, value_size) ? flush() : 0;
+  }
+  int addItem(const PointerPtr& ptr) {
+    size_t size = ptr->encodedSize();
+    char* item = newItem(ptr->key_->size + size);
+    if(item == NULL) return ERROR_ALLOC_FAIL;
+    memcpy(item, ptr->key_->buf, ptr->key_->size);
+    ptr->encode(item + ptr->key_->size);
+    reduce_.add(ptr->reduce_);
     subtreesize_ += ptr->subtreesize_;
-    if(nodesize_ > kChunkThreshold)
-      return flush();
-    else
-      return 0;
+    return appendItem(ptr->key_->size, size) ? flush() : 0;
   }
   //`flush` writes the items collected so far as a node and adds a pointer to
-  //it to the pointers list.
+  //it to the pointers list (or, streaming, passes it up to the next level).
   int flush();
+  //Take a pointer to a node written elsewhere, in its place after the nodes
+  //flushed so far, as if this builder had written it.
+  int adoptPointer(const PointerPtr& ptr) {
+    return addPointer(ptr);
+  }
+  //### Streaming
+  //By default a builder keeps a pointer to every node it writes, for
+  //`build_pointers` to build the levels above once all the items are in. A
+  //streaming builder instead hands each pointer straight to a builder for the
+  //level above it, which does the same in turn, so only one node per level
+  //(and the pointers the compressor still has) is ever held, however big the
+  //tree. The tree comes out the same as `build_pointers` would make it.
+  //
+  //Must be set before any items are added.
+  void setStreaming() {
+    streaming_ = true;
+  }
+  //Write out what's left at every level and set `*root` to the pointer to the
+  //root, or to NULL if the tree is empty.
+  int finishTree(PointerPtr* root);
+  //Write a pointer node over every item added so far, without disturbing the
+  //tree still being built, and set `*root` to the pointer to it, or to NULL
+  //if nothing's been added. Called on a streaming builder's leaf level.
+  int writeFrontier(PointerPtr* root);
   //`dumpPointers` moves all the pointers this NodeBuilder has generated to
   //another NodeBuilder's item list (generating pointer nodes)
   int dumpPointers(NodeBuilder& builder) {
-    int error = 0;
-    for(std::vector<shared_ptr<NodePointer> >::iterator it = pointers_.begin();
+    int error = drain();
+    if(error) return error;
+    for(typename std::vector<PointerPtr>::iterator it = pointers_.begin();
         it != pointers_.end(); ++it)
     {
       error = builder.addItem(*it);
@@ -147,34 +362,194 @@ class NodeBuilder {
     pointers_.clear();
     return error;
   }
-  std::vector<shared_ptr<NodePointer> >* pointers() {
+  std::vector<PointerPtr>* pointers() {
     return &pointers_;
   }
-  void setType(NodeType type)
-  {
-    type_ = type;
-  }
- protected:
-  friend shared_ptr<NodePointer> build_pointers(NodeBuilder&);
-  uint64_t nodesize_;
-  Db* db_;
-  Reduce* reduce_;
-  NodeType type_;
-  std::vector<KVPair> items_;
-  std::vector<shared_ptr<NodePointer> > pointers_;
-  std::vector<shared_ptr<NodePointer> > pointer_items_;
-  uint64_t subtreesize_;
  private:
+  template<class T> friend shared_ptr<NodePointer<T> >
+      build_pointers(NodeBuilder<T>&);
+  //Pass a flushed node's pointer on.
+  int addPointer(const PointerPtr& ptr);
+  int promote();
+  R reduce_;
+  std::vector<PointerPtr> pointers_;
+  //The level above, streaming, once this level has written a node.
+  NodeBuilder* parent_;
+  //Pointers not yet passed up: those whose nodes the compressor hasn't
+  //placed, and a pointer node level's first, until it's clear it won't be
+  //the root.
+  std::deque<PointerPtr> waiting_;
   DISALLOW_COPY_AND_ASSIGN(NodeBuilder);
 };
 
-shared_ptr<NodePointer> build_pointers(NodeBuilder& builder);
+//## Writing out a node
+//The pointer's subtree size counts the node's chunk header and the few bytes
+//of node header around its items.
+template<class R>
+int NodeBuilder<R>::flush()
+{
+  if(nodesize_ == 0) return 0;
+  PointerPtr pointer(new Pointer(0, reduce_, subtreesize_ + nodesize_ + 19,
+                                 lastKey()));
+  int error = writeNode(pointer);
+  if(error) return error;
+  reduce_.reset();
+  return addPointer(pointer);
+}
+
+//## Streaming the levels above
+template<class R>
+int NodeBuilder<R>::addPointer(const PointerPtr& ptr)
+{
+  written_++;
+  if(!streaming_)
+  {
+    pointers_.push_back(ptr);
+    return 0;
+  }
+  waiting_.push_back(ptr);
+  return promote();
+}
+
+//Pass waiting pointers up to the level above, in order, as far as the first
+//whose node isn't placed yet. A pointer node level holds on to its first
+//pointer until it has a second, since if it never does, that's the root.
+//(Leaf levels always get a pointer node above them, even if there's only
+//one leaf, just as with `build_pointers`.)
+template<class R>
+int NodeBuilder<R>::promote()
+{
+  if(type_ == kKPNode && written_ < 2)
+    return 0;
+  while(!waiting_.empty() && waiting_.front()->placed_)
+  {
+    if(parent_ == NULL)
+    {
+      parent_ = new NodeBuilder(writer_, kKPNode);
+      parent_->configureLike(*this);
+      parent_->setStreaming();
+    }
+    int error = parent_->addItem(waiting_.front());
+    waiting_.pop_front();
+    if(error) return error;
+  }
+  return 0;
+}
+
+template<class R>
+int NodeBuilder<R>::finishTree(PointerPtr* root)
+{
+  root->reset();
+  int error = flush();
+  if(!error) error = drain();
+  if(error) return error;
+  if(type_ == kKPNode && written_ == 1)
+  {
+    *root = waiting_.front();
+    waiting_.clear();
+    return 0;
+  }
+  error = promote();
+  if(error || parent_ == NULL) return error;
+  return parent_->finishTree(root);
+}
+
+//### The frontier
+//Between them, the levels hold on to everything not yet under a written
+//pointer node: the pointers each is waiting to pass up, and the items of the
+//pointer node each is filling. From the top level down, those cover every
+//leaf in key order (each level's come after everything above it), so one
+//node of all of them is the root of a tree of what's been added so far. It
+//isn't balanced, but couchstore's B-tree code doesn't need it to be.
+//
+//The leaf in progress is written out first, and the node is written
+//straight through the `ChunkWriter`, once everything under it is in place.
+template<class R>
+int NodeBuilder<R>::writeFrontier(PointerPtr* root)
+{
+  root->reset();
+  int error = flush();
+  if(!error) error = drain();
+  if(error) return error;
+  std::vector<NodeBuilder*> levels;
+  for(NodeBuilder* level = this; level != NULL; level = level->parent_)
+    levels.push_back(level);
+  NodeBuilder frontier(writer_, kKPNode);
+  //All in the one node, however many items that comes to.
+  frontier.limit_ = ~(uint64_t) 0;
+  for(typename std::vector<NodeBuilder*>::reverse_iterator it =
+          levels.rbegin(); it != levels.rend() && !error; ++it)
+  {
+    NodeBuilder* level = *it;
+    for(typename std::deque<PointerPtr>::iterator ptr =
+            level->waiting_.begin();
+        ptr != level->waiting_.end() && !error; ++ptr)
+      error = frontier.addItem(*ptr);
+    if(!error)
+      error = frontier.appendItems(*level);
+    frontier.reduce_.add(level->reduce_);
+  }
+  if(error || frontier.items_ == 0) return error;
+  error = frontier.flush();
+  if(!error)
+    *root = frontier.pointers_.front();
+  return error;
+}
+
+//## Creating the pointer nodes.
+//Once we've written out all of the leaf _kv\_node_s, we create layers of
+//pointer nodes in the same manner: collect enough pointers to write out a node,
+//then write it out to disk, saving a pointer to it, and repeat until the result
+//list of pointers has only a single pointer in it, then save that pointer into
+//the DB header.
+template<class R>
+shared_ptr<NodePointer<R> > build_pointers(NodeBuilder<R>& builder)
+{
+  NodeBuilder<R> builder_2(builder.writer_, kKPNode);
+  builder_2.configureLike(builder);
+  builder.setType(kKPNode);
+  shared_ptr<NodePointer<R> > final;
+  while(true)
+  {
+    builder.dumpPointers(builder_2);
+    builder_2.flush();
+    if(builder_2.pointers()->size() > 1)
+    {
+      builder_2.dumpPointers(builder);
+      builder.flush();
+      if(builder.pointers()->size() > 1)
+        continue;
+      else
+      {
+        final = builder.pointers()->front();
+        break;
+      }
+    } else
+    {
+      final = builder_2.pointers()->front();
+      break;
+    }
+  }
+  //The root's position has to be known before it goes in the header.
+  builder.drain();
+  return final;
+}
+
+//Comparing keys of a `by_seq` tree in couchstore B-tree requests: each key is
+//decoded into the `uint64_t` at the `compare_info`'s `arg`.
+int seq_cmp(void* k1, void* k2);
+void* seq_from_ext(compare_info* c, char* buf, int pos);
+
 //Callback functions for on-disk merge sort (used to sort our new docinfos by
 //ID to create a by ID b-tree.)
 //Uses [this on-disk sort implementation](http://www.efgh.com/software/mergesor.htm)
-int read_diskdocinfo(FILE* fp, void* buffer, void* ctx);
-int write_diskdocinfo(FILE* fp, void* buffer, void* ctx);
 int compare_diskdocinfo(void* d1, void* d2, void* ctx);
+//The first 8 bytes of the ID as a big-endian integer, zero padded. Whenever
+//two prefixes differ they order the docinfos exactly as `compare_diskdocinfo`
+//would, so the sorter only needs the full comparison on ties.
+unsigned long long prefix_diskdocinfo(void* d, void* ctx);
+//The doc ID, for radix sorting runs of docinfos.
+const unsigned char* key_diskdocinfo(void* d, unsigned* length, void* ctx);
 }
 #endif
 
@@ -0,0 +1,316 @@
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <ei.h>
+#include "catch_up.hh"
+#include "checkpoint.hh"
+#include "btree_copy.hh"
+#include "reduces.hh"
+#include "docinfo_term.hh"
+#include "term_encode.hh"
+#include "metrics.hh"
+namespace couchstore
+{
+bool can_catch_up(DBHandle& source, DBHandle& compacted)
+{
+  //A checkpoint has no `by_id` tree to catch up.
+  if(!source.isValid() || !compacted.isValid() || is_checkpoint(compacted))
+    return false;
+  const db_header& from = source->header;
+  const db_header& to = compacted->header;
+  //Purges remove docs without leaving a newer seq behind, so there'd be no
+  //way to tell which of the compacted file's docs are gone.
+  return to.update_seq <= from.update_seq && to.purge_seq == from.purge_seq;
+}
+
+CatchUp::CatchUp(DBHandle& source, DBHandle& target, ChunkWriter* writer)
+    : source_(source), target_(target), writer_(writer),
+      copier_(source.get(), writer, this), pushed_(0), error_(0) { }
+
+int CatchUp::run()
+{
+  //`changes_since` starts at the seq it's given.
+  int error = source_.changes(target_->header.update_seq + 1, *this);
+  if(!error) error = error_;
+  if(!error) error = apply();
+  return error;
+}
+
+int CatchUp::callback(DocumentInfo& info)
+{
+  if(error_)
+    return error_;
+  error_ = copier_.push(info.release());
+  if(!error_ && ++pushed_ >= kBatchDocs)
+    error_ = apply();
+  return error_;
+}
+
+//Called with each doc once its body is in the new file. Its keys and values
+//are encoded now, since the docinfo is freed once this returns.
+int CatchUp::add(DocInfo* info)
+{
+  Entry entry;
+  entry.seq = info->db_seq;
+  entry.start = terms_.size();
+  entry.id_key_size = term::binary_size(info->id.size);
+  entry.id_value_size = id_value_size(info);
+  entry.seq_key_size = term::ulonglong_size(info->db_seq);
+  entry.seq_value_size = seq_value_size(info);
+  terms_.resize(entry.start + entry.id_key_size + entry.id_value_size +
+                entry.seq_key_size + entry.seq_value_size);
+  char* buf = &terms_[entry.start];
+  buf = term::put_binary(buf, info->id.buf, info->id.size);
+  buf = put_id_value(buf, info);
+  buf = term::put_ulonglong(buf, info->db_seq);
+  put_seq_value(buf, info);
+  entries_.push_back(entry);
+  Metrics::get().add(Metrics::kDocs);
+  return 0;
+}
+
+//## Applying a batch
+//Everything the copier holds is written out first: `modify_btree` appends
+//its nodes at `file_pos` itself.
+int CatchUp::apply()
+{
+  int error = copier_.finish();
+  if(!error)
+    error = writer_->flush();
+  if(!error && !entries_.empty())
+  {
+    error = update_by_id();
+    if(!error)
+      error = update_by_seq();
+    if(!error)
+    {
+      target_->header.update_seq = entries_.back().seq;
+      error = target_.commit();
+      Metrics::get().add(Metrics::kCatchUpBatches);
+    }
+  }
+  pushed_ = 0;
+  terms_.clear();
+  entries_.clear();
+  old_seqs_.clear();
+  return error;
+}
+
+//### Reduces
+//`modify_btree` hands over the items of each leaf it writes, and the
+//pointers of each pointer node, to be reduced into `dst`, which has room
+//for any of these reduces.
+template<class R>
+static void encode_reduce(const R& reduce, sized_buf* dst)
+{
+  dst->size = reduce.encode(dst->buf) - dst->buf;
+}
+
+static void seq_reduce(sized_buf* dst, nodelist* leaflist, int count)
+{
+  CountingReduce reduce;
+  for(int i = 0; i < count && leaflist; i++, leaflist = leaflist->next)
+    reduce.add(CountingReduce::Item());
+  encode_reduce(reduce, dst);
+}
+
+//Pick `deleted` and `size` out of a `by_id` value.
+static bool decode_id_item(const sized_buf& value, ByIDReduce::Item* item)
+{
+  int pos = 0;
+  int arity;
+  unsigned long long deleted, size;
+  if(ei_decode_tuple_header(value.buf, &pos, &arity) || arity != 6 ||
+     ei_skip_term(value.buf, &pos) || ei_skip_term(value.buf, &pos) ||
+     ei_skip_term(value.buf, &pos) ||
+     ei_decode_ulonglong(value.buf, &pos, &deleted) ||
+     ei_skip_term(value.buf, &pos) ||
+     ei_decode_ulonglong(value.buf, &pos, &size))
+    return false;
+  item->deleted = deleted != 0;
+  item->size = size;
+  return true;
+}
+
+static void id_reduce(sized_buf* dst, nodelist* leaflist, int count)
+{
+  ByIDReduce reduce;
+  ByIDReduce::Item item(false, 0);
+  for(int i = 0; i < count && leaflist; i++, leaflist = leaflist->next)
+    if(decode_id_item(leaflist->data, &item))
+      reduce.add(item);
+  encode_reduce(reduce, dst);
+}
+
+template<class R>
+static void rereduce(sized_buf* dst, nodelist* leaflist, int count)
+{
+  R reduce;
+  for(int i = 0; i < count && leaflist; i++, leaflist = leaflist->next)
+  {
+    R child;
+    if(leaflist->pointer &&
+       child.decode(leaflist->pointer->reduce_value.buf))
+      reduce.add(child);
+  }
+  encode_reduce(reduce, dst);
+}
+
+//Swap in the root `modify_btree` came back with.
+static void replace_root(node_pointer** root, node_pointer* new_root)
+{
+  if(new_root != *root)
+  {
+    free(*root);
+    *root = new_root;
+  }
+}
+
+//### `by_id`
+//The raw ID in a `by_id` key, which is how `ebin_cmp` compares them.
+static sized_buf raw_id(const char* key, size_t key_size)
+{
+  sized_buf id = { const_cast<char*>(key) + term::binary_size(0),
+                   key_size - term::binary_size(0) };
+  return id;
+}
+
+struct IdOrder {
+  IdOrder(const std::vector<sized_buf>& ids) : ids_(ids) { }
+  bool operator()(size_t a, size_t b) const {
+    const sized_buf& x = ids_[a];
+    const sized_buf& y = ids_[b];
+    int cmp = memcmp(x.buf, y.buf, std::min(x.size, y.size));
+    return cmp < 0 || (cmp == 0 && x.size < y.size);
+  }
+  const std::vector<sized_buf>& ids_;
+};
+
+//An ID that's already in the new file is fetched before it's replaced, so
+//`fetched` gets its old value, and with it the seq to remove.
+void CatchUp::fetched(couchfile_modify_request* rq, sized_buf* key,
+                      sized_buf* value, void* arg)
+{
+  if(value == NULL)
+    return;
+  int pos = 0;
+  int arity;
+  unsigned long long seq;
+  if(ei_decode_tuple_header(value->buf, &pos, &arity) ||
+     ei_decode_ulonglong(value->buf, &pos, &seq))
+    return;
+  static_cast<CatchUp*>(rq->callback_ctx)->old_seqs_.push_back(seq);
+}
+
+int CatchUp::update_by_id()
+{
+  size_t count = entries_.size();
+  std::vector<sized_buf> keys(count), values(count), ids(count);
+  std::vector<size_t> order(count);
+  for(size_t i = 0; i < count; i++)
+  {
+    const Entry& entry = entries_[i];
+    char* key = &terms_[entry.start];
+    keys[i].buf = key;
+    keys[i].size = entry.id_key_size;
+    values[i].buf = key + entry.id_key_size;
+    values[i].size = entry.id_value_size;
+    ids[i] = raw_id(key, entry.id_key_size);
+    order[i] = i;
+  }
+  std::sort(order.begin(), order.end(), IdOrder(ids));
+  std::vector<couchfile_modify_action> actions(count * 2);
+  for(size_t i = 0; i < count; i++)
+  {
+    size_t doc = order[i];
+    couchfile_modify_action& fetch = actions[i * 2];
+    fetch.type = ACTION_FETCH;
+    fetch.key = &keys[doc];
+    fetch.cmp_key = &ids[doc];
+    fetch.value.arg = NULL;
+    couchfile_modify_action& insert = actions[i * 2 + 1];
+    insert.type = ACTION_INSERT;
+    insert.key = &keys[doc];
+    insert.cmp_key = &ids[doc];
+    insert.value.term = &values[doc];
+  }
+  sized_buf tmp;
+  couchfile_modify_request rq;
+  memset(&rq, 0, sizeof(rq));
+  rq.cmp.arg = &tmp;
+  rq.cmp.compare = ebin_cmp;
+  rq.cmp.from_ext = ebin_from_ext;
+  rq.db = target_.get();
+  rq.num_actions = actions.size();
+  rq.actions = &actions[0];
+  rq.fetch_callback = fetched;
+  rq.reduce = id_reduce;
+  rq.rereduce = rereduce<ByIDReduce>;
+  rq.callback_ctx = this;
+  int error = 0;
+  node_pointer* root = modify_btree(&rq, target_->header.by_id_root, &error);
+  if(error) return error;
+  replace_root(&target_->header.by_id_root, root);
+  return 0;
+}
+
+//### `by_seq`
+//Every old seq is below every new one, so the removes all sort ahead of the
+//inserts.
+int CatchUp::update_by_seq()
+{
+  std::sort(old_seqs_.begin(), old_seqs_.end());
+  size_t removes = old_seqs_.size();
+  size_t count = removes + entries_.size();
+  std::vector<uint64_t> seqs(count);
+  std::vector<sized_buf> keys(count), values(entries_.size());
+  std::vector<char> old_keys(removes * term::ulonglong_size(~0ULL));
+  char* old_key = old_keys.empty() ? NULL : &old_keys[0];
+  std::vector<couchfile_modify_action> actions(count);
+  for(size_t i = 0; i < removes; i++)
+  {
+    seqs[i] = old_seqs_[i];
+    keys[i].buf = old_key;
+    old_key = term::put_ulonglong(old_key, seqs[i]);
+    keys[i].size = old_key - keys[i].buf;
+    actions[i].type = ACTION_REMOVE;
+    actions[i].value.term = NULL;
+  }
+  for(size_t i = 0; i < entries_.size(); i++)
+  {
+    const Entry& entry = entries_[i];
+    size_t n = removes + i;
+    seqs[n] = entry.seq;
+    keys[n].buf = &terms_[entry.start] + entry.id_key_size +
+                  entry.id_value_size;
+    keys[n].size = entry.seq_key_size;
+    values[i].buf = keys[n].buf + entry.seq_key_size;
+    values[i].size = entry.seq_value_size;
+    actions[n].type = ACTION_INSERT;
+    actions[n].value.term = &values[i];
+  }
+  for(size_t i = 0; i < count; i++)
+  {
+    actions[i].key = &keys[i];
+    actions[i].cmp_key = &seqs[i];
+  }
+  uint64_t tmp;
+  couchfile_modify_request rq;
+  memset(&rq, 0, sizeof(rq));
+  rq.cmp.arg = &tmp;
+  rq.cmp.compare = seq_cmp;
+  rq.cmp.from_ext = seq_from_ext;
+  rq.db = target_.get();
+  rq.num_actions = actions.size();
+  rq.actions = &actions[0];
+  rq.fetch_callback = NULL;
+  rq.reduce = seq_reduce;
+  rq.rereduce = rereduce<CountingReduce>;
+  rq.callback_ctx = this;
+  int error = 0;
+  node_pointer* root = modify_btree(&rq, target_->header.by_seq_root, &error);
+  if(error) return error;
+  replace_root(&target_->header.by_seq_root, root);
+  return 0;
+}
+}
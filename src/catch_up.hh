@@ -0,0 +1,79 @@
+#ifndef COUCH_CATCH_UP_H
+#define COUCH_CATCH_UP_H
+#include <libcouchstore/couch_db.h>
+#include <libcouchstore/couch_btree.h>
+#include <vector>
+#include "wrap.hh"
+#include "chunk_copy.hh"
+#include "chunk_writer.hh"
+//# Catching up a compaction
+//Writes keep landing in the source DB while it's compacted, so by the time a
+//`.compact` file is finished it's usually behind. Rather than compacting
+//again from scratch, the docs written since (those with seqs past the
+//`.compact` file's `update_seq`) are copied into it, as in "Catching up
+//compaction" in compaction.md, so a retry costs time in proportion to what
+//was written during the last attempt, not to the size of the DB.
+//
+//The new docs are taken in large batches. A batch's bodies are copied first,
+//as raw chunks. Then its IDs are looked up and inserted in the new `by_id`
+//tree in one `modify_btree` pass, which turns up the old seqs of any docs
+//that were already there. Those seqs are removed from the new `by_seq` tree,
+//and the new seqs inserted, in another. A header is committed after each
+//batch, so a catch-up that's cut short leaves a `.compact` file that can
+//itself be caught up.
+//
+//It's only done when asked for. A finished `.compact` file is just a
+//database, with nothing in it to say what it was compacted from, so one left
+//from an earlier database of the same name (deleted and recreated, or
+//restored from a backup) would look no different, and catching it up would
+//bring back docs that are gone.
+namespace couchstore
+{
+//Whether `compacted`, opened from an existing `.compact` file, could be a
+//compaction of `source` as it was at some point, going by their seqs, and so
+//can be caught up if it is one.
+bool can_catch_up(DBHandle& source, DBHandle& compacted);
+
+class CatchUp : public InfoCallback, public DocSink {
+ public:
+  //Docs per batch.
+  static const size_t kBatchDocs = 16 * 1024;
+  //Everything is appended to `target` through `writer`.
+  CatchUp(DBHandle& source, DBHandle& target, ChunkWriter* writer);
+  //Copy every doc with a seq past `target`'s `update_seq`.
+  int run();
+  //Takes the docs from `DBHandle::changes`...
+  int callback(DocumentInfo& info);
+  //...and, once their bodies are copied, from the `ChunkCopier`.
+  int add(DocInfo* info);
+ private:
+  //A doc in the batch: its seq, and where its keys and values are in
+  //`terms_`, one after the other.
+  struct Entry {
+    uint64_t seq;
+    size_t start;
+    size_t id_key_size;
+    size_t id_value_size;
+    size_t seq_key_size;
+    size_t seq_value_size;
+  };
+  int apply();
+  int update_by_id();
+  int update_by_seq();
+  static void fetched(couchfile_modify_request* rq, sized_buf* key,
+                      sized_buf* value, void* arg);
+  DBHandle& source_;
+  DBHandle& target_;
+  ChunkWriter* writer_;
+  ChunkCopier copier_;
+  //Docs pushed to the copier since the last batch was applied.
+  size_t pushed_;
+  std::vector<char> terms_;
+  std::vector<Entry> entries_;
+  //Seqs the batch's docs had in the new file, to be removed.
+  std::vector<uint64_t> old_seqs_;
+  int error_;
+  DISALLOW_COPY_AND_ASSIGN(CatchUp);
+};
+}
+#endif
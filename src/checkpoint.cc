@@ -0,0 +1,283 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <set>
+#include <string>
+#include <vector>
+#include <ei.h>
+#include "checkpoint.hh"
+#include "docinfo_term.hh"
+#include "metrics.hh"
+namespace couchstore
+{
+//The local doc a checkpoint's state is kept in.
+static const char kCheckpointDocId[] = "_local/compaction_checkpoint";
+
+//What it says.
+struct CheckpointState {
+  unsigned long long seq;
+  unsigned long long purge_seq;
+  unsigned long long source_root;
+  unsigned long source_crc;
+};
+
+//Which source a checkpoint is of: where its `by_seq` root is, and the CRC of
+//the node there.
+static int source_identity(Db* source, uint64_t pointer, uint32_t* crc)
+{
+  char* node;
+  int size = pread_compressed(source->fd, pointer, &node);
+  if(size < 0)
+    return ERROR_READ;
+  *crc = chunk_crc32(node, size);
+  free(node);
+  return 0;
+}
+
+static bool read_state(DBHandle& compacted, CheckpointState* state)
+{
+  LocalDoc* doc;
+  if(open_local_doc(compacted.get(), (uint8_t*) kCheckpointDocId,
+                    strlen(kCheckpointDocId), &doc) != 0)
+    return false;
+  std::string json(doc->json.buf, doc->json.size);
+  free_local_doc(doc);
+  return sscanf(json.c_str(), "{\"seq\":%llu,\"purge_seq\":%llu,"
+                "\"source_root\":%llu,\"source_crc\":%lu}", &state->seq,
+                &state->purge_seq, &state->source_root,
+                &state->source_crc) == 4;
+}
+
+Checkpoints::Checkpoints(DBHandle& source, DBHandle& target,
+                         ChunkWriter* writer, unsigned interval)
+    : source_(source), target_(target), writer_(writer), interval_(interval),
+      last_(now()), identified_(false), source_root_(0), source_crc_(0) { }
+
+time_t Checkpoints::now()
+{
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec;
+}
+
+bool Checkpoints::due()
+{
+  return interval_ && now() - last_ >= (time_t) interval_;
+}
+
+int Checkpoints::write(NodeBuilder<CountingReduce>& seq_tree, uint64_t seq)
+{
+  NodeBuilder<CountingReduce>::PointerPtr root;
+  int error = seq_tree.writeFrontier(&root);
+  if(error || !root) return error;
+  root->makeBySeqRoot(target_);
+  return commit(seq);
+}
+
+//The header goes after everything the writer's been given, which has to be
+//on disk first, as does the local doc's tree, which couchstore appends
+//itself.
+int Checkpoints::commit(uint64_t seq)
+{
+  last_ = now();
+  int error = writer_->flush();
+  if(!error)
+    error = save_state(seq);
+  if(error) return error;
+  Metrics::get().add(Metrics::kCheckpoints);
+  return target_.commit();
+}
+
+int Checkpoints::save_state(uint64_t seq)
+{
+  //The source's header doesn't change while it's copied, so neither does
+  //its root.
+  if(!identified_)
+  {
+    node_pointer* root = source_->header.by_seq_root;
+    if(root == NULL)
+      return ERROR_READ;
+    source_root_ = root->pointer;
+    int error = source_identity(source_.get(), source_root_, &source_crc_);
+    if(error) return error;
+    identified_ = true;
+  }
+  char json[160];
+  int len = snprintf(json, sizeof(json),
+                     "{\"seq\":%llu,\"purge_seq\":%llu,\"source_root\":%llu,"
+                     "\"source_crc\":%lu}", (unsigned long long) seq,
+                     (unsigned long long) source_->header.purge_seq,
+                     (unsigned long long) source_root_,
+                     (unsigned long) source_crc_);
+  LocalDoc doc;
+  doc.id.buf = const_cast<char*>(kCheckpointDocId);
+  doc.id.size = strlen(kCheckpointDocId);
+  doc.json.buf = json;
+  doc.json.size = len;
+  doc.deleted = 0;
+  return save_local_doc(target_.get(), &doc);
+}
+
+bool is_checkpoint(DBHandle& compacted)
+{
+  return compacted.isValid() && compacted->header.by_seq_root != NULL &&
+         compacted->header.by_id_root == NULL;
+}
+
+bool can_resume(DBHandle& source, DBHandle& compacted)
+{
+  CheckpointState state;
+  uint32_t crc;
+  return source.isValid() && is_checkpoint(compacted) &&
+         read_state(compacted, &state) &&
+         state.seq <= source->header.update_seq &&
+         state.purge_seq == source->header.purge_seq &&
+         source_identity(source.get(), state.source_root, &crc) == 0 &&
+         crc == state.source_crc;
+}
+
+//## Resuming
+//The IDs of the docs written to the source since the checkpoint. Their
+//older versions in the checkpoint are left out.
+class UpdatedIds : public InfoCallback {
+ public:
+  int callback(DocumentInfo& info) {
+    ids.insert(std::string(info->id.buf, info->id.size));
+    return 0;
+  }
+  std::set<std::string> ids;
+};
+
+struct Resume {
+  int fd;
+  NodeBuilder<CountingReduce>* seq_tree;
+  DocSink* docs;
+  const std::set<std::string>* updated;
+};
+
+static int resume_node(Resume* resume, uint64_t pointer,
+                       const CountingReduce& reduce, uint64_t subtreesize);
+
+//Each item of a pointer node is _{Key, {Pointer, Reduce, SubtreeSize}}_.
+static int resume_children(Resume* resume, char* node, int pos, int count)
+{
+  for(int i = 0; i < count; i++)
+  {
+    int arity;
+    unsigned long long child, subtreesize;
+    CountingReduce reduce;
+    if(ei_decode_tuple_header(node, &pos, &arity) ||
+       ei_skip_term(node, &pos) ||
+       ei_decode_tuple_header(node, &pos, &arity) ||
+       ei_decode_ulonglong(node, &pos, &child) ||
+       !reduce.decode(node + pos) ||
+       ei_skip_term(node, &pos) ||
+       ei_decode_ulonglong(node, &pos, &subtreesize))
+      return ERROR_PARSE_TERM;
+    int error = resume_node(resume, child, reduce, subtreesize);
+    if(error) return error;
+  }
+  return 0;
+}
+
+//A leaf none of whose docs have been updated since is kept as it is. The
+//rest of one that has some is added to the new tree again, item by item.
+static int resume_leaf(Resume* resume, char* node, int pos, int count,
+                       uint64_t pointer, const CountingReduce& reduce,
+                       uint64_t subtreesize)
+{
+  std::vector<std::pair<sized_buf, sized_buf> > items;
+  bool intact = true;
+  int error = 0;
+  for(int i = 0; i < count && !error; i++)
+  {
+    int arity;
+    sized_buf key, value;
+    if(ei_decode_tuple_header(node, &pos, &arity))
+      return ERROR_PARSE_TERM;
+    key.buf = node + pos;
+    if(ei_skip_term(node, &pos))
+      return ERROR_PARSE_TERM;
+    key.size = node + pos - key.buf;
+    value.buf = node + pos;
+    if(ei_skip_term(node, &pos))
+      return ERROR_PARSE_TERM;
+    value.size = node + pos - value.buf;
+    DocInfo* info = decode_docinfo(&key, &value);
+    if(info == NULL)
+      return ERROR_PARSE_TERM;
+    if(resume->updated->count(std::string(info->id.buf, info->id.size)))
+      intact = false;
+    else
+    {
+      items.push_back(std::make_pair(key, value));
+      error = resume->docs->add(info);
+    }
+    free_docinfo(info);
+  }
+  if(error || items.empty()) return error;
+  NodeBuilder<CountingReduce>* seq_tree = resume->seq_tree;
+  if(intact)
+  {
+    //Whatever was added item by item goes before it.
+    const sized_buf& last = items.back().first;
+    error = seq_tree->flush();
+    if(!error)
+      error = seq_tree->adoptPointer(NodeBuilder<CountingReduce>::PointerPtr(
+          new NodePointer<CountingReduce>(pointer, reduce, subtreesize,
+                                          BufPtr(new Buffer(last.buf,
+                                                            last.size)))));
+    return error;
+  }
+  for(size_t i = 0; i < items.size() && !error; i++)
+    error = seq_tree->addItem(items[i].first, items[i].second);
+  return error;
+}
+
+//Resume from the node at `pointer`, given the reduce and subtree size its
+//pointer has.
+static int resume_node(Resume* resume, uint64_t pointer,
+                       const CountingReduce& reduce, uint64_t subtreesize)
+{
+  char* node;
+  if(pread_compressed(resume->fd, pointer, &node) < 0)
+    return ERROR_READ;
+  int error = 0;
+  int pos = 0;
+  int version, arity, count;
+  char atom[MAXATOMLEN + 1];
+  if(ei_decode_version(node, &pos, &version) ||
+     ei_decode_tuple_header(node, &pos, &arity) ||
+     ei_decode_atom(node, &pos, atom) ||
+     ei_decode_list_header(node, &pos, &count))
+    error = ERROR_PARSE_TERM;
+  else if(strcmp(atom, "kp_node") == 0)
+    error = resume_children(resume, node, pos, count);
+  else
+    error = resume_leaf(resume, node, pos, count, pointer, reduce,
+                        subtreesize);
+  free(node);
+  return error;
+}
+
+int resume_checkpoint(DBHandle& source, DBHandle& compacted,
+                      NodeBuilder<CountingReduce>& seq_tree, DocSink* docs,
+                      uint64_t* seq)
+{
+  CheckpointState state;
+  if(!read_state(compacted, &state))
+    return ERROR_PARSE_TERM;
+  *seq = state.seq;
+  //Docs updated since the checkpoint have newer seqs, and are copied again
+  //with the rest after it.
+  UpdatedIds updated;
+  int error = source.changes(state.seq + 1, updated);
+  if(error) return error;
+  node_pointer* root = compacted->header.by_seq_root;
+  CountingReduce reduce;
+  if(!reduce.decode(root->reduce_value.buf))
+    return ERROR_PARSE_TERM;
+  Resume resume = { compacted->fd, &seq_tree, docs, &updated.ids };
+  return resume_node(&resume, root->pointer, reduce, root->subtreesize);
+}
+}
@@ -0,0 +1,82 @@
+#ifndef COUCH_CHECKPOINT_H
+#define COUCH_CHECKPOINT_H
+#include <libcouchstore/couch_db.h>
+#include <time.h>
+#include "wrap.hh"
+#include "btree_copy.hh"
+#include "reduces.hh"
+#include "chunk_writer.hh"
+#include "doc_pipeline.hh"
+//# Checkpoints
+//A long compaction commits a header to the `.compact` file every so often
+//while it copies the `by_seq` tree, and once more when that's done, so that
+//if it dies a restarted compactor picks up from there instead of starting
+//over. A checkpoint's header has:
+//
+// * as its `by_seq` root, a tree of every leaf written so far (see
+//   `NodeBuilder::writeFrontier`);
+// * no `by_id` root, which is what marks it as a checkpoint rather than a
+//   finished compaction;
+// * no `update_seq`. Only the final header says how far the file is copied,
+//   so nothing that reads it takes a checkpoint for a finished compaction.
+//
+//How far it is copied goes in a local doc instead, along with the source's
+//`purge_seq` and which source it is: where the source's `by_seq` root was and
+//the CRC of that node. A couchstore file is only ever appended to, so if the
+//node is still there the source is the same file, written to since; one
+//deleted and recreated, or restored from a backup older than the checkpoint,
+//won't have it. The local doc goes when the source's local docs are copied
+//over at the end.
+//
+//The docinfos already handed to the ID sorter aren't saved: its spill files
+//go with the process. Instead, resuming walks the checkpoint's tree, passing
+//its leaves to the new `by_seq` builder as they are and its docs to the
+//sorter again, which only reads the tree's nodes, not the bodies under them.
+//Anything written after the checkpoint's header is left where it is, unused.
+namespace couchstore
+{
+//Seconds between checkpoints, by default.
+static const unsigned kDefaultCheckpointInterval = 60;
+
+class Checkpoints {
+ public:
+  //Checkpoints of `target`, a compaction of `source`, are committed at most
+  //every `interval` seconds. Everything up to them goes through `writer`.
+  Checkpoints(DBHandle& source, DBHandle& target, ChunkWriter* writer,
+              unsigned interval);
+  //Whether it's time for another.
+  bool due();
+  //Commit a checkpoint of the docs up to `seq`, which have all been added to
+  //`seq_tree`.
+  int write(NodeBuilder<CountingReduce>& seq_tree, uint64_t seq);
+  //Commit a checkpoint with the `by_seq` root already in the header.
+  int commit(uint64_t seq);
+ private:
+  static time_t now();
+  int save_state(uint64_t seq);
+  DBHandle& source_;
+  DBHandle& target_;
+  ChunkWriter* writer_;
+  unsigned interval_;
+  time_t last_;
+  //The source's `by_seq` root and its node's CRC, once they're worked out.
+  bool identified_;
+  uint64_t source_root_;
+  uint32_t source_crc_;
+  DISALLOW_COPY_AND_ASSIGN(Checkpoints);
+};
+
+//Whether `compacted`'s header is a checkpoint.
+bool is_checkpoint(DBHandle& compacted);
+//Whether `compacted` is a checkpoint of a compaction of `source` that can be
+//resumed: it's of this source, which has nothing purged from it since.
+bool can_resume(DBHandle& source, DBHandle& compacted);
+//Pick up from the checkpoint in `compacted`: its leaves are handed to
+//`seq_tree` and its docs to `docs`, leaving out any that have been updated
+//in `source` since. The docs to copy next are then those after `*seq`, the
+//last seq it has.
+int resume_checkpoint(DBHandle& source, DBHandle& compacted,
+                      NodeBuilder<CountingReduce>& seq_tree, DocSink* docs,
+                      uint64_t* seq);
+}
+#endif
@@ -0,0 +1,414 @@
+#include <errno.h>
+#include <unistd.h>
+#include "chunk_copy.hh"
+#include "metrics.hh"
+namespace couchstore
+{
+static const uint64_t kBlockSize = 4096;
+//Length and CRC in front of each chunk's data. The length's top bit marks
+//the CRC.
+static const uint64_t kChunkHeader = 8;
+static const uint32_t kChunkHasCRC = 0x80000000;
+//Caps on an extent, which bound the docinfos held and, when it has to be
+//re-framed, the buffer it's read into.
+static const size_t kMaxExtentDocs = 4096;
+static const uint64_t kMaxExtentBytes = 16 * 1024 * 1024;
+//Extents up to this size are read ahead; bigger ones are copied when their
+//turn comes, in the kernel if possible.
+static const uint64_t kReadAheadBytes = 1024 * 1024;
+//Extents waiting to be copied, and so reads in flight.
+static const size_t kReadWindow = 64;
+//Header windows being read at once, and how much each reads.
+static const size_t kHeaderWindows = 32;
+static const uint64_t kHeaderWindowBytes = 64 * 1024;
+//Zero padding is written to line an extent up with its block offset only if
+//it's at most this fraction of the extent.
+static const uint64_t kMaxPadFraction = 16;
+static const size_t kCopyBufferSize = 1024 * 1024;
+
+//Where a chunk of `length` bytes written at `pos` ends, block markers
+//included.
+static uint64_t chunk_end(uint64_t pos, uint64_t length)
+{
+  while(length > 0)
+  {
+    if(pos % kBlockSize == 0)
+      pos++;
+    uint64_t n = kBlockSize - pos % kBlockSize;
+    if(n > length) n = length;
+    pos += n;
+    length -= n;
+  }
+  return pos;
+}
+
+//The data length in the chunk header at `pos` in the old file, whose bytes
+//from `start` are in `data`.
+static uint64_t chunk_length(const char* data, uint64_t start, uint64_t pos)
+{
+  unsigned char bytes[kChunkHeader];
+  for(size_t i = 0; i < sizeof(bytes); i++, pos++)
+  {
+    if(pos % kBlockSize == 0)
+      pos++;
+    bytes[i] = data[pos - start];
+  }
+  uint32_t length = ((uint32_t) bytes[0] << 24) | ((uint32_t) bytes[1] << 16) |
+                    ((uint32_t) bytes[2] << 8) | bytes[3];
+  return length & ~kChunkHasCRC;
+}
+
+//Copy `len` bytes between files, in the kernel if it can, or through a buffer
+//if `copy_file_range` isn't there or won't do this pair of files.
+int copy_range(int in, uint64_t in_pos, int out, uint64_t out_pos,
+               uint64_t len)
+{
+#ifdef HAVE_COPY_FILE_RANGE
+  while(len > 0)
+  {
+    loff_t in_off = in_pos;
+    loff_t out_off = out_pos;
+    ssize_t n = copy_file_range(in, &in_off, out, &out_off, len, 0);
+    if(n < 0 && errno == EINTR) continue;
+    if(n <= 0) break;
+    Metrics::get().read(in, n);
+    Metrics::get().wrote(out, n);
+    in_pos += n;
+    out_pos += n;
+    len -= n;
+  }
+#endif
+  if(len == 0) return 0;
+  std::vector<char> buf(len < kCopyBufferSize ? len : kCopyBufferSize);
+  while(len > 0)
+  {
+    size_t n = len < buf.size() ? len : buf.size();
+    if(!pread_all(in, &buf[0], n, in_pos))
+      return ERROR_READ;
+    if(!pwrite_all(out, &buf[0], n, out_pos))
+      return ERROR_WRITE;
+    in_pos += n;
+    out_pos += n;
+    len -= n;
+  }
+  return 0;
+}
+
+ChunkCopier::ChunkCopier(Db* source, ChunkWriter* target, DocSink* sink)
+    : source_(source), target_(target), sink_(sink),
+      //The extents' reads, one more while the oldest is retired, and the
+      //header windows'.
+      engine_(ReadEngine::create(source->fd, kReadWindow + 1 + kHeaderWindows)),
+      open_(NULL), error_(0) { }
+
+ChunkCopier::~ChunkCopier()
+{
+  for(std::deque<HeaderWindow*>::iterator it = headers_.begin();
+      it != headers_.end(); ++it)
+  {
+    engine_->wait(&(*it)->read);
+    delete *it;
+  }
+  for(std::deque<Unsized>::iterator it = unsized_.begin();
+      it != unsized_.end(); ++it)
+    free_docinfo(it->info);
+  if(open_)
+    discard(open_);
+  //Reads still in flight have to land before their buffers go away.
+  for(std::deque<Extent*>::iterator it = window_.begin(); it != window_.end();
+      ++it)
+  {
+    if((*it)->reading)
+      engine_->wait(&(*it)->read);
+    discard(*it);
+  }
+  delete engine_;
+}
+
+int ChunkCopier::push(DocInfo* info)
+{
+  if(error_)
+  {
+    free_docinfo(info);
+    return error_;
+  }
+  return error_ = read_header(info);
+}
+
+int ChunkCopier::callback(DocumentInfo& info)
+{
+  return push(info.release());
+}
+
+int ChunkCopier::finish()
+{
+  int error = 0;
+  while(!headers_.empty() && !error)
+    error = size_oldest();
+  if(!error)
+    error = pass_unsized(NULL);
+  if(!error_) error_ = error;
+  error = close_extent();
+  if(!error_) error_ = error;
+  while(!window_.empty())
+  {
+    error = retire();
+    if(!error_) error_ = error;
+  }
+  return error_;
+}
+
+//## Reading the headers
+//Queue the doc until its chunk's header is read: in the last window read, if
+//it's there, or else in a new one from the header on.
+int ChunkCopier::read_header(DocInfo* info)
+{
+  Unsized doc = { info, NULL };
+  if(info->bp != 0)
+  {
+    uint64_t header_end = chunk_end(info->bp, kChunkHeader);
+    HeaderWindow* last = headers_.empty() ? NULL : headers_.back();
+    if(last && info->bp >= last->read.pos &&
+       header_end <= last->read.pos + last->read.len)
+      doc.window = last;
+    else
+    {
+      int error = 0;
+      if(headers_.size() == kHeaderWindows)
+        error = size_oldest();
+      if(error)
+      {
+        free_docinfo(info);
+        return error;
+      }
+      //As far as the end of the file allows, but always the whole header.
+      uint64_t file_end = source_->file_pos;
+      uint64_t len = kHeaderWindowBytes;
+      if(info->bp + len > file_end)
+        len = file_end > info->bp ? file_end - info->bp : 0;
+      if(len < header_end - info->bp)
+        len = header_end - info->bp;
+      HeaderWindow* window = new HeaderWindow();
+      window->data.resize(len);
+      window->read.buf = &window->data[0];
+      window->read.len = len;
+      window->read.pos = info->bp;
+      if(engine_->submit(&window->read) != 0)
+      {
+        delete window;
+        free_docinfo(info);
+        return ERROR_READ;
+      }
+      headers_.push_back(window);
+      doc.window = window;
+    }
+  }
+  unsized_.push_back(doc);
+  //With no headers being read, there's nothing to wait for.
+  return headers_.empty() ? pass_unsized(NULL) : 0;
+}
+
+//Wait for the oldest header window, and pass on the docs up to the last one
+//whose header it has.
+int ChunkCopier::size_oldest()
+{
+  HeaderWindow* window = headers_.front();
+  headers_.pop_front();
+  int error = engine_->wait(&window->read);
+  if(!error)
+    error = pass_unsized(window);
+  delete window;
+  return error;
+}
+
+//Hand the docs at the front of the queue on to be laid out in extents, while
+//they have no body or their header is in `window`.
+int ChunkCopier::pass_unsized(HeaderWindow* window)
+{
+  int error = 0;
+  while(!unsized_.empty() && !error &&
+        (unsized_.front().window == NULL || unsized_.front().window == window))
+  {
+    Unsized doc = unsized_.front();
+    unsized_.pop_front();
+    uint64_t length = 0;
+    if(doc.window)
+      length = chunk_length(&window->data[0], window->read.pos, doc.info->bp);
+    error = add(doc.info, length);
+  }
+  return error;
+}
+
+//## Laying out extents
+int ChunkCopier::add(DocInfo* info, uint64_t length)
+{
+  int error = 0;
+  //A doc with no body has nothing to copy, but still has to reach the sink
+  //in order.
+  if(info->bp == 0)
+  {
+    error = close_extent();
+    Extent* extent = new Extent();
+    extent->start = extent->end = 0;
+    extent->reading = false;
+    extent->docs.push_back(info);
+    extent->lengths.push_back(0);
+    window_.push_back(extent);
+    if(!error && window_.size() > kReadWindow)
+      error = retire();
+    return error;
+  }
+  uint64_t end = chunk_end(info->bp, kChunkHeader + length);
+  if(open_ && (info->bp != open_->end ||
+               open_->docs.size() == kMaxExtentDocs ||
+               end - open_->start > kMaxExtentBytes))
+    error = close_extent();
+  if(!open_)
+  {
+    open_ = new Extent();
+    open_->start = info->bp;
+    open_->reading = false;
+  }
+  open_->docs.push_back(info);
+  open_->lengths.push_back(length);
+  open_->end = end;
+  return error;
+}
+
+//The open extent is complete: start reading it if it's small, and copy the
+//oldest extent if the window is full.
+int ChunkCopier::close_extent()
+{
+  if(!open_) return 0;
+  Extent* extent = open_;
+  open_ = NULL;
+  window_.push_back(extent);
+  Metrics::get().depth(Metrics::kCopyWindow, window_.size());
+  uint64_t length = extent->end - extent->start;
+  if(length <= kReadAheadBytes)
+  {
+    extent->data.resize(length);
+    extent->read.buf = &extent->data[0];
+    extent->read.len = length;
+    extent->read.pos = extent->start;
+    if(engine_->submit(&extent->read) != 0)
+      return ERROR_READ;
+    extent->reading = true;
+  }
+  if(window_.size() > kReadWindow)
+    return retire();
+  return 0;
+}
+
+//Copy the oldest extent in the window, or after an error just drop it.
+int ChunkCopier::retire()
+{
+  Extent* extent = window_.front();
+  window_.pop_front();
+  int error = 0;
+  if(extent->reading)
+    error = engine_->wait(&extent->read);
+  if(!error && !error_)
+    error = copy(extent);
+  discard(extent);
+  return error;
+}
+
+int ChunkCopier::copy(Extent* extent)
+{
+  std::vector<uint64_t> positions;
+  if(extent->start == extent->end)
+  {
+    positions.push_back(0);
+    return hand_off(extent, positions);
+  }
+  uint64_t length = extent->end - extent->start;
+  uint64_t pad = (extent->start % kBlockSize + kBlockSize -
+                  target_->position() % kBlockSize) % kBlockSize;
+  if(pad * kMaxPadFraction <= length)
+    return copy_aligned(extent, pad);
+  if(!extent->reading)
+  {
+    extent->data.resize(length);
+    if(!pread_all(source_->fd, &extent->data[0], length, extent->start))
+      return ERROR_READ;
+  }
+  return copy_reframed(extent);
+}
+
+//Pad the new file out to the extent's offset within a block, then copy it
+//byte for byte, from the buffer it was read into or else file to file. The
+//padding is zeros, so any block marker it covers reads as a data block.
+int ChunkCopier::copy_aligned(Extent* extent, uint64_t pad)
+{
+  uint64_t length = extent->end - extent->start;
+  int error = target_->pad(pad);
+  if(error) return error;
+  uint64_t start = target_->position();
+  if(extent->reading)
+    error = target_->append(&extent->data[0], length);
+  else
+  {
+    error = target_->claim(length, &start);
+    if(!error)
+      error = copy_range(source_->fd, extent->start, target_->db()->fd, start,
+                         length);
+  }
+  if(error) return error;
+  std::vector<uint64_t> positions;
+  for(std::vector<DocInfo*>::iterator it = extent->docs.begin();
+      it != extent->docs.end(); ++it)
+    positions.push_back(start + ((*it)->bp - extent->start));
+  return hand_off(extent, positions);
+}
+
+//Drop the extent's block markers and let the writer put in new ones for where
+//it's going.
+int ChunkCopier::copy_reframed(Extent* extent)
+{
+  std::vector<char>& in = extent->data;
+  std::vector<uint64_t> positions;
+  uint64_t src = extent->start;
+  for(size_t i = 0; i < extent->docs.size(); i++)
+  {
+    positions.push_back(target_->position());
+    uint64_t remaining = kChunkHeader + extent->lengths[i];
+    while(remaining > 0)
+    {
+      if(src % kBlockSize == 0)
+        src++;
+      uint64_t n = remaining;
+      if(n > kBlockSize - src % kBlockSize) n = kBlockSize - src % kBlockSize;
+      int error = target_->put(&in[src - extent->start], n);
+      if(error) return error;
+      src += n;
+      remaining -= n;
+    }
+  }
+  return hand_off(extent, positions);
+}
+
+//Point the extent's docinfos at their new chunks and pass them on.
+int ChunkCopier::hand_off(Extent* extent, std::vector<uint64_t>& positions)
+{
+  int error = 0;
+  for(size_t i = 0; i < extent->docs.size(); i++)
+  {
+    extent->docs[i]->bp = positions[i];
+    if(!error)
+      error = sink_->add(extent->docs[i]);
+    free_docinfo(extent->docs[i]);
+  }
+  extent->docs.clear();
+  return error;
+}
+
+//Free an extent along with any docinfos it still holds.
+void ChunkCopier::discard(Extent* extent)
+{
+  for(std::vector<DocInfo*>::iterator it = extent->docs.begin();
+      it != extent->docs.end(); ++it)
+    free_docinfo(*it);
+  delete extent;
+}
+}
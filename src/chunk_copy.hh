@@ -0,0 +1,100 @@
+#ifndef COUCH_CHUNK_COPY_H
+#define COUCH_CHUNK_COPY_H
+#include <libcouchstore/couch_db.h>
+#include <deque>
+#include <vector>
+#include "wrap.hh"
+#include "doc_pipeline.hh"
+#include "read_engine.hh"
+#include "chunk_writer.hh"
+//# Raw document body copy
+//A document body is stored as one chunk: a 4 byte length, a 4 byte CRC and
+//`size` bytes of (possibly compressed) data, with a marker byte wherever the
+//chunk crosses a 4096 byte block boundary. The new file wants exactly those
+//bytes, so instead of reading each body into memory and writing it back out,
+//we copy the chunks as they are and only fix up each docinfo's `bp`.
+//
+//The `by_seq` walk visits live docs in the order they were written, so runs
+//of them usually sit back to back in the old file with no garbage between
+//them. Each such extent is copied in one go: with `copy_file_range` when the
+//new position can be put at the same offset within a block (so the block
+//markers land in the same places), or else read in once and handed to the
+//`ChunkWriter` to be re-framed for its new offset.
+//
+//Extents are laid out by the lengths in the chunks' own headers, not the
+//docinfos' `size`s, which a store is free to record differently (as the
+//uncompressed length, say). The headers are read ahead too, a window of the
+//file from each one that isn't in the last window, so a run of small docs
+//costs one read between them.
+//
+//Extents small enough that the copy is bound by seek latency rather than
+//bandwidth are read ahead: a window of them is read through a `ReadEngine`,
+//many at a time, while the ones before them are written out in order.
+namespace couchstore
+{
+//Copy `len` bytes at `in_pos` in one file to `out_pos` in another.
+int copy_range(int in, uint64_t in_pos, int out, uint64_t out_pos,
+               uint64_t len);
+
+class ChunkCopier : public InfoCallback {
+ public:
+  //Copied docs are handed to `sink` in the order they come in.
+  ChunkCopier(Db* source, ChunkWriter* target, DocSink* sink);
+  ~ChunkCopier();
+  //Queue a doc to be copied. The copier takes ownership of `info`.
+  int push(DocInfo* info);
+  int callback(DocumentInfo& info);
+  //Copy whatever is still pending. Returns the first error hit. More docs
+  //may be pushed afterwards; they go on after the ones already copied.
+  int finish();
+ private:
+  //Bytes of the old file read for the chunk headers in them.
+  struct HeaderWindow {
+    std::vector<char> data;
+    ReadRequest read;
+  };
+  //A doc waiting for its chunk's header, which is in `window` (NULL if it
+  //has no body).
+  struct Unsized {
+    DocInfo* info;
+    HeaderWindow* window;
+  };
+  //Docs whose chunks fill `start` up to `end` in the old file, and their
+  //chunks' data lengths. A doc with no body gets an extent of its own, with
+  //no bytes.
+  struct Extent {
+    std::vector<DocInfo*> docs;
+    std::vector<uint64_t> lengths;
+    uint64_t start;
+    uint64_t end;
+    //The extent's bytes, if it's being read ahead.
+    std::vector<char> data;
+    ReadRequest read;
+    bool reading;
+  };
+  int read_header(DocInfo* info);
+  int size_oldest();
+  int pass_unsized(HeaderWindow* window);
+  int add(DocInfo* info, uint64_t length);
+  int close_extent();
+  int retire();
+  int copy(Extent* extent);
+  int copy_aligned(Extent* extent, uint64_t pad);
+  int copy_reframed(Extent* extent);
+  int hand_off(Extent* extent, std::vector<uint64_t>& positions);
+  void discard(Extent* extent);
+  Db* source_;
+  ChunkWriter* target_;
+  DocSink* sink_;
+  ReadEngine* engine_;
+  //Header windows being read, oldest first, and the docs waiting on them.
+  std::deque<HeaderWindow*> headers_;
+  std::deque<Unsized> unsized_;
+  //The extent still being added to, and the ones waiting to be copied.
+  Extent* open_;
+  std::deque<Extent*> window_;
+  int error_;
+  DISALLOW_COPY_AND_ASSIGN(ChunkCopier);
+};
+}
+#endif
@@ -0,0 +1,180 @@
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <snappy-c.h>
+#include "chunk_writer.hh"
+#include "term_encode.hh"
+#include "metrics.hh"
+namespace couchstore
+{
+static const uint64_t kBlockSize = 4096;
+//Top bit of a chunk's length, saying a CRC follows it.
+static const uint32_t kChunkHasCRC = 0x80000000;
+
+//## CRC32
+//The usual reflected CRC32 (polynomial 0xEDB88320), a byte at a time from a
+//table built on first use.
+static uint32_t crc_table[256];
+static pthread_once_t crc_table_once = PTHREAD_ONCE_INIT;
+
+static void build_crc_table()
+{
+  for(uint32_t i = 0; i < 256; i++)
+  {
+    uint32_t crc = i;
+    for(int bit = 0; bit < 8; bit++)
+      crc = (crc & 1) ? (crc >> 1) ^ 0xEDB88320 : crc >> 1;
+    crc_table[i] = crc;
+  }
+}
+
+uint32_t chunk_crc32(const char* data, size_t len)
+{
+  pthread_once(&crc_table_once, build_crc_table);
+  uint32_t crc = 0xFFFFFFFF;
+  const unsigned char* p = reinterpret_cast<const unsigned char*>(data);
+  for(size_t i = 0; i < len; i++)
+    crc = crc_table[(crc ^ p[i]) & 0xFF] ^ (crc >> 8);
+  return crc ^ 0xFFFFFFFF;
+}
+
+bool pwrite_all(int fd, const char* buf, size_t len, uint64_t pos)
+{
+  while(len > 0)
+  {
+    ssize_t n = pwrite(fd, buf, len, pos);
+    if(n < 0 && errno == EINTR) continue;
+    if(n < 0) return false;
+    Metrics::get().wrote(fd, n);
+    buf += n;
+    len -= n;
+    pos += n;
+  }
+  return true;
+}
+
+//## Buffering
+//The buffer is at least two blocks, so that when it's full there's always a
+//whole block in it to write out.
+ChunkWriter::ChunkWriter(Db* db, size_t buffer_size)
+    : db_(db), buffer_(buffer_size < 2 * kBlockSize ? 2 * kBlockSize :
+                       buffer_size),
+      used_(0), error_(0) { }
+
+//Write out the buffer up to the last block boundary in it, or all of it.
+int ChunkWriter::write_out(bool all)
+{
+  if(error_) return error_;
+  uint64_t start = db_->file_pos - used_;
+  size_t len = used_;
+  if(!all && db_->file_pos / kBlockSize * kBlockSize > start)
+    len = db_->file_pos / kBlockSize * kBlockSize - start;
+  if(len == 0) return 0;
+  if(!pwrite_all(db_->fd, &buffer_[0], len, start))
+    return error_ = ERROR_WRITE;
+  memmove(&buffer_[0], &buffer_[len], used_ - len);
+  used_ -= len;
+  return 0;
+}
+
+//Make room for `len` more bytes, `len` being at most a block.
+int ChunkWriter::reserve(size_t len)
+{
+  if(error_) return error_;
+  if(buffer_.size() - used_ >= len) return 0;
+  return write_out(false);
+}
+
+int ChunkWriter::append(const char* data, size_t len)
+{
+  while(len > 0)
+  {
+    int error = reserve(1);
+    if(error) return error;
+    size_t n = buffer_.size() - used_;
+    if(n > len) n = len;
+    memcpy(&buffer_[used_], data, n);
+    used_ += n;
+    db_->file_pos += n;
+    data += n;
+    len -= n;
+  }
+  return error_;
+}
+
+int ChunkWriter::pad(size_t len)
+{
+  while(len > 0)
+  {
+    int error = reserve(1);
+    if(error) return error;
+    size_t n = buffer_.size() - used_;
+    if(n > len) n = len;
+    memset(&buffer_[used_], 0, n);
+    used_ += n;
+    db_->file_pos += n;
+    len -= n;
+  }
+  return error_;
+}
+
+int ChunkWriter::put(const char* data, size_t len)
+{
+  while(len > 0)
+  {
+    if(db_->file_pos % kBlockSize == 0)
+    {
+      int error = pad(1);
+      if(error) return error;
+    }
+    size_t n = kBlockSize - db_->file_pos % kBlockSize;
+    if(n > len) n = len;
+    int error = append(data, n);
+    if(error) return error;
+    data += n;
+    len -= n;
+  }
+  return error_;
+}
+
+//## Chunks
+int ChunkWriter::write(const sized_buf* buf, off_t* pos)
+{
+  char header[8];
+  term::put_be32(header, buf->size | kChunkHasCRC);
+  term::put_be32(header + 4, chunk_crc32(buf->buf, buf->size));
+  *pos = db_->file_pos;
+  int error = put(header, sizeof(header));
+  if(!error)
+    error = put(buf->buf, buf->size);
+  return error;
+}
+
+int ChunkWriter::write_compressed(const sized_buf* buf, off_t* pos,
+                                  size_t* compressed_size)
+{
+  size_t len = snappy_max_compressed_length(buf->size);
+  if(compressed_.size() < len)
+    compressed_.resize(len);
+  if(snappy_compress(buf->buf, buf->size, &compressed_[0], &len) != SNAPPY_OK)
+    return ERROR_WRITE;
+  if(compressed_size)
+    *compressed_size = len;
+  sized_buf compressed = { &compressed_[0], len };
+  return write(&compressed, pos);
+}
+
+int ChunkWriter::claim(uint64_t len, uint64_t* pos)
+{
+  int error = flush();
+  if(error) return error;
+  *pos = db_->file_pos;
+  db_->file_pos += len;
+  return 0;
+}
+
+int ChunkWriter::flush()
+{
+  return write_out(true);
+}
+}
@@ -0,0 +1,73 @@
+#ifndef COUCH_CHUNK_WRITER_H
+#define COUCH_CHUNK_WRITER_H
+#include <libcouchstore/couch_db.h>
+#include <vector>
+#include "wrap.hh"
+//# Write-behind chunk writer
+//Everything the compactor appends to the new file goes through one of these
+//instead of a `pwrite` per body or node. Each chunk is given its place in the
+//file as soon as it's added, and framed just as `db_write_buf` frames it: a
+//4 byte length (with the top bit set, marking a CRC) and the CRC32 of the
+//data in front, and a zero marker byte wherever it crosses a 4096 byte block
+//boundary. The bytes are collected in a buffer and written out a few
+//megabytes at a time, in whole blocks, with whatever part-block is left over
+//kept back for the next write.
+//
+//The `Db`'s `file_pos` always points past the last byte added, written out
+//or not, so anything placing itself by `file_pos` sees the same file it
+//would with unbuffered writes. Nothing but the writer may write to the file
+//while it holds bytes, except at places it has handed out with `claim`.
+namespace couchstore
+{
+class ChunkWriter {
+ public:
+  static const size_t kDefaultBufferSize = 4 * 1024 * 1024;
+  ChunkWriter(Db* db, size_t buffer_size = kDefaultBufferSize);
+  //Drops anything not yet flushed.
+  ~ChunkWriter() { }
+  Db* db() {
+    return db_;
+  }
+  //Where the next byte added will go.
+  uint64_t position() {
+    return db_->file_pos;
+  }
+  //Add `buf` as a chunk, setting `*pos` to where it starts.
+  int write(const sized_buf* buf, off_t* pos);
+  //The same, compressed with snappy first. Sets `*compressed_size`, if given,
+  //to the size of what was written, less the chunk header.
+  int write_compressed(const sized_buf* buf, off_t* pos,
+                       size_t* compressed_size = NULL);
+  //Add bytes of one or more chunks that have already been framed (header and
+  //all) but have no block markers, putting the markers in for where they land.
+  int put(const char* data, size_t len);
+  //Add bytes exactly as given: the caller has laid them out, block markers
+  //included, for `position()`.
+  int append(const char* data, size_t len);
+  //Add `len` zero bytes. A zero at a block boundary marks a data block.
+  int pad(size_t len);
+  //Hand the next `len` bytes of the file to the caller to write itself (with
+  //`copy_file_range`, say), setting `*pos` to where they start. Whatever was
+  //added before them is written out first.
+  int claim(uint64_t len, uint64_t* pos);
+  //Write out everything added so far.
+  int flush();
+ private:
+  int reserve(size_t len);
+  int write_out(bool all);
+  Db* db_;
+  std::vector<char> buffer_;
+  //Bytes in `buffer_`, which start at `db_->file_pos - used_`.
+  size_t used_;
+  //Scratch space for compressing.
+  std::vector<char> compressed_;
+  int error_;
+  DISALLOW_COPY_AND_ASSIGN(ChunkWriter);
+};
+
+//Write all of `buf` at `pos`, retrying short writes.
+bool pwrite_all(int fd, const char* buf, size_t len, uint64_t pos);
+//CRC32 of `len` bytes, as couchstore checks chunks with.
+uint32_t chunk_crc32(const char* data, size_t len);
+}
+#endif
@@ -1,268 +1,798 @@
 //**Compactor** for couchstore .couch files
 #include <fcntl.h>
+#include <string.h>
 #include <string>
 #include <ei.h>
 #include <signal.h>
+#include <unistd.h>
 #include <sys/time.h>
 #include <libcouchstore/couch_btree.h>
+#include "compactor.hh"
+#include "node_sizing_bench.hh"
 #include "btree_copy.hh"
 #include "wrap.hh"
 #include "reduces.hh"
+#include "chunk_copy.hh"
+#include "doc_pipeline.hh"
+#include "seq_copy.hh"
+#include "raw_tree_copy.hh"
+#include "catch_up.hh"
+#include "checkpoint.hh"
+#include "node_compressor.hh"
+#include "term_encode.hh"
+#include "docinfo_term.hh"
+#include "metrics.hh"
+#include "mergesor.h"
 namespace couchstore
 {
-extern "C"
-int merge_sort(FILE *unsorted_file, FILE *sorted_file,
-               int (*read)(FILE *, void *, void *),
-               int (*write)(FILE *, void *, void *),
-               int (*compare)(void *, void *, void *), void *pointer,
-               unsigned max_record_size, unsigned long block_size, unsigned long *pcount);
-
-class SeqTreeCopy : public InfoCallback {
+
+//Largest docinfo record we hand to the sorter: a `disk_docinfo` followed by
+//the ID and rev\_meta.
+static const unsigned kMaxDocInfoRecord = 1024;
+
+//Docs each body copy reader may have in flight, on average.
+static const unsigned kPipelineDepthPerReader = 16;
+
+//Nodes each compressor thread may have waiting, on average.
+static const unsigned kCompressDepthPerThread = 8;
+
+//Takes each doc once its body is in the new file, and indexes it, passing it
+//on to `ids` (if any) for the `by_id` index. With `checkpoints`, one is taken
+//after a doc whenever it's due.
+class SeqTreeCopy : public DocSink {
  public:
-  SeqTreeCopy(NodeBuilder* builder, Db* source, Db* target, int tempfd) :
-      builder_(builder), source_(source), target_(target), temp_fd_(tempfd) { }
-  int callback(DocumentInfo& info);
+  SeqTreeCopy(NodeBuilder<CountingReduce>* builder, DocSink* ids,
+              Checkpoints* checkpoints = NULL) :
+      builder_(builder), ids_(ids), checkpoints_(checkpoints) { }
+  int add(DocInfo* info);
  private:
-  NodeBuilder* builder_;
-  Db* source_;
-  Db* target_;
-  int temp_fd_;
+  NodeBuilder<CountingReduce>* builder_;
+  DocSink* ids_;
+  Checkpoints* checkpoints_;
+};
+
+//Gives each range of a parallel `by_seq` copy a `SeqTreeCopy` of its own.
+//The `by_id` index gets the docs from `SeqCopy` itself, in seq order.
+class SeqTreeCopies : public RangeSinks {
+ public:
+  DocSink* create(NodeBuilder<CountingReduce>* leaves) {
+    return new SeqTreeCopy(leaves, NULL);
+  }
 };
 
-BufPtr number_term(uint64_t num)
+static unsigned reader_count(const CompactOptions& options)
 {
-  int pos = 0;
-  BufPtr ret(new Buffer(10));
-  ei_encode_ulonglong(ret->buf, &pos, num);
-  ret->size = pos;
-  return ret;
+  if(options.readers)
+    return options.readers;
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  //Body reads are mostly waiting on the disk, so have at least a couple in
+  //flight even on one CPU.
+  if(cpus < 2) return 2;
+  if(cpus > 16) return 16;
+  return cpus;
 }
 
-BufPtr binary_term(sized_buf* term)
+static unsigned seq_worker_count(const CompactOptions& options)
 {
-  int pos = 0;
-  BufPtr ret(new Buffer(term->size + 5));
-  ei_encode_binary(ret->buf, &pos, term->buf, term->size);
-  return ret;
+  if(options.seq_workers)
+    return options.seq_workers;
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  if(cpus < 1) return 1;
+  if(cpus > 16) return 16;
+  return cpus;
 }
 
-int copy_seq_index(DBHandle& original_db, DBHandle& new_db, int temp_fd)
+static unsigned compressor_count(const CompactOptions& options)
+{
+  if(options.compressors)
+    return options.compressors;
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  if(cpus < 1) return 1;
+  if(cpus > 16) return 16;
+  return cpus;
+}
+
+//Copy the `by_seq` tree a range of seqs per worker, if it's big enough to
+//split. Sets `*done` if it was.
+static int copy_seq_ranges(DBHandle& original_db, ChunkWriter* writer,
+                           DocSink* ids, Checkpoints* checkpoints,
+                           const CompactOptions& options,
+                           NodeBuilder<CountingReduce>& output, bool* done)
+{
+  SeqTreeCopies sinks;
+  SeqCopy ranges(original_db.get(), writer, &sinks, ids,
+                 seq_worker_count(options), options.spill_dir);
+  ranges.setSizing(options.seq_nodes);
+  int error = ranges.plan(done);
+  if(error || !*done) return error;
+  return ranges.run(output, checkpoints);
+}
+
+int copy_seq_index(DBHandle& original_db, DBHandle& new_db,
+                   ChunkWriter* writer, NodeCompressor* compressor,
+                   DocSink* ids, Checkpoints* checkpoints,
+                   const CompactOptions& options)
 {
   int error = 0;
-  CountingReduce seq_reduce;
-  NodeBuilder output(new_db.get(), &seq_reduce);
+  NodeBuilder<CountingReduce> output(writer);
+  output.setCompressor(compressor);
+  output.setSizing(options.seq_nodes);
+  output.setStreaming();
   //Run over the `by_seq` B-tree in the original db, copying the document bodies
   //into the new DB and creating a new, balanced `by_seq` btree.
-  SeqTreeCopy copier(&output, original_db.get(), new_db.get(), temp_fd);
-  error = original_db.changes(0, copier);
-  output.flush();
-  shared_ptr<NodePointer> seq_root = build_pointers(output);
-  seq_root->makeBySeqRoot(new_db);
+  SeqTreeCopy copier(&output, ids, checkpoints);
+  bool done = false;
+  uint64_t since = 0;
+  bool resuming = is_checkpoint(new_db);
+  Metrics::get().beginPhase(resuming ? "resume" : "by_seq");
+  if(resuming)
+  {
+    //Pick up after the last checkpoint. The rest goes in one pass, since the
+    //ranges are cut from the whole tree. The checkpoint's own docs, whose
+    //`by_seq` items are already written, only go to the `by_id` index.
+    uint64_t seq;
+    error = resume_checkpoint(original_db, new_db, output, ids, &seq);
+    if(error) return error;
+    since = seq + 1;
+    Metrics::get().beginPhase("by_seq");
+  }
+  else if(options.raw_bodies && seq_worker_count(options) > 1)
+  {
+    //Walk, copy and index ranges of the tree on a pool of workers. This
+    //leaves the leaf nodes written and their pointers in `output`.
+    error = copy_seq_ranges(original_db, writer, ids, checkpoints, options,
+                            output, &done);
+    if(error) return error;
+  }
+  if(!done && options.raw_bodies)
+  {
+    //Copy the bodies' chunks straight across, a run of them at a time.
+    ChunkCopier chunks(original_db.get(), writer, &copier);
+    error = original_db.changes(since, chunks);
+    int copy_error = chunks.finish();
+    if(!error) error = copy_error;
+  }
+  else if(!done)
+  {
+    //The bodies are read by a pool of threads and written, in seq order, by
+    //another, which also builds the `by_seq` nodes, while this thread walks
+    //the tree.
+    unsigned readers = reader_count(options);
+    DocPipeline pipeline(original_db.get(), writer, &copier, readers,
+                         readers * kPipelineDepthPerReader);
+    error = pipeline.start();
+    if(!error) error = original_db.changes(since, pipeline);
+    int pipeline_error = pipeline.finish();
+    if(!error) error = pipeline_error;
+  }
+  if(error) return error;
+  shared_ptr<NodePointer<CountingReduce> > seq_root;
+  error = output.finishTree(&seq_root);
+  if(!error && seq_root)
+  {
+    seq_root->makeBySeqRoot(new_db);
+    //Building `by_id` can take a while too, so don't lose this.
+    if(checkpoints)
+      error = checkpoints->commit(original_db->header.update_seq);
+  }
   return error;
 }
 
-BufPtr id_index_value_term(disk_docinfo* info)
+//## Building the `by_id` index
+//The final pass of the merge sort hands each docinfo, in ID order, straight to
+//this builder, so the sorted docinfos are never written back out and re-read.
+//Docs that come in ID order to begin with skip the sort; see `IdFeed`.
+class IdIndexBuilder {
+ public:
+  IdIndexBuilder(DBHandle& new_db, ChunkWriter* writer,
+                 NodeCompressor* compressor, const NodeSizing& sizing) :
+      new_db_(new_db), writer_(writer), output_(writer) {
+    output_.setCompressor(compressor);
+    output_.setSizing(sizing);
+    output_.setStreaming();
+  }
+  int add(disk_docinfo* info);
+  int finish();
+  //Give up on this index: write out the tree of what's been added so far,
+  //without making it the new file's, and read its items back into `sorter`.
+  int unwind(merge_sorter* sorter);
+  //Output callback for `merge_sort`
+  static int sorted_callback(void* record, void* ctx) {
+    return static_cast<IdIndexBuilder*>(ctx)->add(
+        static_cast<disk_docinfo*>(record));
+  }
+ private:
+  static int sort_item(couchfile_lookup_request* rq, void* k, sized_buf* v);
+  DBHandle& new_db_;
+  ChunkWriter* writer_;
+  NodeBuilder<ByIDReduce> output_;
+  DISALLOW_COPY_AND_ASSIGN(IdIndexBuilder);
+};
+
+//The docinfo as a record for the sorter: a `disk_docinfo` followed by the ID
+//and rev\_meta. Returns its length, or 0 if it's over `kMaxDocInfoRecord`.
+static unsigned docinfo_record(const DocInfo* info, char* record)
 {
-  char* srcbuf = ((char*) info) + sizeof(disk_docinfo);
-  // * 4 bytes - Tuple headers
-  // * ID len + 5 - info->rev\_meta encoded as a binary
-  // * up to 10 bytes - RevSeq,
-  // * rev\_meta len + 5 - info->rev\_meta encoded as a binary
-  // * up to 10 bytes - Bp
-  // * 2 bytes - Deleted Flag
-  // * 2 bytes - ContentMeta
-  // * up to 10 bytes - Size
-  int pos = 0;
-  const size_t maxsize = info->id_len + 5 + info->rev_meta_len + 48;
-  BufPtr value (new Buffer(maxsize));
-  ei_encode_tuple_header(value->buf, &pos, 6);
-  ei_encode_binary(value->buf, &pos, srcbuf, info->id_len);
-  srcbuf += info->id_len;
-  ei_encode_tuple_header(value->buf, &pos, 2);
-  ei_encode_ulonglong(value->buf, &pos, info->rev_seq);
-  ei_encode_binary(value->buf, &pos, srcbuf, info->rev_meta_len);
-  ei_encode_ulonglong(value->buf, &pos, info->bp);
-  ei_encode_ulonglong(value->buf, &pos, info->deleted);
-  ei_encode_ulonglong(value->buf, &pos, info->content_meta);
-  ei_encode_ulonglong(value->buf, &pos, info->size);
-  value->size = pos;
-  return value;
+  disk_docinfo* temp = reinterpret_cast<disk_docinfo*>(record);
+  size_t len = sizeof(disk_docinfo) + info->id.size + info->rev_meta.size;
+  if(len > kMaxDocInfoRecord)
+    return 0;
+  temp->len = len;
+  temp->id_len = info->id.size;
+  temp->db_seq = info->db_seq;
+  temp->rev_seq = info->rev_seq;
+  temp->rev_meta_len = info->rev_meta.size;
+  temp->deleted = info->deleted;
+  temp->content_meta = info->content_meta;
+  temp->bp = info->bp;
+  temp->size = info->size;
+  memcpy(record + sizeof(disk_docinfo), info->id.buf, info->id.size);
+  memcpy(record + sizeof(disk_docinfo) + info->id.size, info->rev_meta.buf,
+         info->rev_meta.size);
+  return len;
 }
 
-int build_id_index(DBHandle& new_db, FILE* tempfile)
+static int sort_record(merge_sorter* sorter, const char* record)
 {
-  char tmpbuf[1024];
-  disk_docinfo *info = (disk_docinfo*)(tmpbuf);
-  ByIDReduce id_reduce;
-  NodeBuilder output(new_db.get(), &id_reduce);
-  while(read_diskdocinfo(tempfile, tmpbuf, NULL) > 0)
-  {
-    sized_buf id = {tmpbuf + sizeof(disk_docinfo),
-                    info->id_len};
-    id_reduce(info);
-    output.addItem(KVPair(binary_term(&id),
-                          BufPtr(new Buffer((char*) "DICK", 4))));
-  }
-  output.flush();
-  shared_ptr<NodePointer> id_root = build_pointers(output);
-  id_root->makeByIdRoot(new_db);
+  const disk_docinfo* info = reinterpret_cast<const disk_docinfo*>(record);
+  if(merge_sorter_add(sorter, record, info->len) != 0)
+    return ERROR_WRITE;
   return 0;
 }
 
-int local_doc_copy(couchfile_lookup_request* rq, void* k, sized_buf *v)
+int IdIndexBuilder::add(disk_docinfo* info)
 {
-  sized_buf *key = static_cast<sized_buf*>(k);
-  NodeBuilder *output = static_cast<NodeBuilder*>(rq->callback_ctx);
-  output->addItem(KVPair(BufPtr(new Buffer(key->buf, key->size)),
-                         BufPtr(new Buffer(v->buf, v->size))));
-  return 0;
+  //The record as a DocInfo, its ID and rev meta pointing into the record.
+  DocInfo doc;
+  memset(&doc, 0, sizeof(doc));
+  doc.id.buf = ((char*) info) + sizeof(disk_docinfo);
+  doc.id.size = info->id_len;
+  doc.rev_meta.buf = doc.id.buf + info->id_len;
+  doc.rev_meta.size = info->rev_meta_len;
+  doc.db_seq = info->db_seq;
+  doc.rev_seq = info->rev_seq;
+  doc.bp = info->bp;
+  doc.deleted = info->deleted;
+  doc.content_meta = info->content_meta;
+  doc.size = info->size;
+  //The ID as a binary, then the value.
+  size_t key_size = term::binary_size(info->id_len);
+  size_t value_size = id_value_size(&doc);
+  char* item = output_.newItem(key_size + value_size);
+  if(item == NULL) return ERROR_ALLOC_FAIL;
+  put_id_value(term::put_binary(item, doc.id.buf, doc.id.size), &doc);
+  return output_.commitItem(key_size, value_size,
+                            ByIDReduce::Item(info->deleted, info->size));
 }
 
-int copy_local_docs(DBHandle& original_db, DBHandle& new_db)
+int IdIndexBuilder::finish()
 {
-  NullReduce null_reduce;
-  NodeBuilder output(new_db.get(), &null_reduce);
-  couchfile_lookup_request rq;
+  shared_ptr<NodePointer<ByIDReduce> > id_root;
+  int error = output_.finishTree(&id_root);
+  if(!error && id_root)
+    id_root->makeByIdRoot(new_db_);
+  return error;
+}
+
+//Where `sort_item` puts what it reads back.
+struct Unwind {
+  merge_sorter* sorter;
+  int error;
+};
+
+int IdIndexBuilder::sort_item(couchfile_lookup_request* rq, void* k,
+                              sized_buf* v)
+{
+  Unwind* unwind = static_cast<Unwind*>(rq->callback_ctx);
+  if(unwind->error)
+    return unwind->error;
+  DocInfo* info = decode_id_docinfo(static_cast<sized_buf*>(k), v);
+  if(info == NULL)
+    return unwind->error = ERROR_PARSE_TERM;
+  char record[kMaxDocInfoRecord];
+  if(docinfo_record(info, record) == 0)
+    unwind->error = ERROR_WRITE;
+  else
+    unwind->error = sort_record(unwind->sorter, record);
+  free_docinfo(info);
+  return unwind->error;
+}
+
+//The tree's nodes are read back from the new file, so they have to be out of
+//the compressor and the writer's buffer first.
+int IdIndexBuilder::unwind(merge_sorter* sorter)
+{
+  shared_ptr<NodePointer<ByIDReduce> > root;
+  int error = output_.finishTree(&root);
+  if(!error)
+    error = writer_->flush();
+  if(error || !root) return error;
+  sized_buf start = { NULL, 0 };
+  void* keys[1] = { &start };
   sized_buf tmp;
+  Unwind walk = { sorter, 0 };
+  couchfile_lookup_request rq;
   rq.cmp.arg = &tmp;
   rq.cmp.compare = ebin_cmp;
   rq.cmp.from_ext = ebin_from_ext;
-  sized_buf empty;
-  empty.buf = NULL;
-  empty.size = 0;
-  void* keys[1] = { &empty };
   rq.keys = keys;
   rq.num_keys = 1;
   rq.fold = 1;
-  rq.fd = original_db.get()->fd;
-  rq.fetch_callback = local_doc_copy;
-  rq.callback_ctx = &output;
-  btree_lookup(&rq, original_db.get()->header.local_docs_root->pointer);
-  output.flush();
-  shared_ptr<NodePointer> local_docs_root = build_pointers(output);
+  rq.in_fold = 0;
+  rq.fd = new_db_->fd;
+  rq.fetch_callback = sort_item;
+  rq.callback_ctx = &walk;
+  error = btree_lookup(&rq, root->pointer());
+  if(error < 0) return error;
+  return walk.error;
+}
+
+//## Feeding the `by_id` index
+//Every doc reaches the `by_id` index through an `IdFeed`, in seq order, once
+//its body is in the new file. In buckets whose IDs increase with their seqs
+//(timestamps, counters) that's already ID order, so the docs are streamed
+//straight into an `IdIndexBuilder` for as long as they stay in it, and never
+//sorted, spilled or merged at all.
+//
+//The first `kHeldIdBytes` of records are held back before any are streamed:
+//docs that aren't in ID order nearly always show it straight away, and then
+//go to the sorter without anything having been written. At the first doc out
+//of order after that, what's been streamed is read back into the sorter,
+//which takes the rest too, and the nodes written for it are left unused.
+static const size_t kHeldIdBytes = 1024 * 1024;
+
+class IdFeed : public DocSink {
+ public:
+  //`streamed` builds the index from docs that came in ID order, `sorted`
+  //from the output of `sorter` if they didn't.
+  IdFeed(IdIndexBuilder* streamed, IdIndexBuilder* sorted,
+         merge_sorter* sorter) :
+      streamed_(streamed), sorted_(sorted), sorter_(sorter),
+      state_(kHolding) { }
+  int add(DocInfo* info);
+  //Finish the `by_id` index, whichever way it's being built.
+  int finish();
+ private:
+  enum State {
+    kHolding,
+    kStreaming,
+    kSorting
+  };
+  int stream_held();
+  int sort_all();
+  IdIndexBuilder* streamed_;
+  IdIndexBuilder* sorted_;
+  merge_sorter* sorter_;
+  State state_;
+  //Records held back, end to end, and the last record added before the
+  //switch to sorting.
+  std::vector<char> held_;
+  std::vector<char> last_;
+  DISALLOW_COPY_AND_ASSIGN(IdFeed);
+};
+
+int IdFeed::add(DocInfo* info)
+{
+  char record[kMaxDocInfoRecord];
+  unsigned len = docinfo_record(info, record);
+  if(len == 0)
+    return ERROR_WRITE;
+  if(state_ != kSorting && !last_.empty() &&
+     compare_diskdocinfo(&last_[0], record, NULL) > 0)
+  {
+    int error = sort_all();
+    if(error) return error;
+  }
+  if(state_ == kSorting)
+    return sort_record(sorter_, record);
+  last_.assign(record, record + len);
+  if(state_ == kStreaming)
+    return streamed_->add(reinterpret_cast<disk_docinfo*>(record));
+  held_.insert(held_.end(), record, record + len);
+  if(held_.size() < kHeldIdBytes)
+    return 0;
+  state_ = kStreaming;
+  return stream_held();
+}
+
+int IdFeed::stream_held()
+{
+  int error = 0;
+  for(size_t pos = 0; pos < held_.size() && !error;)
+  {
+    disk_docinfo* info = reinterpret_cast<disk_docinfo*>(&held_[pos]);
+    pos += info->len;
+    error = streamed_->add(info);
+  }
+  std::vector<char>().swap(held_);
+  return error;
+}
+
+//A doc came out of order: everything so far goes to the sorter, and so does
+//everything after.
+int IdFeed::sort_all()
+{
+  int error = 0;
+  if(state_ == kStreaming)
+    error = streamed_->unwind(sorter_);
+  for(size_t pos = 0; pos < held_.size() && !error;)
+  {
+    error = sort_record(sorter_, &held_[pos]);
+    pos += reinterpret_cast<disk_docinfo*>(&held_[pos])->len;
+  }
+  std::vector<char>().swap(held_);
+  std::vector<char>().swap(last_);
+  state_ = kSorting;
+  return error;
+}
+
+int IdFeed::finish()
+{
+  if(state_ != kSorting)
+  {
+    int error = stream_held();
+    if(error) return error;
+    return streamed_->finish();
+  }
+  //The last merge pass feeds the new `by_id` index directly.
+  int error = merge_sorter_finish(sorter_, NULL);
+  if(error) return error;
+  return sorted_->finish();
+}
+
+//## Copying the local docs
+//Local docs are copied a node at a time, as they are; see raw_tree_copy.hh.
+//The tree has no reduce, so its root's reduce is _[]_.
+int copy_local_docs(DBHandle& original_db, DBHandle& new_db,
+                    ChunkWriter* writer)
+{
+  node_pointer* root = original_db.get()->header.local_docs_root;
+  uint64_t pointer;
+  int64_t growth = 0;
+  int error = copy_subtree(original_db.get()->fd, root->pointer, writer,
+                           &pointer, &growth);
+  if(error) return error;
+  NodePointer<NullReduce> local_docs_root(pointer, NullReduce(),
+                                          root->subtreesize + growth,
+                                          BufPtr());
+  local_docs_root.makeLocalDocsRoot(new_db);
   return 0;
 }
 
-int finish_compact(DBHandle& original_db, DBHandle& new_db)
+int finish_compact(DBHandle& original_db, DBHandle& new_db,
+                   ChunkWriter* writer, NodeCompressor* compressor)
 {
   int error = 0;
   //Main data and indexes are copied, so now we need to copy the local docs and
-  //header info, and write our new header.
+  //header info, and write our new header. The source's local docs replace
+  //any the new file has, which are a checkpoint's, or an older copy.
+  free(new_db->header.local_docs_root);
+  new_db->header.local_docs_root = NULL;
   if(original_db->header.local_docs_root)
-    error = copy_local_docs(original_db, new_db);
+  {
+    Metrics::get().beginPhase("local_docs");
+    error = copy_local_docs(original_db, new_db, writer);
+  }
+  //The header is written by couchstore, at the end of what's been flushed.
+  Metrics::get().beginPhase("commit");
+  if(compressor)
+  {
+    int compress_error = compressor->finish();
+    if(!error)
+      error = compress_error;
+  }
+  if(!error)
+    error = writer->flush();
   if(error) return error;
   new_db->header.update_seq = original_db->header.update_seq;
   new_db->header.purge_seq = original_db->header.purge_seq;
+  //A `.compact` being caught up has purged docs of its own, from when it
+  //was copied; they're replaced.
+  free(new_db->header.purged_docs);
   new_db->header.purged_docs = original_db->header.purged_docs;
   //**_Hackish_**! -Move- the purged docs object onto to the new db's header.
   //We have to clear it from the original so it isn't double free()'d.
   //Important we don't actually write a new header for the original DB.
   original_db->header.purged_docs = NULL;
-  new_db.commit();
-  return 0;
+  return new_db.commit();
+}
+
+//## Catching up
+//Bring a `.compact` file left by an earlier compaction up to date; see
+//catch_up.hh. The local docs are few, so they're just copied again.
+static int catch_up(DBHandle& original_db, DBHandle& compacted)
+{
+  Metrics::get().beginPhase("catch_up");
+  ChunkWriter writer(compacted.get());
+  int error = CatchUp(original_db, compacted, &writer).run();
+  if(error) return error;
+  return finish_compact(original_db, compacted, &writer, NULL);
 }
 
-int compact (std::string& filename)
+//## Compacting
+//Copy everything into `new_db`, which is either new or holds a checkpoint to
+//resume from.
+static int copy_compact(DBHandle& original_db, DBHandle& new_db,
+                        const CompactOptions& options)
 {
   int error = 0;
+  //Everything up to the header is appended through one write-behind buffer.
+  //B-tree nodes get there by way of a pool of threads compressing them.
+  ChunkWriter writer(new_db.get());
+  NodeCompressor compressor(&writer, compressor_count(options),
+                            compressor_count(options) *
+                            kCompressDepthPerThread);
+  error = compressor.start();
+  if(error) return error;
+  //We also feed all the docinfos, in seq order, to the `by_id` index. If
+  //they come in ID order, as they do in buckets whose IDs increase with their
+  //seqs, they're streamed straight into it. Otherwise they go to a sorter,
+  //which sorts and spills runs on a background thread while we're still
+  //copying the `by_seq` tree, so only the final merge is left once that's
+  //done; if the docinfos fit in its memory, they're never written to a
+  //temporary file at all.
+  IdIndexBuilder id_index(new_db, &writer, &compressor, options.id_nodes);
+  IdIndexBuilder streamed_id_index(new_db, &writer, &compressor,
+                                   options.id_nodes);
+  merge_sort_params sort_params;
+  merge_sort_default_params(&sort_params);
+  sort_params.compare = compare_diskdocinfo;
+  sort_params.prefix = prefix_diskdocinfo;
+  sort_params.key = key_diskdocinfo;
+  sort_params.run_sort = MERGE_SORT_RUNS_BY_RADIX;
+  sort_params.output = IdIndexBuilder::sorted_callback;
+  sort_params.output_pointer = &id_index;
+  sort_params.max_record_size = kMaxDocInfoRecord;
+  sort_params.background = 1;
+  //Two arenas: one filling while the other is sorted and spilled.
+  sort_params.run_bytes = options.sort_memory / 2;
+  sort_params.spill_dir = options.spill_dir;
+  merge_sorter* sorter = merge_sorter_open(&sort_params);
+  if(sorter == NULL) return ERROR_ALLOC_FAIL;
+  IdFeed ids(&streamed_id_index, &id_index, sorter);
+  Checkpoints checkpoints(original_db, new_db, &writer,
+                          options.checkpoint_interval);
+  error = copy_seq_index(original_db, new_db, &writer, &compressor, &ids,
+                         options.checkpoint_interval ? &checkpoints : NULL,
+                         options);
+  Metrics::get().beginPhase("by_id");
+  if(!error)
+    error = ids.finish();
+  merge_sort_stats sort_stats;
+  merge_sorter_stats(sorter, &sort_stats);
+  Metrics::get().setSortStats(sort_stats);
+  merge_sorter_close(sorter);
+  if(error) return error;
+  return finish_compact(original_db, new_db, &writer, &compressor);
+}
+
+int compact (std::string& filename, const CompactOptions& options)
+{
   //Open the original database
+  Metrics::get().beginPhase("open");
   DBHandle original_db(filename, false);
-  //And create the new file
+  if(original_db.isValid())
+    Metrics::get().setFile(original_db->fd, Metrics::kSourceFile);
+  if(options.resume || options.catch_up)
+  {
+    DBHandle compacted(filename + ".compact", false);
+    if(compacted.isValid())
+      Metrics::get().setFile(compacted->fd, Metrics::kTargetFile);
+    if(options.resume && can_resume(original_db, compacted))
+    {
+      //A checkpoint that doesn't parse is no use: start over without it.
+      int error = copy_compact(original_db, compacted, options);
+      if(error != ERROR_PARSE_TERM)
+        return error;
+    }
+    if(options.catch_up && can_catch_up(original_db, compacted))
+      return catch_up(original_db, compacted);
+  }
+  //Otherwise create the new file, from nothing, so no header (and no roots)
+  //from an earlier attempt are left in it.
+  unlink((filename + ".compact").c_str());
   DBHandle new_db(filename + ".compact", true);
+  Metrics::get().setFile(new_db->fd, Metrics::kTargetFile);
   //Rewind the file pointer to 0 so that we don't leave a valid header at the
   //beginning of the file.
   new_db->file_pos = 1;
-  //We also create a temporary file and store all the docinfos in it, which
-  //we will use to build the `by_id` index after we sort it by ID.
-  std::string tmpname = filename + ".temp.comact";
-  int temp_fd = open(tmpname.c_str(), O_CREAT | O_RDWR, 0744);
-  error = copy_seq_index(original_db, new_db, temp_fd);
-  close(temp_fd);
-  if(error) return error;
-  //**TODO** _go make this sorter work on fds and not `FILE*`s_
-  FILE* in = fopen(tmpname.c_str(), "r");
-  merge_sort(in, in, read_diskdocinfo, write_diskdocinfo,
-             compare_diskdocinfo, NULL, 1024, 10000, NULL);
-  fseek(in, 0, SEEK_SET);
-  error = build_id_index(new_db, in);
-  fclose(in);
-  finish_compact(original_db, new_db);
-  unlink(tmpname.c_str());
-  return error;
+  return copy_compact(original_db, new_db, options);
 }
 
-//Encode the erlang term _{(buf), {RevSeq, RevMeta}, Bp, Deleted,
-//ContentMeta, Size}_
-BufPtr docinfo_term(BufPtr firstterm, DocInfo* info)
+//## Node sizing options
+//Set `kind` of limit (leaf, interior, or both) in `sizing`.
+static bool set_node_limit(NodeSizing* sizing, const std::string& kind,
+                           const NodeLimit& limit)
 {
-  // * 4 bytes - Tuple headers
-  // * buf->size
-  // * up to 10 bytes - RevSeq,
-  // * info->rev\_meta.size + 5 - info->rev\_meta encoded as a binary
-  // * up to 10 bytes - Bp
-  // * 2 bytes - Deleted Flag
-  // * 2 bytes - ContentMeta
-  // * up to 10 bytes - Size
-  int pos = 0;
-  const size_t maxsize = firstterm->size + info->rev_meta.size + 48;
-  BufPtr value (new Buffer(maxsize));
-  ei_encode_tuple_header(value->buf, &pos, 6);
-  memcpy(value->buf + pos, firstterm->buf, firstterm->size);
-  pos += firstterm->size;
-  ei_encode_tuple_header(value->buf, &pos, 2);
-  ei_encode_ulonglong(value->buf, &pos, info->rev_seq);
-  ei_encode_binary(value->buf, &pos, info->rev_meta.buf, info->rev_meta.size);
-  ei_encode_ulonglong(value->buf, &pos, info->bp);
-  ei_encode_ulonglong(value->buf, &pos, info->deleted);
-  ei_encode_ulonglong(value->buf, &pos, info->content_meta);
-  ei_encode_ulonglong(value->buf, &pos, info->size);
-  value->size = pos;
-  return value;
+  if(kind == "leaf" || kind == "node")
+    sizing->leaf = limit;
+  if(kind == "interior" || kind == "node")
+    sizing->interior = limit;
+  return kind == "leaf" || kind == "interior" || kind == "node";
 }
 
-//Called for each item in the source DB's `by_seq` B-tree.
-int SeqTreeCopy::callback(DocumentInfo& info)
+bool parse_node_sizing(const char* spec, CompactOptions* options)
 {
-  //Read the document body
-  Doc* doc;
-  if(open_doc_with_docinfo(source_, info.get(), &doc, 0) < 0)
-    return ERROR_READ;
-  //Write the document body to the new file.
-  off_t new_position = 0;
-  if(db_write_buf(target_, &doc->data, &new_position) < 0)
-    return ERROR_WRITE;
-  free_doc(doc);
-  info->bp = new_position;
-  //Add the correct KV pair to the new file's by\_seq tree.
-  builder_->addItem(KVPair(number_term(info->db_seq),
-                           docinfo_term(binary_term(&(info->id)), info.get())));
-  //Write the DocInfo value to the temporary file.
-  disk_docinfo temp;
-  temp.len = sizeof(temp) + info->id.size + info->rev_meta.size;
-  temp.id_len = info->id.size;
-  temp.db_seq = info->db_seq;
-  temp.rev_seq = info->rev_seq;
-  temp.rev_meta_len = info->rev_meta.size;
-  temp.deleted = info->deleted;
-  temp.content_meta = info->content_meta;
-  temp.bp = info->bp;
-  temp.size = info->size;
-  write(temp_fd_, &temp, sizeof(temp));
-  write(temp_fd_, info->id.buf, info->id.size);
-  write(temp_fd_, info->rev_meta.buf, info->rev_meta.size);
-  return 0;
+  std::string rest(spec);
+  while(!rest.empty())
+  {
+    size_t comma = rest.find(',');
+    std::string item = rest.substr(0, comma);
+    rest = comma == std::string::npos ? "" : rest.substr(comma + 1);
+    size_t equals = item.find('=');
+    if(equals == std::string::npos) return false;
+    std::string name = item.substr(0, equals);
+    const char* value = item.c_str() + equals + 1;
+    char* end;
+    NodeLimit limit(strtoull(value, &end, 10));
+    if(end == value) return false;
+    if(*end == 'c')
+    {
+      limit.compressed = true;
+      end++;
+    }
+    if(*end != '\0' || limit.bytes == 0) return false;
+    std::string tree;
+    size_t dot = name.find('.');
+    if(dot != std::string::npos)
+    {
+      tree = name.substr(0, dot);
+      name = name.substr(dot + 1);
+    }
+    bool known = false;
+    if(tree.empty() || tree == "seq")
+      known = set_node_limit(&options->seq_nodes, name, limit);
+    if(tree.empty() || tree == "id")
+      known = set_node_limit(&options->id_nodes, name, limit);
+    if(!known) return false;
+  }
+  return true;
 }
+
+//Called for each item in the source DB's `by_seq` B-tree, in order, once its
+//body has been copied to the new file.
+int SeqTreeCopy::add(DocInfo* info)
+{
+  //Add the correct KV pair to the new file's by\_seq tree, encoding it once,
+  //straight into the node being built: the seq, then the docinfo.
+  size_t key_size = term::ulonglong_size(info->db_seq);
+  size_t value_size = seq_value_size(info);
+  char* item = builder_->newItem(key_size + value_size);
+  if(item == NULL)
+    return ERROR_ALLOC_FAIL;
+  put_seq_value(term::put_ulonglong(item, info->db_seq), info);
+  Metrics::get().add(Metrics::kDocs);
+  int error = builder_->commitItem(key_size, value_size);
+  if(!error && ids_)
+    error = ids_->add(info);
+  if(!error && checkpoints_ && checkpoints_->due())
+    error = checkpoints_->write(*builder_, info->db_seq);
+  return error;
+}
+}
+
+static void usage(const char* prog)
+{
+  printf("Usage: %s [-t spill_dir] [-m sort_mb] [-j readers] [-p workers] "
+         "[-z compressors] [-n sizing] [-S sizing]... [-c seconds] [-R] [-U] "
+         "[-F] [-M report] [-I seconds] file.couch\n",
+         prog);
+  printf("  -t  directory for temporary sort files\n");
+  printf("  -m  megabytes of memory for sorting docinfos by ID (default %lu)\n",
+         (unsigned long) (couchstore::kDefaultSortMemory >> 20));
+  printf("  -j  threads reading document bodies (with -R)\n");
+  printf("  -p  threads copying ranges of the by_seq tree (default one per\n"
+         "      CPU, up to 16; 1 copies it in one pass)\n");
+  printf("  -z  threads compressing B-tree nodes (default one per CPU, up to\n"
+         "      16)\n");
+  printf("  -n  node size limits, as [tree.]kind=bytes[c],... where tree is\n"
+         "      seq or id (default both), kind is leaf, interior or node\n"
+         "      (both), and c limits the compressed size (default\n"
+         "      node=%lu)\n", (unsigned long) couchstore::kChunkThreshold);
+  printf("  -S  compact once with each given sizing (or 'default') and report\n"
+         "      output size, build time and ID lookup latency, then remove\n"
+         "      the output\n");
+  printf("  -c  seconds between checkpoints a killed compaction can be resumed\n"
+         "      from (default %u; 0 takes none)\n",
+         couchstore::kDefaultCheckpointInterval);
+  printf("  -R  read and rewrite each document body instead of copying the\n"
+         "      raw chunks\n");
+  printf("  -U  catch up file.couch.compact, if it's a finished compaction of\n"
+         "      file.couch, instead of starting over. Only safe if file.couch\n"
+         "      hasn't been deleted and recreated, or restored, since\n");
+  printf("  -F  start over, even if file.couch.compact holds a checkpoint that\n"
+         "      could be resumed\n");
+  printf("  -M  write a JSON report of time, I/O, node, sort and queue\n"
+         "      metrics per phase to this file ('-' for stdout) at the end\n");
+  printf("  -I  with -M, also report every this many seconds while compacting\n");
 }
 
 int main(int argc, char **argv)
 {
-  if(argc < 2)
+  couchstore::CompactOptions options;
+  std::vector<const char*> sweep;
+  const char* report = NULL;
+  unsigned report_interval = 0;
+  int opt;
+  while((opt = getopt(argc, argv, "t:m:j:p:z:n:S:c:RUFM:I:")) != -1)
+  {
+    switch(opt)
+    {
+      case 't':
+        options.spill_dir = optarg;
+        break;
+      case 'm':
+        options.sort_memory = (size_t) atol(optarg) << 20;
+        break;
+      case 'j':
+        options.readers = atoi(optarg);
+        break;
+      case 'p':
+        options.seq_workers = atoi(optarg);
+        break;
+      case 'z':
+        options.compressors = atoi(optarg);
+        break;
+      case 'n':
+        if(!couchstore::parse_node_sizing(optarg, &options))
+        {
+          printf("Bad node sizing: %s\n", optarg);
+          usage(argv[0]);
+          return 1;
+        }
+        break;
+      case 'S':
+        sweep.push_back(optarg);
+        break;
+      case 'c':
+        options.checkpoint_interval = atoi(optarg);
+        break;
+      case 'R':
+        options.raw_bodies = false;
+        break;
+      case 'U':
+        options.catch_up = true;
+        break;
+      case 'F':
+        options.resume = false;
+        break;
+      case 'M':
+        report = optarg;
+        break;
+      case 'I':
+        report_interval = atoi(optarg);
+        break;
+      default:
+        usage(argv[0]);
+        return 1;
+    }
+  }
+  if(optind >= argc)
+  {
     printf("Must specify file to compact.\n");
-  std::string filename(argv[1]);
+    usage(argv[0]);
+    return 1;
+  }
+  std::string filename(argv[optind]);
+  if(!sweep.empty())
+    return couchstore::sweep_node_sizing(filename, options, sweep);
+  couchstore::MetricsReporter reporter(report ? report : "-",
+                                      report_interval);
+  if(report && reporter.start() != 0)
+  {
+    fprintf(stderr, "Can't write report to %s\n", report);
+    return 1;
+  }
   timeval start, stop;
   gettimeofday(&start, 0);
-  int error = couchstore::compact(filename);
+  int error = couchstore::compact(filename, options);
   gettimeofday(&stop, 0);
-  printf("time: %lu\n", stop.tv_sec - start.tv_sec);
+  couchstore::Metrics::get().endPhase();
+  //Keep stdout to the report alone if that's where it's going.
+  bool report_on_stdout = report && strcmp(report, "-") == 0;
+  fprintf(report_on_stdout ? stderr : stdout, "time: %lu\n",
+          stop.tv_sec - start.tv_sec);
+  if(report && reporter.finish(error) != 0)
+    fprintf(stderr, "Can't write report to %s\n", report);
   return error;
 }
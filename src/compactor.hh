@@ -0,0 +1,66 @@
+#ifndef COUCH_COMPACTOR_H
+#define COUCH_COMPACTOR_H
+#include <stddef.h>
+#include <string>
+#include "btree_copy.hh"
+#include "checkpoint.hh"
+namespace couchstore
+{
+//Default memory for sorting docinfos by ID. Up to this much (less the 16
+//byte index entry per docinfo) is sorted without a temporary file.
+static const size_t kDefaultSortMemory = 256 * 1024 * 1024;
+
+//Settings from the command line.
+struct CompactOptions {
+  CompactOptions() : spill_dir(NULL), sort_memory(kDefaultSortMemory),
+      readers(0), seq_workers(0), compressors(0), raw_bodies(true),
+      catch_up(false), resume(true),
+      checkpoint_interval(kDefaultCheckpointInterval) { }
+  //Where the ID sorter puts the runs it can't keep in memory. NULL means
+  //$TMPDIR, or /tmp.
+  const char* spill_dir;
+  //Memory the ID sorter works in.
+  size_t sort_memory;
+  //Threads reading document bodies; 0 means one per CPU.
+  unsigned readers;
+  //Threads copying ranges of the `by_seq` tree; 0 means one per CPU.
+  unsigned seq_workers;
+  //Threads compressing B-tree nodes; 0 means one per CPU.
+  unsigned compressors;
+  //Copy body chunks as they are on disk, rather than reading each body and
+  //writing it back out.
+  bool raw_bodies;
+  //If there's a finished `.compact` file left from an earlier compaction,
+  //catch it up with what's been written since, rather than starting over.
+  //Off by default: nothing in the file says which source it was compacted
+  //from, so one left from a database since deleted and recreated, or
+  //restored from a backup, would be caught up all the same.
+  bool catch_up;
+  //If there's a checkpoint left from an earlier compaction, resume it.
+  bool resume;
+  //Seconds between checkpoints of a compaction, to resume from if it's
+  //killed; 0 means none are taken.
+  unsigned checkpoint_interval;
+  //How full each tree's nodes get. The local docs tree's nodes are copied as
+  //they are.
+  NodeSizing seq_nodes;
+  NodeSizing id_nodes;
+};
+
+//Compact `filename` into `filename`.compact, or bring an existing
+//`filename`.compact up to date, or resume one from its last checkpoint.
+int compact(std::string& filename, const CompactOptions& options);
+
+//Set node limits in `options` from `spec`, a comma separated list of
+//`[tree.]kind=bytes[c]`:
+//
+// * `tree` is `seq` or `id`, or left out for both;
+// * `kind` is `leaf`, `interior` or `node` (both);
+// * a trailing `c` makes `bytes` a limit on the compressed size.
+//
+//So `leaf=4096,id.interior=2048c` gives every tree 4096 byte leaves, and the
+//`by_id` tree pointer nodes of about 2048 bytes on disk. Returns false if
+//`spec` doesn't parse.
+bool parse_node_sizing(const char* spec, CompactOptions* options);
+}
+#endif
@@ -0,0 +1,192 @@
+#include "doc_pipeline.hh"
+#include "metrics.hh"
+namespace couchstore
+{
+DocPipeline::DocPipeline(Db* source, ChunkWriter* target, DocSink* sink,
+                         unsigned readers, unsigned depth)
+    : source_(source), target_(target), sink_(sink),
+      reader_count_(readers ? readers : 1), slots_(depth ? depth : 1),
+      head_(0), next_read_(0), tail_(0), closing_(false), error_(0)
+{
+  for(std::vector<Slot>::iterator it = slots_.begin(); it != slots_.end(); ++it)
+  {
+    (*it).info = NULL;
+    (*it).doc = NULL;
+    (*it).state = kEmpty;
+  }
+  pthread_mutex_init(&lock_, NULL);
+  pthread_cond_init(&not_full_, NULL);
+  pthread_cond_init(&work_, NULL);
+  pthread_cond_init(&ready_, NULL);
+}
+
+DocPipeline::~DocPipeline()
+{
+  finish();
+  pthread_mutex_destroy(&lock_);
+  pthread_cond_destroy(&not_full_);
+  pthread_cond_destroy(&work_);
+  pthread_cond_destroy(&ready_);
+}
+
+int DocPipeline::start()
+{
+  pthread_t thread;
+  if(pthread_create(&thread, NULL, appender_main, this) != 0)
+    return ERROR_ALLOC_FAIL;
+  threads_.push_back(thread);
+  for(unsigned i = 0; i < reader_count_; i++)
+  {
+    if(pthread_create(&thread, NULL, reader_main, this) != 0)
+    {
+      pthread_mutex_lock(&lock_);
+      fail(ERROR_ALLOC_FAIL);
+      pthread_mutex_unlock(&lock_);
+      break;
+    }
+    threads_.push_back(thread);
+  }
+  pthread_mutex_lock(&lock_);
+  int error = error_;
+  pthread_mutex_unlock(&lock_);
+  return error;
+}
+
+//Called with the lock held. Only the first error is kept; after it, readers
+//stop reading, the appender only frees what comes through, and `push` turns
+//docs away.
+void DocPipeline::fail(int error)
+{
+  if(!error_)
+    error_ = error;
+}
+
+int DocPipeline::push(DocInfo* info)
+{
+  pthread_mutex_lock(&lock_);
+  while(head_ - tail_ == slots_.size())
+    pthread_cond_wait(&not_full_, &lock_);
+  int error = error_;
+  if(error)
+  {
+    pthread_mutex_unlock(&lock_);
+    free_docinfo(info);
+    return error;
+  }
+  Slot& slot = slots_[head_ % slots_.size()];
+  slot.info = info;
+  slot.doc = NULL;
+  slot.state = kQueued;
+  head_++;
+  Metrics::get().depth(Metrics::kPipelineQueue, head_ - tail_);
+  pthread_cond_signal(&work_);
+  pthread_mutex_unlock(&lock_);
+  return 0;
+}
+
+int DocPipeline::callback(DocumentInfo& info)
+{
+  return push(info.release());
+}
+
+int DocPipeline::finish()
+{
+  pthread_mutex_lock(&lock_);
+  closing_ = true;
+  pthread_cond_broadcast(&work_);
+  pthread_cond_broadcast(&ready_);
+  pthread_mutex_unlock(&lock_);
+  for(std::vector<pthread_t>::iterator it = threads_.begin();
+      it != threads_.end(); ++it)
+    pthread_join(*it, NULL);
+  threads_.clear();
+  return error_;
+}
+
+void* DocPipeline::reader_main(void* ctx)
+{
+  static_cast<DocPipeline*>(ctx)->read_docs();
+  return NULL;
+}
+
+void* DocPipeline::appender_main(void* ctx)
+{
+  static_cast<DocPipeline*>(ctx)->append_docs();
+  return NULL;
+}
+
+//## Reader stage
+//Claim the oldest doc nobody is reading yet and read its body. Reads of the
+//source file are all `pread`s, so any number can be in flight at once, and
+//alongside the caller's walk of the source B-tree.
+void DocPipeline::read_docs()
+{
+  pthread_mutex_lock(&lock_);
+  while(true)
+  {
+    while(next_read_ == head_ && !closing_)
+      pthread_cond_wait(&work_, &lock_);
+    if(next_read_ == head_)
+      break;
+    Slot& slot = slots_[next_read_ % slots_.size()];
+    uint64_t seq = next_read_++;
+    int error = error_;
+    pthread_mutex_unlock(&lock_);
+    Doc* doc = NULL;
+    if(!error && open_doc_with_docinfo(source_, slot.info, &doc, 0) < 0)
+      error = ERROR_READ;
+    //Couchstore does the reading, so count it here.
+    if(!error)
+      Metrics::get().read(source_->fd, slot.info->size);
+    pthread_mutex_lock(&lock_);
+    if(error)
+      fail(error);
+    slot.doc = doc;
+    slot.state = kRead;
+    if(seq == tail_)
+      pthread_cond_signal(&ready_);
+  }
+  pthread_mutex_unlock(&lock_);
+}
+
+//## Appender stage
+//Write the bodies out in the order they were pushed, whichever order the
+//readers finish them in.
+void DocPipeline::append_docs()
+{
+  pthread_mutex_lock(&lock_);
+  while(true)
+  {
+    while(!(tail_ < head_ && slots_[tail_ % slots_.size()].state == kRead) &&
+          !(tail_ == head_ && closing_))
+      pthread_cond_wait(&ready_, &lock_);
+    if(tail_ == head_)
+      break;
+    Slot& slot = slots_[tail_ % slots_.size()];
+    int error = error_;
+    pthread_mutex_unlock(&lock_);
+    if(!error)
+    {
+      off_t new_position = 0;
+      error = target_->write(&slot.doc->data, &new_position);
+      if(!error)
+      {
+        slot.info->bp = new_position;
+        error = sink_->add(slot.info);
+      }
+    }
+    if(slot.doc)
+      free_doc(slot.doc);
+    free_docinfo(slot.info);
+    pthread_mutex_lock(&lock_);
+    if(error)
+      fail(error);
+    slot.info = NULL;
+    slot.doc = NULL;
+    slot.state = kEmpty;
+    tail_++;
+    pthread_cond_signal(&not_full_);
+  }
+  pthread_mutex_unlock(&lock_);
+}
+}
@@ -0,0 +1,83 @@
+#ifndef COUCH_DOC_PIPELINE_H
+#define COUCH_DOC_PIPELINE_H
+#include <libcouchstore/couch_db.h>
+#include <pthread.h>
+#include <vector>
+#include "wrap.hh"
+#include "chunk_writer.hh"
+//# Document body copy pipeline
+//Copies document bodies from one file to another with the reads, the writes
+//and whatever is done with each written doc all overlapping:
+//
+// * The caller pushes docinfos in, in the order they should be written.
+// * A pool of reader threads reads (and decompresses) the bodies from the
+//   source file, as many at a time as there are readers.
+// * A single appender thread writes the bodies to the target file strictly
+//   in push order, points each docinfo's `bp` at the new copy, and hands the
+//   docinfo to a `DocSink`.
+//
+//Docs move between the stages through a ring of `depth` slots, which bounds
+//how many bodies are held in memory at once; pushing blocks while the ring
+//is full.
+namespace couchstore
+{
+//Gets every written doc, in push order, on the appender thread. Anything
+//else that appends to the target file must happen here too, so it doesn't
+//race the body writes.
+class DocSink {
+ public:
+  virtual ~DocSink() { }
+  virtual int add(DocInfo* info) = 0;
+};
+
+//Is itself an `InfoCallback`, so it can be fed straight from
+//`DBHandle::changes`.
+class DocPipeline : public InfoCallback {
+ public:
+  DocPipeline(Db* source, ChunkWriter* target, DocSink* sink, unsigned readers,
+              unsigned depth);
+  ~DocPipeline();
+  int start();
+  //Queue a doc to be copied. The pipeline takes ownership of `info`.
+  int push(DocInfo* info);
+  int callback(DocumentInfo& info);
+  //Wait for every queued doc to be written and handed to the sink, and stop
+  //the threads. Returns the first error any stage hit.
+  int finish();
+ private:
+  enum SlotState {
+    kEmpty,
+    kQueued,
+    kRead
+  };
+  struct Slot {
+    DocInfo* info;
+    Doc* doc;
+    SlotState state;
+  };
+  static void* reader_main(void* ctx);
+  static void* appender_main(void* ctx);
+  void read_docs();
+  void append_docs();
+  void fail(int error);
+  Db* source_;
+  ChunkWriter* target_;
+  DocSink* sink_;
+  unsigned reader_count_;
+  std::vector<Slot> slots_;
+  std::vector<pthread_t> threads_;
+  //Docs `tail_` up to `head_` are in the ring; readers have claimed the ones
+  //before `next_read_`.
+  uint64_t head_;
+  uint64_t next_read_;
+  uint64_t tail_;
+  bool closing_;
+  int error_;
+  pthread_mutex_t lock_;
+  pthread_cond_t not_full_;
+  pthread_cond_t work_;
+  pthread_cond_t ready_;
+  DISALLOW_COPY_AND_ASSIGN(DocPipeline);
+};
+}
+#endif
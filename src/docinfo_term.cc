@@ -0,0 +1,93 @@
+#include <stdlib.h>
+#include <ei.h>
+#include "docinfo_term.hh"
+namespace couchstore
+{
+//Decode an item of either index. The ID is the key of a `by_id` item, and
+//the seq the first element of its value; a `by_seq` item has them the other
+//way round.
+static DocInfo* decode_item(const sized_buf* k, const sized_buf* v,
+                            bool by_id)
+{
+  unsigned long long seq, rev_seq, bp, deleted, content_meta, size;
+  int pos = 0;
+  int arity, rev_arity, id_type, meta_type, id_size, meta_size;
+  const sized_buf* id_term = by_id ? k : v;
+  int id_pos;
+  if(by_id)
+  {
+    if(ei_get_type(k->buf, &pos, &id_type, &id_size) ||
+       id_type != ERL_BINARY_EXT)
+      return NULL;
+    id_pos = pos;
+    if(ei_skip_term(k->buf, &pos) || (size_t) pos > k->size)
+      return NULL;
+  }
+  else if(ei_decode_ulonglong(k->buf, &pos, &seq) || (size_t) pos > k->size)
+    return NULL;
+  pos = 0;
+  if(ei_decode_tuple_header(v->buf, &pos, &arity) || arity != 6)
+    return NULL;
+  if(by_id)
+  {
+    if(ei_decode_ulonglong(v->buf, &pos, &seq))
+      return NULL;
+  }
+  else
+  {
+    if(ei_get_type(v->buf, &pos, &id_type, &id_size) ||
+       id_type != ERL_BINARY_EXT)
+      return NULL;
+    id_pos = pos;
+    if(ei_skip_term(v->buf, &pos))
+      return NULL;
+  }
+  if(ei_decode_tuple_header(v->buf, &pos, &rev_arity) || rev_arity != 2 ||
+     ei_decode_ulonglong(v->buf, &pos, &rev_seq) ||
+     ei_get_type(v->buf, &pos, &meta_type, &meta_size) ||
+     meta_type != ERL_BINARY_EXT)
+    return NULL;
+  int meta_pos = pos;
+  if(ei_skip_term(v->buf, &pos) ||
+     ei_decode_ulonglong(v->buf, &pos, &bp) ||
+     ei_decode_ulonglong(v->buf, &pos, &deleted) ||
+     ei_decode_ulonglong(v->buf, &pos, &content_meta) ||
+     ei_decode_ulonglong(v->buf, &pos, &size) || (size_t) pos > v->size)
+    return NULL;
+  //Both binaries were skipped within their terms, so their sizes are sane.
+  DocInfo* info = static_cast<DocInfo*>(
+      malloc(sizeof(DocInfo) + id_size + meta_size));
+  if(info == NULL)
+    return NULL;
+  long id_len, meta_len;
+  info->id.buf = reinterpret_cast<char*>(info + 1);
+  info->rev_meta.buf = info->id.buf + id_size;
+  if(ei_decode_binary(id_term->buf, &id_pos, info->id.buf, &id_len) ||
+     id_len != id_size ||
+     ei_decode_binary(v->buf, &meta_pos, info->rev_meta.buf, &meta_len) ||
+     meta_len != meta_size)
+  {
+    free(info);
+    return NULL;
+  }
+  info->id.size = id_len;
+  info->rev_meta.size = meta_len;
+  info->db_seq = seq;
+  info->rev_seq = rev_seq;
+  info->bp = bp;
+  info->deleted = deleted;
+  info->content_meta = content_meta;
+  info->size = size;
+  return info;
+}
+
+DocInfo* decode_docinfo(const sized_buf* k, const sized_buf* v)
+{
+  return decode_item(k, v, false);
+}
+
+DocInfo* decode_id_docinfo(const sized_buf* k, const sized_buf* v)
+{
+  return decode_item(k, v, true);
+}
+}
@@ -0,0 +1,75 @@
+#ifndef COUCH_DOCINFO_TERM_H
+#define COUCH_DOCINFO_TERM_H
+#include <libcouchstore/couch_db.h>
+#include "term_encode.hh"
+//# DocInfo terms
+//How a doc's info is stored in each index, as the value of its item:
+//
+// * `by_seq`: _Seq => {Id, {RevSeq, RevMeta}, Bp, Deleted, ContentMeta,
+//   Size}_
+// * `by_id`: _Id => {Seq, {RevSeq, RevMeta}, Bp, Deleted, ContentMeta,
+//   Size}_
+//
+//The keys are a `ulonglong` and a binary.
+namespace couchstore
+{
+//Everything after the first element, which is the same in both.
+inline size_t docinfo_tail_size(const DocInfo* info)
+{
+  return term::Tuple<2>::size +
+         term::ulonglong_size(info->rev_seq) +
+         term::binary_size(info->rev_meta.size) +
+         term::ulonglong_size(info->bp) +
+         term::ulonglong_size(info->deleted) +
+         term::ulonglong_size(info->content_meta) +
+         term::ulonglong_size(info->size);
+}
+
+inline char* put_docinfo_tail(char* buf, const DocInfo* info)
+{
+  buf = term::Tuple<2>::put(buf);
+  buf = term::put_ulonglong(buf, info->rev_seq);
+  buf = term::put_binary(buf, info->rev_meta.buf, info->rev_meta.size);
+  buf = term::put_ulonglong(buf, info->bp);
+  buf = term::put_ulonglong(buf, info->deleted);
+  buf = term::put_ulonglong(buf, info->content_meta);
+  return term::put_ulonglong(buf, info->size);
+}
+
+//### `by_seq`
+inline size_t seq_value_size(const DocInfo* info)
+{
+  return term::Tuple<6>::size + term::binary_size(info->id.size) +
+         docinfo_tail_size(info);
+}
+
+inline char* put_seq_value(char* buf, const DocInfo* info)
+{
+  buf = term::Tuple<6>::put(buf);
+  buf = term::put_binary(buf, info->id.buf, info->id.size);
+  return put_docinfo_tail(buf, info);
+}
+
+//### `by_id`
+inline size_t id_value_size(const DocInfo* info)
+{
+  return term::Tuple<6>::size + term::ulonglong_size(info->db_seq) +
+         docinfo_tail_size(info);
+}
+
+inline char* put_id_value(char* buf, const DocInfo* info)
+{
+  buf = term::Tuple<6>::put(buf);
+  buf = term::put_ulonglong(buf, info->db_seq);
+  return put_docinfo_tail(buf, info);
+}
+
+//### Decoding
+//Decode a `by_seq` item into a DocInfo allocated in one block, as couchstore
+//allocates them, so `free_docinfo` can free it. NULL if it doesn't parse, or
+//there's no memory.
+DocInfo* decode_docinfo(const sized_buf* k, const sized_buf* v);
+//The same for a `by_id` item.
+DocInfo* decode_id_docinfo(const sized_buf* k, const sized_buf* v);
+}
+#endif
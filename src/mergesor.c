@@ -2,257 +2,904 @@
    by Philip J. Erdelsky
    pje@efgh.com
    http://www.alumni.caltech.edu/~pje/
+
+   Modified to merge up to fan_in runs per pass through a loser tree,
+   rather than two tapes at a time, and to hand the records of the final
+   pass to an output callback instead of writing them to a sorted file.
+
+   Runs are built in a single arena of run_bytes bytes instead of one
+   malloc'd linked-list node per record: records are copied into the front
+   of the arena, a struct sort_entry for each one grows down from the back,
+   and the run is spilled when the two would meet.
+
+   Records are pushed in one at a time through a struct merge_sorter. With
+   params->background set, a full arena is handed to a thread that sorts
+   and spills it while the caller fills a second one, so run generation
+   overlaps with whatever is producing the records and only the merge is
+   left when the last record has been added.
+
+   Spilled runs are appended to a file created in params->spill_dir, and
+   so is the output of each intermediate merge, which takes the oldest
+   runs on the file; where the file system allows, the space of the runs
+   it took is then punched out of the file, so it never holds much more
+   than the records being sorted. It is a plain file descriptor written
+   and read with pwrite and pread through large aligned buffers, and a
+   list of the runs on it (offset, length, record count) lets every run
+   being merged be read from its own position. In a spill file each
+   record is preceded by its size, and both are padded to
+   RECORD_ALIGNMENT so records come back aligned.
+
+   Input that is already in order, in whole or in long stretches, is
+   detected as it arrives, natural merge sort style. An arena whose records
+   were added in ascending order is not sorted at all, and a run that
+   starts at or above the end of the run spilled before it is appended to
+   that run instead of starting a new one, so a sorted stream ends up as a
+   single run that is read back once with no merge pass.
+
+   Runs still in memory when the input ends are never spilled: they are
+   sorted in their arenas and merged from there along with any runs on
+   disk. With background spilling the first full arena is held back as
+   well, so input that fits in two arenas is sorted without touching a
+   file at all.
 */
 
+/* for fallocate */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "mergesor.h"
+#include "runsort.h"
+
+#define OK                   0
+#define INSUFFICIENT_MEMORY  1
+#define FILE_CREATION_ERROR  2
+#define FILE_WRITE_ERROR     3
+#define OUTPUT_ERROR         4
+#define RECORD_TOO_LARGE     5
+#define FILE_READ_ERROR      6
+
+/* round record offsets in arenas and spill files up to this */
+#define RECORD_ALIGNMENT 8
 
-extern void *sort_linked_list(void *, unsigned,
-  int (*)(void *, void *, void *), void *, unsigned long *);
+/* spill file buffers are aligned to this */
+#define BUFFER_ALIGNMENT 4096
 
-struct record_in_memory
+#define ALIGN(n) (((n) + RECORD_ALIGNMENT - 1) & ~(size_t) (RECORD_ALIGNMENT - 1))
+
+/* the size header in front of each record in a spill file */
+#define RECORD_HEADER ALIGN(sizeof(unsigned))
+
+struct run
+{
+  unsigned long long offset;
+  unsigned long long bytes;
+  unsigned long count;
+};
+
+/* A spill file and the runs on it, in file order. */
+struct run_file
+{
+  int fd;
+  unsigned long long size;
+  struct run *run;
+  unsigned long runs;
+  unsigned long run_capacity;
+};
+
+/* Appends runs to a run_file through a buffer. */
+struct run_writer
+{
+  struct run_file *file;
+  char *buffer;
+  size_t capacity;
+  size_t used;
+  unsigned long long run_start;
+  unsigned long run_count;
+  unsigned long long *bytes_written;
+};
+
+/* Reads one run back through a buffer, or, if entries is not NULL, */
+/* walks a sorted run that is still in its arena.                   */
+struct run_reader
 {
-  struct record_in_memory *next;
-  char record[1];
+  struct sort_entry *entries;
+  char *arena;
+  unsigned long next;
+  int fd;
+  char *buffer;
+  size_t capacity;
+  size_t pos;
+  size_t len;
+  unsigned long long offset;
+  unsigned long long end;
+  unsigned long long *bytes_read;
 };
 
-struct compare_info
+/* A loser (tournament) tree over k sources. node[0] holds the index of the */
+/* current winner, node[1] .. node[k-1] hold the loser of the match played  */
+/* at that internal node. Leaf i sits at position k + i, so the parent of   */
+/* any position p is p / 2. A source with nothing left in its current run   */
+/* loses every match, and ties go to the lower source index so the merge    */
+/* is stable. Each current record's key prefix is kept alongside it, so a   */
+/* match only calls compare when the two prefixes are equal.                */
+struct loser_tree
 {
+  unsigned k;
+  unsigned *node;
+  char **record;
+  unsigned *size;
+  unsigned long long *prefix;
+  unsigned long *left;
   int (*compare)(void *, void *, void *);
   void *pointer;
 };
 
-static void free_memory_blocks(struct record_in_memory *first)
+/* An arena being filled with one run's records (from the front) and */
+/* their sort entries (from entry_top down).                         */
+struct run_buffer
 {
-  while (first != NULL)
+  char *arena;
+  struct sort_entry *entry_top;
+  size_t used;
+  unsigned long n;
+  /* records were added in ascending order */
+  int sorted;
+};
+
+struct merge_sorter
+{
+  struct merge_sort_params params;
+  unsigned fan_in;
+  size_t run_bytes;
+  struct run_buffer buffer[2];
+  struct run_buffer *filling;
+  /* the spill file: the initial runs, then the intermediate merges' */
+  struct run_file file;
+  struct run_writer writer;
+  /* a copy of the last record of the last run spilled */
+  char *last;
+  unsigned long long last_prefix;
+  unsigned long total;
+  int status;
+  /* background spilling; pending is the buffer handed to the thread, */
+  /* which clears it once the run is on disk                          */
+  int background;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  struct run_buffer *pending;
+  int finished;
+  /* the first full arena, kept back in case the rest fits in the other */
+  struct run_buffer *held;
+  int held_once;
+  struct merge_sort_stats stats;
+};
+
+static int beats(struct loser_tree *t, unsigned a, unsigned b)
+{
+  int cmp;
+  if (t->left[a] == 0)
+    return t->left[b] == 0 && a < b;
+  if (t->left[b] == 0)
+    return 1;
+  if (t->prefix[a] != t->prefix[b])
+    return t->prefix[a] < t->prefix[b];
+  cmp = (*t->compare)(t->record[a], t->record[b], t->pointer);
+  return cmp < 0 || (cmp == 0 && a < b);
+}
+
+static unsigned play(struct loser_tree *t, unsigned position)
+{
+  unsigned left, right;
+  if (position >= t->k)
+    return position - t->k;
+  left = play(t, 2 * position);
+  right = play(t, 2 * position + 1);
+  if (beats(t, left, right))
   {
-    struct record_in_memory *next = first->next;
-    free(first);
-    first = next;
+    t->node[position] = right;
+    return left;
   }
+  t->node[position] = left;
+  return right;
 }
 
-static int compare_records(void *p, void *q, void *pointer)
+static void loser_tree_init(struct loser_tree *t)
 {
-  #define pp ((struct record_in_memory *) p)
-  #define qq ((struct record_in_memory *) q)
-  #define point ((struct compare_info *) pointer)
-  return (*point->compare)(pp->record, qq->record, point->pointer);
+  t->node[0] = t->k > 1 ? play(t, 1) : 0;
 }
 
-#define OK                   0
-#define INSUFFICIENT_MEMORY  1
-#define FILE_CREATION_ERROR  2
-#define FILE_WRITE_ERROR     3
+/* source s has a new current record (or has run out); replay its path */
+static void loser_tree_replay(struct loser_tree *t, unsigned s)
+{
+  unsigned winner = s;
+  unsigned position = (t->k + s) / 2;
+  while (position != 0)
+  {
+    if (beats(t, t->node[position], winner))
+    {
+      unsigned loser = winner;
+      winner = t->node[position];
+      t->node[position] = loser;
+    }
+    position /= 2;
+  }
+  t->node[0] = winner;
+}
 
-int merge_sort(FILE *unsorted_file, FILE *sorted_file,
-  int (*read)(FILE *, void *, void *),
-  int (*write)(FILE *, void *, void *),
-  int (*compare)(void *, void *, void *), void *pointer,
-  unsigned max_record_size, unsigned long block_size, unsigned long *pcount)
+static char *alloc_buffer(size_t size)
 {
-  struct tape
+  void *p;
+  if (posix_memalign(&p, BUFFER_ALIGNMENT, size) != 0)
+    return NULL;
+  return p;
+}
+
+static int pwrite_all(int fd, const char *buf, size_t len,
+  unsigned long long offset)
+{
+  while (len > 0)
   {
-    FILE *fp;
-    unsigned long count;
-  };
-  struct tape source_tape[2];
-  char *record[2];
-  /* allocate memory */
-  if ((record[0] = malloc(max_record_size)) == NULL)
-    return INSUFFICIENT_MEMORY;
-  if ((record[1] = malloc(max_record_size)) == NULL)
+    ssize_t n = pwrite(fd, buf, len, (off_t) offset);
+    if (n < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      return 0;
+    }
+    buf += n;
+    len -= n;
+    offset += n;
+  }
+  return 1;
+}
+
+static int pread_all(int fd, char *buf, size_t len, unsigned long long offset)
+{
+  while (len > 0)
+  {
+    ssize_t n = pread(fd, buf, len, (off_t) offset);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return 0;
+    buf += n;
+    len -= n;
+    offset += n;
+  }
+  return 1;
+}
+
+/* Create an anonymous spill file: it is unlinked as soon as it is open, */
+/* so it disappears with the descriptor however the process exits.      */
+static int open_spill_file(struct run_file *f, const char *dir)
+{
+  char path[PATH_MAX];
+  if (dir == NULL)
+    dir = getenv("TMPDIR");
+  if (dir == NULL || *dir == '\0')
+    dir = "/tmp";
+  if (snprintf(path, sizeof(path), "%s/mergesort.XXXXXX", dir) >=
+    (int) sizeof(path))
+    return 0;
+  if ((f->fd = mkstemp(path)) < 0)
+    return 0;
+  unlink(path);
+  return 1;
+}
+
+static void close_run_file(struct run_file *f)
+{
+  if (f->fd >= 0)
+    close(f->fd);
+  free(f->run);
+  memset(f, 0, sizeof(struct run_file));
+  f->fd = -1;
+}
+
+/* Give back the disk space of n consecutive runs that have been merged */
+/* away. Their bytes read back as zeros afterwards, and a file system   */
+/* that can't do this just keeps them.                                  */
+static void release_runs(struct run_file *f, unsigned long first, unsigned n)
+{
+#ifdef FALLOC_FL_PUNCH_HOLE
+  unsigned long long start = f->run[first].offset;
+  unsigned long long end = f->run[first + n - 1].offset +
+    f->run[first + n - 1].bytes;
+  if (end > start)
+    fallocate(f->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+      (off_t) start, (off_t) (end - start));
+#endif
+}
+
+/* record a run at the end of the file */
+static int add_run(struct run_file *f, unsigned long long offset,
+  unsigned long long bytes, unsigned long count)
+{
+  if (f->runs == f->run_capacity)
+  {
+    unsigned long capacity = f->run_capacity ? 2 * f->run_capacity : 16;
+    struct run *run = realloc(f->run, capacity * sizeof(struct run));
+    if (run == NULL)
+      return 0;
+    f->run = run;
+    f->run_capacity = capacity;
+  }
+  f->run[f->runs].offset = offset;
+  f->run[f->runs].bytes = bytes;
+  f->run[f->runs].count = count;
+  f->runs++;
+  return 1;
+}
+
+static int writer_flush(struct run_writer *w)
+{
+  if (w->used == 0)
+    return OK;
+  if (!pwrite_all(w->file->fd, w->buffer, w->used, w->file->size))
+    return FILE_WRITE_ERROR;
+  w->file->size += w->used;
+  *w->bytes_written += w->used;
+  w->used = 0;
+  return OK;
+}
+
+static void writer_begin_run(struct run_writer *w, struct run_file *f)
+{
+  w->file = f;
+  w->run_start = f->size + w->used;
+  w->run_count = 0;
+}
+
+static int writer_put(struct run_writer *w, const void *record,
+  unsigned size)
+{
+  size_t framed = RECORD_HEADER + ALIGN(size);
+  if (w->used + framed > w->capacity)
   {
-    free(record[0]);
+    int status = writer_flush(w);
+    if (status != OK)
+      return status;
+  }
+  memcpy(w->buffer + w->used, &size, sizeof(unsigned));
+  memcpy(w->buffer + w->used + RECORD_HEADER, record, size);
+  w->used += framed;
+  w->run_count++;
+  return OK;
+}
+
+static int writer_end_run(struct run_writer *w)
+{
+  unsigned long long end = w->file->size + w->used;
+  if (!add_run(w->file, w->run_start, end - w->run_start, w->run_count))
     return INSUFFICIENT_MEMORY;
+  return OK;
+}
+
+/* continue the last run on the file instead of starting a new one */
+static void writer_continue_run(struct run_writer *w, struct run_file *f)
+{
+  struct run *run = f->run + --f->runs;
+  w->file = f;
+  w->run_start = run->offset;
+  w->run_count = run->count;
+}
+
+static void reader_start(struct run_reader *r, int fd, const struct run *run)
+{
+  r->entries = NULL;
+  r->fd = fd;
+  r->pos = r->len = 0;
+  r->offset = run->offset;
+  r->end = run->offset + run->bytes;
+}
+
+/* start walking the sorted records of a buffer */
+static void reader_start_memory(struct run_reader *r, struct run_buffer *b)
+{
+  r->entries = b->entry_top - b->n;
+  r->arena = b->arena;
+  r->next = 0;
+}
+
+/* Point *record at the next record of the run. It stays valid until the */
+/* next call.                                                            */
+static int reader_next(struct run_reader *r, char **record, unsigned *size)
+{
+  unsigned length;
+  if (r->entries != NULL)
+  {
+    struct sort_entry *e = r->entries + r->next++;
+    *record = r->arena + e->offset;
+    *size = e->size;
+    return OK;
   }
-  /* create temporary files source_tape[0] and source_tape[1] */
-  source_tape[0].fp = tmpfile();
-  source_tape[0].count = 0L;
-  if (source_tape[0].fp == NULL)
+  if (r->len - r->pos < RECORD_HEADER ||
+    r->len - r->pos < RECORD_HEADER +
+      ALIGN(*(unsigned *) (r->buffer + r->pos)))
   {
-    free(record[0]);
-    free(record[1]);
-    return FILE_CREATION_ERROR;
+    size_t n;
+    memmove(r->buffer, r->buffer + r->pos, r->len - r->pos);
+    r->len -= r->pos;
+    r->pos = 0;
+    n = r->capacity - r->len;
+    if (n > r->end - r->offset)
+      n = (size_t) (r->end - r->offset);
+    if (!pread_all(r->fd, r->buffer + r->len, n, r->offset))
+      return FILE_READ_ERROR;
+    r->offset += n;
+    r->len += n;
+    *r->bytes_read += n;
+    if (r->len < RECORD_HEADER)
+      return FILE_READ_ERROR;
   }
-  source_tape[1].fp = tmpfile();
-  source_tape[1].count = 0L;
-  if (source_tape[1].fp == NULL)
+  memcpy(&length, r->buffer + r->pos, sizeof(unsigned));
+  if (r->len - r->pos < RECORD_HEADER + ALIGN(length))
+    return FILE_READ_ERROR;
+  *record = r->buffer + r->pos + RECORD_HEADER;
+  *size = length;
+  r->pos += RECORD_HEADER + ALIGN(length);
+  return OK;
+}
+
+void merge_sort_default_params(struct merge_sort_params *params)
+{
+  memset(params, 0, sizeof(struct merge_sort_params));
+  params->run_bytes = MERGE_SORT_DEFAULT_RUN_BYTES;
+  params->fan_in = MERGE_SORT_DEFAULT_FAN_IN;
+  params->write_buffer_bytes = MERGE_SORT_DEFAULT_WRITE_BUFFER_BYTES;
+  params->read_buffer_bytes = MERGE_SORT_DEFAULT_READ_BUFFER_BYTES;
+}
+
+/* nonzero if record a (with key prefix pa) does not sort after b */
+static int in_order(struct merge_sorter *s, unsigned long long pa, void *a,
+  unsigned long long pb, void *b)
+{
+  if (pa != pb)
+    return pa < pb;
+  return (*s->params.compare)(a, b, s->params.pointer) <= 0;
+}
+
+/* Put the buffer's entries in sorted order and return them. Entries grow */
+/* down from entry_top, so a buffer filled in order only needs reversing. */
+static struct sort_entry *sort_run(struct merge_sorter *s,
+  struct run_buffer *b)
+{
+  struct sort_entry *entries = b->entry_top - b->n;
+  if (b->sorted)
   {
-    fclose(source_tape[0].fp);
-    free(record[0]);
-    free(record[1]);
+    unsigned long i, j;
+    for (i = 0, j = b->n; i + 1 < j; i++, j--)
+    {
+      struct sort_entry t = entries[i];
+      entries[i] = entries[j - 1];
+      entries[j - 1] = t;
+    }
+  }
+  else if (s->params.run_sort == MERGE_SORT_RUNS_BY_RADIX &&
+    s->params.prefix != NULL)
+    radix_sort_entries(entries, b->n, b->arena, s->params.compare,
+      s->params.key, s->params.pointer);
+  else
+    sort_entries(entries, b->n, b->arena, s->params.compare,
+      s->params.pointer);
+  return entries;
+}
+
+/* Sort the records in the buffer and append them to the spill file,  */
+/* as a new run or, if they all sort at or after the end of the last  */
+/* run, as a continuation of it.                                      */
+static int spill_run(struct merge_sorter *s, struct run_buffer *b)
+{
+  struct sort_entry *entries = sort_run(s, b);
+  struct sort_entry *last = entries + b->n - 1;
+  unsigned long i;
+  int status;
+  if (s->file.fd < 0 && !open_spill_file(&s->file, s->params.spill_dir))
     return FILE_CREATION_ERROR;
+  if (s->file.runs != 0 && in_order(s, s->last_prefix, s->last,
+    entries[0].prefix, b->arena + entries[0].offset))
+    writer_continue_run(&s->writer, &s->file);
+  else
+  {
+    writer_begin_run(&s->writer, &s->file);
+    s->stats.runs_spilled++;
+  }
+  for (i = 0; i < b->n; i++)
+  {
+    status = writer_put(&s->writer, b->arena + entries[i].offset,
+      entries[i].size);
+    if (status != OK)
+      return status;
+  }
+  if ((status = writer_end_run(&s->writer)) != OK)
+    return status;
+  memcpy(s->last, b->arena + last->offset, last->size);
+  s->last_prefix = last->prefix;
+  s->total += b->n;
+  s->stats.buffers_spilled++;
+  b->used = 0;
+  b->n = 0;
+  return OK;
+}
+
+static void *spill_thread(void *arg)
+{
+  struct merge_sorter *s = arg;
+  pthread_mutex_lock(&s->lock);
+  while (1)
+  {
+    struct run_buffer *b;
+    int status;
+    while (s->pending == NULL && !s->finished)
+      pthread_cond_wait(&s->cond, &s->lock);
+    if (s->pending == NULL)
+      break;
+    b = s->pending;
+    pthread_mutex_unlock(&s->lock);
+    status = spill_run(s, b);
+    pthread_mutex_lock(&s->lock);
+    if (status != OK && s->status == OK)
+      s->status = status;
+    b->used = 0;
+    b->n = 0;
+    s->pending = NULL;
+    pthread_cond_broadcast(&s->cond);
+  }
+  pthread_mutex_unlock(&s->lock);
+  return NULL;
+}
+
+/* The filling buffer is full (or input is over): spill it, or give it */
+/* to the background thread and start filling the other buffer.        */
+static int hand_off_run(struct merge_sorter *s)
+{
+  int status;
+  if (s->filling->n == 0)
+    return s->status;
+  if (!s->background)
+  {
+    if (s->status == OK)
+      s->status = spill_run(s, s->filling);
+    return s->status;
+  }
+  if (!s->held_once)
+  {
+    s->held_once = 1;
+    s->held = s->filling;
+    s->filling = s->filling == s->buffer ? s->buffer + 1 : s->buffer;
+    return OK;
+  }
+  pthread_mutex_lock(&s->lock);
+  if (s->held != NULL)
+  {
+    /* both arenas are full: the held one goes first */
+    s->pending = s->held;
+    s->held = NULL;
+    pthread_cond_broadcast(&s->cond);
+  }
+  while (s->pending != NULL)
+    pthread_cond_wait(&s->cond, &s->lock);
+  status = s->status;
+  if (status == OK)
+  {
+    s->pending = s->filling;
+    s->filling = s->filling == s->buffer ? s->buffer + 1 : s->buffer;
+    pthread_cond_broadcast(&s->cond);
+  }
+  pthread_mutex_unlock(&s->lock);
+  return status;
+}
+
+static int init_run_buffer(struct run_buffer *b, size_t run_bytes)
+{
+  if ((b->arena = malloc(run_bytes)) == NULL)
+    return 0;
+  b->entry_top = (struct sort_entry *) (b->arena + run_bytes);
+  b->used = 0;
+  b->n = 0;
+  return 1;
+}
+
+struct merge_sorter *merge_sorter_open(const struct merge_sort_params *params)
+{
+  struct merge_sorter *s = calloc(1, sizeof(struct merge_sorter));
+  size_t minimum;
+  if (s == NULL)
+    return NULL;
+  s->params = *params;
+  s->fan_in = params->fan_in < 2 ? 2 : params->fan_in;
+  s->file.fd = -1;
+  /* entries hold 32-bit offsets into the arena */
+  minimum = ALIGN(params->max_record_size) + sizeof(struct sort_entry);
+  s->run_bytes = params->run_bytes;
+  if (s->run_bytes > 0xFFFFFFFFUL)
+    s->run_bytes = 0xFFFFFFFFUL;
+  if (s->run_bytes < minimum)
+    s->run_bytes = minimum;
+  s->run_bytes &= ~(size_t) (RECORD_ALIGNMENT - 1);
+  /* the spill buffers must hold at least one framed record */
+  minimum = RECORD_HEADER + ALIGN(params->max_record_size);
+  if (s->params.write_buffer_bytes < minimum)
+    s->params.write_buffer_bytes = minimum;
+  if (s->params.read_buffer_bytes < minimum)
+    s->params.read_buffer_bytes = minimum;
+  s->writer.capacity = s->params.write_buffer_bytes;
+  s->writer.bytes_written = &s->stats.bytes_written;
+  s->writer.buffer = alloc_buffer(s->writer.capacity);
+  s->last = malloc(params->max_record_size ? params->max_record_size : 1);
+  s->filling = s->buffer;
+  if (s->writer.buffer == NULL || s->last == NULL ||
+    !init_run_buffer(s->buffer, s->run_bytes))
+  {
+    merge_sorter_close(s);
+    return NULL;
   }
-  /* read blocks, sort them in memory, and write the alternately to */
-  /* tapes 0 and 1 */
+  if (params->background)
   {
-    struct record_in_memory *first = NULL;
-    unsigned long block_count = 0;
-    unsigned destination = 0;
-    struct compare_info comp;
-    comp.compare = compare;
-    comp.pointer = pointer;
-    while (1)
+    if (!init_run_buffer(s->buffer + 1, s->run_bytes))
     {
-      int record_size = (*read)(unsorted_file, record[0], pointer);
-      if (record_size > 0)
-      {
-        struct record_in_memory *p = (struct record_in_memory *)
-          malloc(sizeof(struct record_in_memory *) + record_size);
-        if (p == NULL)
-        {
-          fclose(source_tape[0].fp);
-          fclose(source_tape[1].fp);
-          free(record[0]);
-          free(record[1]);
-          free_memory_blocks(first);
-          return INSUFFICIENT_MEMORY;
-        }
-        p->next = first;
-        memcpy(p->record, record[0], record_size);
-        first = p;
-        block_count++;
-      }
-      if (block_count == block_size || record_size == 0 && block_count != 0)
-      {
-        first = sort_linked_list(first, 0, compare_records, &comp, NULL);
-        while (first != NULL)
-        {
-          struct record_in_memory *next = first->next;
-          if ((*write)(source_tape[destination].fp, first->record,
-            pointer) == 0)
-          {
-            fclose(source_tape[0].fp);
-            fclose(source_tape[1].fp);
-            free(record[0]);
-            free(record[1]);
-            free_memory_blocks(first);
-            return FILE_WRITE_ERROR;
-          }
-          source_tape[destination].count++;
-          free(first);
-          first = next;
-        }
-        destination ^= 1;
-        block_count = 0;
-      }
-      if (record_size == 0)
-        break;
+      merge_sorter_close(s);
+      return NULL;
     }
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->cond, NULL);
+    if (pthread_create(&s->thread, NULL, spill_thread, s) != 0)
+    {
+      pthread_mutex_destroy(&s->lock);
+      pthread_cond_destroy(&s->cond);
+      merge_sorter_close(s);
+      return NULL;
+    }
+    s->background = 1;
+  }
+  return s;
+}
+
+int merge_sorter_add(struct merge_sorter *s, const void *record,
+  unsigned size)
+{
+  struct run_buffer *b = s->filling;
+  struct sort_entry *entry;
+  if (size > s->params.max_record_size)
+    return RECORD_TOO_LARGE;
+  if (b->used + size + (b->n + 1) * sizeof(struct sort_entry) > s->run_bytes)
+  {
+    int status = hand_off_run(s);
+    if (status != OK)
+      return status;
+    b = s->filling;
   }
-  if (sorted_file == unsorted_file)
-    rewind(unsorted_file);
-  rewind(source_tape[0].fp);
-  rewind(source_tape[1].fp);
-  /* delete the unsorted file here, if required (see instructions) */
-  /* handle case where memory sort is all that is required */
-  if (source_tape[1].count == 0L)
+  memcpy(b->arena + b->used, record, size);
+  entry = b->entry_top - (b->n + 1);
+  entry->offset = (unsigned) b->used;
+  entry->size = size;
+  entry->prefix = s->params.prefix != NULL ?
+    (*s->params.prefix)(b->arena + b->used, s->params.pointer) : 0;
+  /* entry + 1 is the record added before this one */
+  b->sorted = b->n == 0 || (b->sorted && in_order(s, entry[1].prefix,
+    b->arena + entry[1].offset, entry->prefix, b->arena + entry->offset));
+  b->n++;
+  b->used += ALIGN(size);
+  return OK;
+}
+
+/* Stop the background thread once it has spilled everything it has. */
+static void stop_spill_thread(struct merge_sorter *s)
+{
+  if (!s->background)
+    return;
+  pthread_mutex_lock(&s->lock);
+  s->finished = 1;
+  pthread_cond_broadcast(&s->cond);
+  pthread_mutex_unlock(&s->lock);
+  pthread_join(s->thread, NULL);
+  pthread_mutex_destroy(&s->lock);
+  pthread_cond_destroy(&s->cond);
+  s->background = 0;
+}
+
+static int read_next(struct merge_sorter *s, struct loser_tree *tree,
+  struct run_reader *readers, unsigned i)
+{
+  int status = reader_next(readers + i, tree->record + i, tree->size + i);
+  /* a lone run is just copied out, with no matches to play */
+  if (status == OK && tree->k > 1)
+    tree->prefix[i] = s->params.prefix != NULL ?
+      (*s->params.prefix)(tree->record[i], s->params.pointer) : 0;
+  return status;
+}
+
+/* Merge n consecutive runs of in, starting at first, and then the m sorted */
+/* buffers in memory, into a single run appended through the writer, or    */
+/* into the output if writer is NULL.                                      */
+static int merge_group(struct merge_sorter *s, struct loser_tree *tree,
+  struct run_reader *readers, struct run_file *in, unsigned long first,
+  unsigned n, struct run_buffer **memory, unsigned m,
+  struct run_writer *writer, struct run_file *out)
+{
+  unsigned long count = 0L;
+  unsigned i;
+  int status = OK;
+  tree->k = n + m;
+  for (i = 0; i < n + m; i++)
   {
-    fclose(source_tape[1].fp);
-    source_tape[1] = source_tape[0];
-    source_tape[0].fp = sorted_file;
-    while (source_tape[1].count-- != 0L)
+    if (i < n)
+    {
+      reader_start(readers + i, in->fd, in->run + first + i);
+      tree->left[i] = in->run[first + i].count;
+    }
+    else
     {
-      (*read)(source_tape[1].fp, record[0], pointer);
-      if ((*write)(source_tape[0].fp, record[0], pointer) == 0)
-      {
-        fclose(source_tape[1].fp);
-        free(record[0]);
-        free(record[1]);
-        return FILE_WRITE_ERROR;
-      }
+      reader_start_memory(readers + i, memory[i - n]);
+      tree->left[i] = memory[i - n]->n;
     }
+    count += tree->left[i];
+    if (tree->left[i] != 0 && (status = read_next(s, tree, readers, i)) != OK)
+      return status;
   }
-  else
+  if (writer != NULL)
+    writer_begin_run(writer, out);
+  loser_tree_init(tree);
+  while (count-- != 0L)
+  {
+    unsigned select = tree->node[0];
+    if (writer != NULL)
+      status = writer_put(writer, tree->record[select], tree->size[select]);
+    else if ((*s->params.output)(tree->record[select],
+      s->params.output_pointer) != 0)
+      status = OUTPUT_ERROR;
+    if (status != OK)
+      return status;
+    if (--tree->left[select] != 0 &&
+      (status = read_next(s, tree, readers, select)) != OK)
+      return status;
+    loser_tree_replay(tree, select);
+  }
+  return writer != NULL ? writer_end_run(writer) : OK;
+}
+
+/* Merge the spilled runs until few enough are left to merge with the m */
+/* runs in memory in one last pass, which hands them to the output. Each */
+/* intermediate merge takes the oldest runs and appends its result to    */
+/* the same file, so the runs it leaves alone stay where they are. Only  */
+/* the first merge takes fewer than fan_in runs: just enough that every  */
+/* later one is full and the last of them leaves exactly last_fan_in.    */
+/* The runs a merge took are punched out of the file once it's done.     */
+static int merge_runs(struct merge_sorter *s, struct run_buffer **memory,
+  unsigned m)
+{
+  unsigned fan_in = s->fan_in;
+  unsigned last_fan_in = fan_in > m ? fan_in - m : 1;
+  struct run_file *in = &s->file;
+  unsigned long first = 0L, live = in->runs;
+  struct run_reader *readers;
+  struct loser_tree tree;
+  unsigned i;
+  int status = OK;
+  tree.compare = s->params.compare;
+  tree.pointer = s->params.pointer;
+  /* allocate memory: a read buffer and loser tree slot per merged run */
+  readers = calloc(fan_in + m, sizeof(struct run_reader));
+  tree.record = calloc(fan_in + m, sizeof(char *));
+  tree.size = calloc(fan_in + m, sizeof(unsigned));
+  tree.prefix = calloc(fan_in + m, sizeof(unsigned long long));
+  tree.node = malloc((fan_in + m) * sizeof(unsigned));
+  tree.left = malloc((fan_in + m) * sizeof(unsigned long));
+  if (readers == NULL || tree.record == NULL || tree.size == NULL ||
+    tree.prefix == NULL || tree.node == NULL || tree.left == NULL)
+  {
+    status = INSUFFICIENT_MEMORY;
+    goto done;
+  }
+  for (i = 0; i < fan_in + m; i++)
+    readers[i].bytes_read = &s->stats.bytes_read;
+  for (i = 0; i < fan_in && i < in->runs; i++)
   {
-    /* merge tapes, two by two, until every record is in source_tape[0] */
-    while (source_tape[1].count != 0L)
+    readers[i].capacity = s->params.read_buffer_bytes;
+    if ((readers[i].buffer = alloc_buffer(readers[i].capacity)) == NULL)
     {
-      unsigned destination = 0;
-      struct tape destination_tape[2];
-      destination_tape[0].fp = source_tape[0].count <= block_size ?
-        sorted_file : tmpfile();
-      destination_tape[0].count = 0L;
-      if (destination_tape[0].fp == NULL)
-      {
-        fclose(source_tape[0].fp);
-        fclose(source_tape[1].fp);
-        free(record[0]);
-        free(record[1]);
-        return FILE_CREATION_ERROR;
-      }
-      destination_tape[1].fp = tmpfile();
-      destination_tape[1].count = 0L;
-      if (destination_tape[1].fp == NULL)
-      {
-        if (destination_tape[0].fp != sorted_file)
-          fclose(destination_tape[0].fp);
-        fclose(source_tape[0].fp);
-        fclose(source_tape[1].fp);
-        free(record[0]);
-        free(record[1]);
-        return FILE_CREATION_ERROR;
-      }
-      (*read)(source_tape[0].fp, record[0], pointer);
-      (*read)(source_tape[1].fp, record[1], pointer);
-      while (source_tape[0].count != 0L)
-      {
-        unsigned long count[2];
-        count[0] = source_tape[0].count;
-        if (count[0] > block_size)
-          count[0] = block_size;
-        count[1] = source_tape[1].count;
-        if (count[1] > block_size)
-          count[1] = block_size;
-        while (count[0] + count[1] != 0)
-        {
-          unsigned select = count[0] == 0 ? 1 : count[1] == 0 ? 0 :
-            compare(record[0], record[1], pointer) < 0 ? 0 : 1;
-          if ((*write)(destination_tape[destination].fp, record[select],
-            pointer) == 0)
-          {
-            if (destination_tape[0].fp != sorted_file)
-              fclose(destination_tape[0].fp);
-            fclose(destination_tape[1].fp);
-            fclose(source_tape[0].fp);
-            fclose(source_tape[1].fp);
-            free(record[0]);
-            free(record[1]);
-            return FILE_WRITE_ERROR;
-          }
-          if (source_tape[select].count > 1L)
-            (*read)(source_tape[select].fp, record[select], pointer);
-          source_tape[select].count--;
-          count[select]--;
-          destination_tape[destination].count++;
-        }
-        destination ^= 1;
-      }
-      fclose(source_tape[0].fp);
-      fclose(source_tape[1].fp);
-      if (fflush(destination_tape[0].fp) == EOF ||
-        fflush(destination_tape[1].fp) == EOF)
-      {
-        if (destination_tape[0].fp != sorted_file)
-          fclose(destination_tape[0].fp);
-        fclose(destination_tape[1].fp);
-        free(record[0]);
-        free(record[1]);
-        return FILE_WRITE_ERROR;
-      }
-      rewind(destination_tape[0].fp);
-      rewind(destination_tape[1].fp);
-      memcpy(source_tape, destination_tape, sizeof(source_tape));
-      block_size <<= 1;
+      status = INSUFFICIENT_MEMORY;
+      goto done;
     }
   }
-  fclose(source_tape[1].fp);
-  if (pcount != NULL)
-    *pcount = source_tape[0].count;
-  free(record[0]);
-  free(record[1]);
-  return OK;
+  if (live > last_fan_in)
+  {
+    /* each full merge leaves fan_in - 1 fewer runs */
+    unsigned n = (unsigned) ((live - last_fan_in - 1) % (fan_in - 1)) + 2;
+    while (live > last_fan_in)
+    {
+      status = merge_group(s, &tree, readers, in, first, n, NULL, 0,
+        &s->writer, in);
+      /* later merges read the new run back from the file */
+      if (status == OK)
+        status = writer_flush(&s->writer);
+      if (status != OK)
+        goto done;
+      release_runs(in, first, n);
+      first += n;
+      live -= n - 1;
+      n = fan_in;
+      s->stats.intermediate_merges++;
+    }
+  }
+  if (live + m != 0)
+    status = merge_group(s, &tree, readers, in, first, (unsigned) live,
+      memory, m, NULL, NULL);
+done:
+  if (readers != NULL)
+  {
+    for (i = 0; i < fan_in + m; i++)
+      free(readers[i].buffer);
+  }
+  free(readers);
+  free(tree.record);
+  free(tree.size);
+  free(tree.prefix);
+  free(tree.node);
+  free(tree.left);
+  return status;
+}
+
+int merge_sorter_finish(struct merge_sorter *s, unsigned long *pcount)
+{
+  struct run_buffer *memory[2];
+  unsigned m = 0, i;
+  int status;
+  stop_spill_thread(s);
+  status = s->status;
+  if (status == OK)
+    status = writer_flush(&s->writer);
+  /* whatever is still in memory stays there for the last merge */
+  if (s->held != NULL)
+    memory[m++] = s->held;
+  if (s->filling->n != 0)
+    memory[m++] = s->filling;
+  for (i = 0; i < 2; i++)
+  {
+    struct run_buffer *b = s->buffer + i;
+    if (b != s->held && (b != s->filling || b->n == 0))
+    {
+      free(b->arena);
+      b->arena = NULL;
+    }
+  }
+  for (i = 0; i < m; i++)
+  {
+    sort_run(s, memory[i]);
+    s->total += memory[i]->n;
+  }
+  s->stats.runs_in_memory = m;
+  if (status == OK)
+    status = merge_runs(s, memory, m);
+  if (status == OK && pcount != NULL)
+    *pcount = s->total;
+  return status;
+}
+
+void merge_sorter_stats(struct merge_sorter *s,
+  struct merge_sort_stats *stats)
+{
+  *stats = s->stats;
+  stats->records = s->total;
 }
 
+void merge_sorter_close(struct merge_sorter *s)
+{
+  stop_spill_thread(s);
+  close_run_file(&s->file);
+  free(s->buffer[0].arena);
+  free(s->buffer[1].arena);
+  free(s->writer.buffer);
+  free(s->last);
+  free(s);
+}
@@ -0,0 +1,102 @@
+#ifndef __MERGESOR_H
+#define __MERGESOR_H 1
+
+#include <stddef.h>
+
+/* Default number of runs merged at once. Each costs one read buffer of */
+/* read_buffer_bytes while merging.                                     */
+#define MERGE_SORT_DEFAULT_FAN_IN 64
+
+/* Default size of the arena each in-memory run is built in. */
+#define MERGE_SORT_DEFAULT_RUN_BYTES (64 * 1024 * 1024)
+
+/* Default sizes of the buffers spill files are written and read through. */
+#define MERGE_SORT_DEFAULT_WRITE_BUFFER_BYTES (4 * 1024 * 1024)
+#define MERGE_SORT_DEFAULT_READ_BUFFER_BYTES (1024 * 1024)
+
+/* How each in-memory run is sorted: a quicksort of the prefixed entries, */
+/* or an MSD radix sort on the prefix and key bytes. Radix sorting wins   */
+/* on runs of more than a few thousand records (bench/run_sort_bench.c).  */
+#define MERGE_SORT_RUNS_BY_COMPARISON 0
+#define MERGE_SORT_RUNS_BY_RADIX 1
+
+struct merge_sort_params
+{
+  /* compare two records, strcmp style */
+  int (*compare)(void *, void *, void *);
+  /* optional: a key prefix such that prefix(a) < prefix(b) implies */
+  /* compare(a, b) < 0; records with equal prefixes fall back to    */
+  /* compare                                                        */
+  unsigned long long (*prefix)(void *, void *);
+  /* optional: the bytes of a record's key, which must order records */
+  /* exactly as compare does; lets radix sorting go past the prefix  */
+  const unsigned char *(*key)(void *, unsigned *, void *);
+  /* passed to all of the above */
+  void *pointer;
+  /* called with each record in sorted order (and output_pointer) by */
+  /* merge_sorter_finish; a nonzero return stops the sort            */
+  int (*output)(void *, void *);
+  void *output_pointer;
+  unsigned max_record_size;
+  /* bytes of memory to build each run in, records and index included */
+  size_t run_bytes;
+  unsigned fan_in;
+  /* MERGE_SORT_RUNS_BY_COMPARISON or MERGE_SORT_RUNS_BY_RADIX (which */
+  /* needs prefix, and key to get past the first 8 bytes)              */
+  int run_sort;
+  /* if nonzero, a merge_sorter sorts and spills full runs on a thread of */
+  /* its own while records are still being added (using a second arena   */
+  /* of run_bytes)                                                       */
+  int background;
+  /* directory spill files are created (and immediately unlinked) in; */
+  /* NULL means $TMPDIR, or /tmp                                      */
+  const char *spill_dir;
+  /* spill files are written write_buffer_bytes at a time, and each run */
+  /* being merged is read read_buffer_bytes at a time                   */
+  size_t write_buffer_bytes;
+  size_t read_buffer_bytes;
+};
+
+/* What a sort did, for reporting. */
+struct merge_sort_stats
+{
+  unsigned long records;
+  /* arenas sorted and spilled while records were being added, the runs */
+  /* they made (an arena that sorts after the last one extends its run), */
+  /* and arenas still in memory for the last merge                       */
+  unsigned long buffers_spilled;
+  unsigned long runs_spilled;
+  unsigned long runs_in_memory;
+  /* merges of spilled runs into one, before the last pass */
+  unsigned long intermediate_merges;
+  /* spill file I/O */
+  unsigned long long bytes_written;
+  unsigned long long bytes_read;
+};
+
+/* An incremental sort: records are added one at a time, then handed to */
+/* params->output in sorted order by merge_sorter_finish. Records that  */
+/* don't fit in memory are spilled to files in params->spill_dir; if    */
+/* they all fit (in both arenas, with background), no file is used.    */
+struct merge_sorter;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void merge_sort_default_params(struct merge_sort_params *params);
+
+struct merge_sorter *merge_sorter_open(const struct merge_sort_params *params);
+int merge_sorter_add(struct merge_sorter *sorter, const void *record,
+  unsigned size);
+int merge_sorter_finish(struct merge_sorter *sorter, unsigned long *pcount);
+/* the sorter's stats, complete once merge_sorter_finish has returned */
+void merge_sorter_stats(struct merge_sorter *sorter,
+  struct merge_sort_stats *stats);
+void merge_sorter_close(struct merge_sorter *sorter);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
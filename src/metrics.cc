@@ -0,0 +1,305 @@
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sys/resource.h>
+#include "metrics.hh"
+namespace couchstore
+{
+static double clock_ms(clockid_t clock)
+{
+  timespec ts;
+  clock_gettime(clock, &ts);
+  return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+Metrics& Metrics::get()
+{
+  static Metrics metrics;
+  return metrics;
+}
+
+Metrics::Metrics() : sorted_(false), phase_(NULL), phase_wall_(0),
+                     phase_cpu_(0)
+{
+  memset(files_, kOtherFile, sizeof(files_));
+  memset(read_, 0, sizeof(read_));
+  memset(written_, 0, sizeof(written_));
+  memset(counters_, 0, sizeof(counters_));
+  memset(queues_, 0, sizeof(queues_));
+  memset(&sort_, 0, sizeof(sort_));
+  start_wall_ = clock_ms(CLOCK_MONOTONIC);
+  pthread_mutex_init(&lock_, NULL);
+}
+
+void Metrics::setFile(int fd, File file)
+{
+  if(fd >= 0 && fd < kMaxFd)
+    files_[fd] = file;
+}
+
+void Metrics::read(int fd, uint64_t bytes)
+{
+  __sync_fetch_and_add(&read_[fileOf(fd)], bytes);
+}
+
+void Metrics::wrote(int fd, uint64_t bytes)
+{
+  __sync_fetch_and_add(&written_[fileOf(fd)], bytes);
+}
+
+void Metrics::node(bool leaf, uint64_t raw, uint64_t compressed)
+{
+  add(leaf ? kLeafNodes : kInteriorNodes);
+  add(leaf ? kLeafRawBytes : kInteriorRawBytes, raw);
+  add(leaf ? kLeafCompressedBytes : kInteriorCompressedBytes, compressed);
+}
+
+void Metrics::depth(Queue queue, uint64_t depth)
+{
+  QueueDepth& q = queues_[queue];
+  uint64_t peak = q.peak;
+  while(depth > peak)
+  {
+    uint64_t was = __sync_val_compare_and_swap(&q.peak, peak, depth);
+    if(was == peak) break;
+    peak = was;
+  }
+  __sync_fetch_and_add(&q.total, depth);
+  __sync_fetch_and_add(&q.samples, 1);
+}
+
+void Metrics::setSortStats(const merge_sort_stats& stats)
+{
+  pthread_mutex_lock(&lock_);
+  sort_ = stats;
+  sorted_ = true;
+  pthread_mutex_unlock(&lock_);
+}
+
+//## Phases
+void Metrics::beginPhase(const char* name)
+{
+  double wall = clock_ms(CLOCK_MONOTONIC);
+  double cpu = clock_ms(CLOCK_PROCESS_CPUTIME_ID);
+  pthread_mutex_lock(&lock_);
+  closePhase(wall, cpu);
+  phase_ = name;
+  phase_wall_ = wall;
+  phase_cpu_ = cpu;
+  pthread_mutex_unlock(&lock_);
+}
+
+void Metrics::endPhase()
+{
+  double wall = clock_ms(CLOCK_MONOTONIC);
+  double cpu = clock_ms(CLOCK_PROCESS_CPUTIME_ID);
+  pthread_mutex_lock(&lock_);
+  closePhase(wall, cpu);
+  pthread_mutex_unlock(&lock_);
+}
+
+//Called with the lock held.
+void Metrics::closePhase(double wall, double cpu)
+{
+  if(phase_ == NULL) return;
+  Phase phase = { phase_, wall - phase_wall_, cpu - phase_cpu_ };
+  phases_.push_back(phase);
+  phase_ = NULL;
+}
+
+//## JSON
+static void append(std::string* out, const char* format, ...)
+    __attribute__((format(printf, 2, 3)));
+
+static void append(std::string* out, const char* format, ...)
+{
+  char buf[256];
+  va_list args;
+  va_start(args, format);
+  vsnprintf(buf, sizeof(buf), format, args);
+  va_end(args);
+  *out += buf;
+}
+
+static void append_bytes(std::string* out, const char* name, uint64_t read,
+                         uint64_t written)
+{
+  append(out, "\"%s\":{\"read_bytes\":%llu,\"written_bytes\":%llu}", name,
+         (unsigned long long) read, (unsigned long long) written);
+}
+
+static void append_nodes(std::string* out, const char* name, uint64_t count,
+                         uint64_t raw, uint64_t compressed)
+{
+  append(out, "\"%s\":{\"count\":%llu,\"raw_bytes\":%llu,"
+         "\"compressed_bytes\":%llu}", name, (unsigned long long) count,
+         (unsigned long long) raw, (unsigned long long) compressed);
+}
+
+//The kernel's count of this process's I/O, in /proc/self/io: `rchar` and
+//`wchar` for everything read and written, `read_bytes` and `write_bytes` for
+//what actually went to the disk.
+static void append_process_io(std::string* out)
+{
+  FILE* io = fopen("/proc/self/io", "r");
+  if(io == NULL) return;
+  *out += ",\"process_io\":{";
+  char name[32];
+  unsigned long long value;
+  bool first = true;
+  while(fscanf(io, "%31[^:]: %llu ", name, &value) == 2)
+  {
+    append(out, "%s\"%s\":%llu", first ? "" : ",", name, value);
+    first = false;
+  }
+  *out += "}";
+  fclose(io);
+}
+
+std::string Metrics::report(bool final, int error)
+{
+  double wall = clock_ms(CLOCK_MONOTONIC);
+  double cpu = clock_ms(CLOCK_PROCESS_CPUTIME_ID);
+  rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  std::string out;
+  append(&out, "{\"final\":%s", final ? "true" : "false");
+  if(final)
+    append(&out, ",\"error\":%d", error);
+  append(&out, ",\"elapsed_ms\":%.1f,\"cpu_ms\":%.1f,\"peak_rss_kb\":%ld",
+         wall - start_wall_, cpu, usage.ru_maxrss);
+  //Phases, the one under way with its time so far.
+  pthread_mutex_lock(&lock_);
+  out += ",\"phases\":[";
+  for(size_t i = 0; i < phases_.size(); i++)
+    append(&out, "%s{\"name\":\"%s\",\"wall_ms\":%.1f,\"cpu_ms\":%.1f}",
+           i ? "," : "", phases_[i].name, phases_[i].wall_ms,
+           phases_[i].cpu_ms);
+  if(phase_)
+    append(&out, "%s{\"name\":\"%s\",\"wall_ms\":%.1f,\"cpu_ms\":%.1f,"
+           "\"running\":true}", phases_.empty() ? "" : ",", phase_,
+           wall - phase_wall_, cpu - phase_cpu_);
+  out += "]";
+  merge_sort_stats sort = sort_;
+  bool sorted = sorted_;
+  pthread_mutex_unlock(&lock_);
+  //Files.
+  out += ",\"files\":{";
+  append_bytes(&out, "source", read_[kSourceFile], written_[kSourceFile]);
+  out += ",";
+  append_bytes(&out, "target", read_[kTargetFile], written_[kTargetFile]);
+  out += ",";
+  append_bytes(&out, "segments", read_[kSegmentFile], written_[kSegmentFile]);
+  out += ",";
+  append_bytes(&out, "other", read_[kOtherFile], written_[kOtherFile]);
+  out += "}";
+  append_process_io(&out);
+  //Counts.
+  append(&out, ",\"docs\":%llu,\"checkpoints\":%llu,\"catch_up_batches\":%llu",
+         (unsigned long long) counters_[kDocs],
+         (unsigned long long) counters_[kCheckpoints],
+         (unsigned long long) counters_[kCatchUpBatches]);
+  out += ",\"nodes\":{";
+  append_nodes(&out, "leaf", counters_[kLeafNodes], counters_[kLeafRawBytes],
+               counters_[kLeafCompressedBytes]);
+  out += ",";
+  append_nodes(&out, "interior", counters_[kInteriorNodes],
+               counters_[kInteriorRawBytes],
+               counters_[kInteriorCompressedBytes]);
+  out += "}";
+  //The sorter's, once it's finished.
+  if(sorted)
+    append(&out, ",\"sort\":{\"records\":%lu,\"buffers_spilled\":%lu,"
+           "\"runs_spilled\":%lu,\"runs_in_memory\":%lu,"
+           "\"intermediate_merges\":%lu,"
+           "\"spill_written_bytes\":%llu,\"spill_read_bytes\":%llu}",
+           sort.records, sort.buffers_spilled, sort.runs_spilled,
+           sort.runs_in_memory, sort.intermediate_merges, sort.bytes_written,
+           sort.bytes_read);
+  //Queues.
+  static const char* queue_names[kQueues] = {
+    "compress", "pipeline", "copy_window"
+  };
+  out += ",\"queues\":{";
+  for(int i = 0; i < kQueues; i++)
+  {
+    const QueueDepth& q = queues_[i];
+    append(&out, "%s\"%s\":{\"peak\":%llu,\"mean\":%.1f}", i ? "," : "",
+           queue_names[i], (unsigned long long) q.peak,
+           q.samples ? (double) q.total / q.samples : 0.0);
+  }
+  out += "}}";
+  return out;
+}
+
+//## Reporting
+MetricsReporter::MetricsReporter(const char* path, unsigned interval)
+    : path_(path), interval_(interval), out_(NULL), running_(false),
+      stopping_(false)
+{
+  pthread_mutex_init(&lock_, NULL);
+  pthread_cond_init(&stop_, NULL);
+}
+
+MetricsReporter::~MetricsReporter()
+{
+  pthread_mutex_destroy(&lock_);
+  pthread_cond_destroy(&stop_);
+}
+
+int MetricsReporter::start()
+{
+  out_ = strcmp(path_, "-") == 0 ? stdout : fopen(path_, "w");
+  if(out_ == NULL) return ERROR_OPEN_FILE;
+  if(interval_ && pthread_create(&thread_, NULL, reporter_main, this) == 0)
+    running_ = true;
+  return 0;
+}
+
+void* MetricsReporter::reporter_main(void* ctx)
+{
+  static_cast<MetricsReporter*>(ctx)->report_periodically();
+  return NULL;
+}
+
+void MetricsReporter::report_periodically()
+{
+  pthread_mutex_lock(&lock_);
+  timespec until;
+  clock_gettime(CLOCK_REALTIME, &until);
+  while(!stopping_)
+  {
+    until.tv_sec += interval_;
+    while(!stopping_ &&
+          pthread_cond_timedwait(&stop_, &lock_, &until) != ETIMEDOUT) { }
+    if(stopping_) break;
+    std::string report = Metrics::get().report();
+    fprintf(out_, "%s\n", report.c_str());
+    fflush(out_);
+  }
+  pthread_mutex_unlock(&lock_);
+}
+
+int MetricsReporter::finish(int error)
+{
+  if(out_ == NULL) return 0;
+  pthread_mutex_lock(&lock_);
+  stopping_ = true;
+  pthread_cond_signal(&stop_);
+  pthread_mutex_unlock(&lock_);
+  if(running_)
+    pthread_join(thread_, NULL);
+  running_ = false;
+  std::string report = Metrics::get().report(true, error);
+  fprintf(out_, "%s\n", report.c_str());
+  int result = 0;
+  if(out_ == stdout)
+    fflush(out_);
+  else if(fclose(out_) != 0)
+    result = ERROR_WRITE;
+  out_ = NULL;
+  return result;
+}
+}
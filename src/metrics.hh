@@ -0,0 +1,134 @@
+#ifndef COUCH_METRICS_H
+#define COUCH_METRICS_H
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include "wrap.hh"
+#include "mergesor.h"
+//# Metrics
+//What a compaction spends its time and I/O on, broken down far enough to
+//tell body reads from node writes from the ID sort, and reported as JSON
+//for dashboards to pick up.
+//
+//There's one set per process, counted into from whichever thread does the
+//work, with atomic adds: no locks are taken on the I/O paths. Phases are
+//timed on the thread running `compact`, in wall time and in CPU time of the
+//whole process, so worker threads' time counts towards the phase they
+//worked in.
+//
+//Bytes are counted per file by descriptor, for our own reads and writes
+//(`pread_all`, `pwrite_all`, io\_uring reads and `copy_file_range`).
+//Couchstore's own reads of the source (walking its B-trees, and reading
+//bodies with `-R`) only show up in `process_io`, the kernel's count for the
+//whole process; the sorter's spill files are in `sort`.
+namespace couchstore
+{
+class Metrics {
+ public:
+  //What a descriptor's reads and writes are counted as.
+  enum File {
+    kOtherFile,
+    kSourceFile,
+    kTargetFile,
+    kSegmentFile,
+    kFileKinds
+  };
+  enum Counter {
+    kDocs,
+    kLeafNodes,
+    kLeafRawBytes,
+    kLeafCompressedBytes,
+    kInteriorNodes,
+    kInteriorRawBytes,
+    kInteriorCompressedBytes,
+    kCheckpoints,
+    kCatchUpBatches,
+    kCounters
+  };
+  //Queues whose depth is sampled each time something's added to them.
+  enum Queue {
+    kCompressQueue,
+    kPipelineQueue,
+    kCopyWindow,
+    kQueues
+  };
+  static Metrics& get();
+  void setFile(int fd, File file);
+  void read(int fd, uint64_t bytes);
+  void wrote(int fd, uint64_t bytes);
+  void add(Counter counter, uint64_t n = 1) {
+    __sync_fetch_and_add(&counters_[counter], n);
+  }
+  //A node written, `raw` bytes before compression.
+  void node(bool leaf, uint64_t raw, uint64_t compressed);
+  void depth(Queue queue, uint64_t depth);
+  void setSortStats(const merge_sort_stats& stats);
+  //Phases follow one another; starting one ends the last.
+  void beginPhase(const char* name);
+  void endPhase();
+  //Everything so far, as a JSON object on one line. A `final` report has
+  //the compaction's result, `error`.
+  std::string report(bool final = false, int error = 0);
+ private:
+  Metrics();
+  struct Phase {
+    const char* name;
+    double wall_ms;
+    double cpu_ms;
+  };
+  struct QueueDepth {
+    uint64_t peak;
+    uint64_t total;
+    uint64_t samples;
+  };
+  static const int kMaxFd = 1024;
+  File fileOf(int fd) const {
+    return fd >= 0 && fd < kMaxFd ? (File) files_[fd] : kOtherFile;
+  }
+  void closePhase(double wall, double cpu);
+  unsigned char files_[kMaxFd];
+  uint64_t read_[kFileKinds];
+  uint64_t written_[kFileKinds];
+  uint64_t counters_[kCounters];
+  QueueDepth queues_[kQueues];
+  merge_sort_stats sort_;
+  bool sorted_;
+  double start_wall_;
+  std::vector<Phase> phases_;
+  //The phase under way, if `phase_` isn't NULL, and when it started.
+  const char* phase_;
+  double phase_wall_;
+  double phase_cpu_;
+  pthread_mutex_t lock_;
+  DISALLOW_COPY_AND_ASSIGN(Metrics);
+};
+
+//## Reporting
+//Writes reports to `path` ("-" for stdout) one per line: every `interval`
+//seconds from a thread of its own, if `interval` isn't 0, and a last one
+//from `finish`, marked `"final": true`, which has to be called once it's
+//started.
+class MetricsReporter {
+ public:
+  MetricsReporter(const char* path, unsigned interval);
+  ~MetricsReporter();
+  int start();
+  //Stop the thread, and write the last report, with the compaction's result.
+  int finish(int error);
+ private:
+  static void* reporter_main(void* ctx);
+  void report_periodically();
+  const char* path_;
+  unsigned interval_;
+  FILE* out_;
+  bool running_;
+  bool stopping_;
+  pthread_t thread_;
+  pthread_mutex_t lock_;
+  pthread_cond_t stop_;
+  DISALLOW_COPY_AND_ASSIGN(MetricsReporter);
+};
+}
+#endif
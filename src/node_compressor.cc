@@ -0,0 +1,192 @@
+#include <string.h>
+#include <snappy-c.h>
+#include "node_compressor.hh"
+#include "metrics.hh"
+namespace couchstore
+{
+NodeCompressor::NodeCompressor(ChunkWriter* writer, unsigned threads,
+                               unsigned depth)
+    : writer_(writer), thread_count_(threads ? threads : 1),
+      slots_(depth ? depth : 1), head_(0), next_(0), tail_(0),
+      closing_(false), error_(0)
+{
+  for(std::vector<Slot>::iterator it = slots_.begin(); it != slots_.end(); ++it)
+  {
+    (*it).input_size = 0;
+    (*it).output_size = 0;
+    (*it).bytes = NULL;
+    (*it).state = kEmpty;
+    (*it).error = 0;
+  }
+  pthread_mutex_init(&lock_, NULL);
+  pthread_cond_init(&work_, NULL);
+  pthread_cond_init(&compressed_, NULL);
+}
+
+NodeCompressor::~NodeCompressor()
+{
+  pthread_mutex_lock(&lock_);
+  closing_ = true;
+  pthread_cond_broadcast(&work_);
+  pthread_mutex_unlock(&lock_);
+  for(std::vector<pthread_t>::iterator it = threads_.begin();
+      it != threads_.end(); ++it)
+    pthread_join(*it, NULL);
+  pthread_mutex_destroy(&lock_);
+  pthread_cond_destroy(&work_);
+  pthread_cond_destroy(&compressed_);
+}
+
+//Fewer threads than asked for will do, but not none.
+int NodeCompressor::start()
+{
+  for(unsigned i = 0; i < thread_count_; i++)
+  {
+    pthread_t thread;
+    if(pthread_create(&thread, NULL, worker_main, this) != 0)
+      break;
+    threads_.push_back(thread);
+  }
+  return threads_.empty() ? ERROR_ALLOC_FAIL : 0;
+}
+
+int NodeCompressor::submit(const sized_buf* node,
+                           const shared_ptr<NodePointerBase>& pointer,
+                           NodeType type, NodeBytes* bytes)
+{
+  pthread_mutex_lock(&lock_);
+  //Make room in the ring by appending the oldest node, once it's compressed.
+  uint64_t until = 0;
+  if(head_ + 1 > slots_.size())
+    until = head_ + 1 - slots_.size();
+  int error = append(until);
+  if(error)
+  {
+    pthread_mutex_unlock(&lock_);
+    return error;
+  }
+  //Slots from `head_` on are only touched here, so the node can be copied in
+  //without the lock.
+  Slot& slot = slots_[head_ % slots_.size()];
+  pthread_mutex_unlock(&lock_);
+  if(slot.input.size() < node->size)
+    slot.input.resize(node->size);
+  memcpy(&slot.input[0], node->buf, node->size);
+  slot.input_size = node->size;
+  slot.pointer = pointer;
+  slot.type = type;
+  slot.bytes = bytes;
+  slot.error = 0;
+  pthread_mutex_lock(&lock_);
+  slot.state = kQueued;
+  head_++;
+  Metrics::get().depth(Metrics::kCompressQueue, head_ - tail_);
+  pthread_cond_signal(&work_);
+  //Pass on whatever's ready, without waiting for the rest.
+  error = append(0);
+  pthread_mutex_unlock(&lock_);
+  return error;
+}
+
+int NodeCompressor::drain()
+{
+  pthread_mutex_lock(&lock_);
+  int error = append(head_);
+  pthread_mutex_unlock(&lock_);
+  return error;
+}
+
+int NodeCompressor::finish()
+{
+  int error = drain();
+  pthread_mutex_lock(&lock_);
+  closing_ = true;
+  pthread_cond_broadcast(&work_);
+  pthread_mutex_unlock(&lock_);
+  for(std::vector<pthread_t>::iterator it = threads_.begin();
+      it != threads_.end(); ++it)
+    pthread_join(*it, NULL);
+  threads_.clear();
+  return error;
+}
+
+void* NodeCompressor::worker_main(void* ctx)
+{
+  static_cast<NodeCompressor*>(ctx)->compress_nodes();
+  return NULL;
+}
+
+//## Compressing
+//Claim the oldest node nobody is compressing yet and compress it.
+void NodeCompressor::compress_nodes()
+{
+  pthread_mutex_lock(&lock_);
+  while(true)
+  {
+    while(next_ == head_ && !closing_)
+      pthread_cond_wait(&work_, &lock_);
+    if(next_ == head_)
+      break;
+    Slot& slot = slots_[next_++ % slots_.size()];
+    pthread_mutex_unlock(&lock_);
+    size_t len = snappy_max_compressed_length(slot.input_size);
+    if(slot.output.size() < len)
+      slot.output.resize(len);
+    if(snappy_compress(&slot.input[0], slot.input_size, &slot.output[0],
+                       &len) != SNAPPY_OK)
+      slot.error = ERROR_WRITE;
+    slot.output_size = len;
+    pthread_mutex_lock(&lock_);
+    slot.state = kCompressed;
+    pthread_cond_broadcast(&compressed_);
+  }
+  pthread_mutex_unlock(&lock_);
+}
+
+//## Appending
+//Called with the lock held. Write out compressed nodes from the tail of the
+//ring in order, waiting for any before `until` that aren't compressed yet.
+//After an error, nodes are only dropped.
+int NodeCompressor::append(uint64_t until)
+{
+  while(tail_ < head_)
+  {
+    Slot& slot = slots_[tail_ % slots_.size()];
+    if(slot.state != kCompressed)
+    {
+      if(tail_ >= until)
+        break;
+      pthread_cond_wait(&compressed_, &lock_);
+      continue;
+    }
+    int error = error_ ? error_ : slot.error;
+    pthread_mutex_unlock(&lock_);
+    if(!error)
+    {
+      sized_buf compressed = { &slot.output[0], slot.output_size };
+      off_t position;
+      error = writer_->write(&compressed, &position);
+      if(!error)
+      {
+        slot.pointer->pointer_ = position;
+        slot.pointer->placed_ = true;
+      }
+      if(!error && slot.bytes)
+      {
+        slot.bytes->raw += slot.input_size;
+        slot.bytes->compressed += slot.output_size;
+      }
+      if(!error)
+        Metrics::get().node(slot.type == kKVNode, slot.input_size,
+                            slot.output_size);
+    }
+    slot.pointer.reset();
+    pthread_mutex_lock(&lock_);
+    if(error && !error_)
+      error_ = error;
+    slot.state = kEmpty;
+    tail_++;
+  }
+  return error_;
+}
+}
@@ -0,0 +1,80 @@
+#ifndef COUCH_NODE_COMPRESSOR_H
+#define COUCH_NODE_COMPRESSOR_H
+#include <pthread.h>
+#include <vector>
+#include "wrap.hh"
+#include "btree_copy.hh"
+#include "chunk_writer.hh"
+//# Parallel node compression
+//Compressing a node with snappy costs more than encoding it, and would
+//otherwise happen on whichever thread builds the tree, one node at a time.
+//A `NodeBuilder` given a `NodeCompressor` instead hands each node it flushes
+//to a pool of threads to compress, and gets back a `NodePointer` whose
+//position isn't known yet.
+//
+//Nodes are appended to the file strictly in the order they were handed in,
+//by the thread handing them in, as it hands in more or waits in `drain`. The
+//`ChunkWriter` is never used from more than one thread at a time, so bodies
+//and nodes can still be written through it side by side, and the file is laid
+//out just as if each node had been compressed and written where it was
+//flushed, only later.
+//
+//A pointer's position is filled in when its node is appended, so nothing may
+//read it (to put it in a pointer node, or the header) until after a `drain`.
+namespace couchstore
+{
+class NodeCompressor {
+ public:
+  //Up to `depth` nodes may be waiting to be compressed or appended.
+  NodeCompressor(ChunkWriter* writer, unsigned threads, unsigned depth);
+  ~NodeCompressor();
+  int start();
+  //Queue `node`, of `type`, to be compressed and appended, and set
+  //`pointer`'s position once it is. The node is copied, so its buffer can be
+  //reused at once. Its size before and after compression is added to
+  //`bytes`, if given, when it's appended (on the calling thread, like
+  //everything else done on appending).
+  int submit(const sized_buf* node, const shared_ptr<NodePointerBase>& pointer,
+             NodeType type, NodeBytes* bytes = NULL);
+  //Append every node submitted so far. Returns the first error hit.
+  int drain();
+  //Drain, and stop the threads.
+  int finish();
+ private:
+  enum SlotState {
+    kEmpty,
+    kQueued,
+    kCompressed
+  };
+  struct Slot {
+    std::vector<char> input;
+    size_t input_size;
+    std::vector<char> output;
+    size_t output_size;
+    shared_ptr<NodePointerBase> pointer;
+    NodeType type;
+    NodeBytes* bytes;
+    SlotState state;
+    int error;
+  };
+  static void* worker_main(void* ctx);
+  void compress_nodes();
+  int append(uint64_t until);
+  ChunkWriter* writer_;
+  unsigned thread_count_;
+  std::vector<Slot> slots_;
+  std::vector<pthread_t> threads_;
+  //Nodes `tail_` up to `head_` are in the ring; workers have claimed the ones
+  //before `next_`.
+  uint64_t head_;
+  uint64_t next_;
+  uint64_t tail_;
+  bool closing_;
+  int error_;
+  pthread_mutex_t lock_;
+  pthread_cond_t work_;
+  pthread_cond_t compressed_;
+  DISALLOW_COPY_AND_ASSIGN(NodeCompressor);
+};
+}
+#endif
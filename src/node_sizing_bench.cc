@@ -0,0 +1,160 @@
+#include <algorithm>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <libcouchstore/couch_btree.h>
+#include "node_sizing_bench.hh"
+namespace couchstore
+{
+//Doc IDs looked up in each new file.
+static const size_t kLookupSamples = 1000;
+
+static double now_us()
+{
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+//Picks doc IDs evenly at random from a walk of the `by_seq` tree.
+class IdSampler : public InfoCallback {
+ public:
+  IdSampler() : seen_(0) { }
+  int callback(DocumentInfo& info) {
+    std::string id(info->id.buf, info->id.size);
+    if(ids.size() < kLookupSamples)
+      ids.push_back(id);
+    else
+    {
+      uint64_t slot = random() % (seen_ + 1);
+      if(slot < kLookupSamples)
+        ids[slot] = id;
+    }
+    seen_++;
+    return 0;
+  }
+  std::vector<std::string> ids;
+ private:
+  uint64_t seen_;
+};
+
+static int count_found(couchfile_lookup_request* rq, void* k, sized_buf* v)
+{
+  (*static_cast<size_t*>(rq->callback_ctx))++;
+  return 0;
+}
+
+//Look up each of `ids` in the `by_id` tree, adding the time each took, in
+//microseconds, to `times`. If `cold`, the file is dropped from the page cache
+//before each lookup.
+static int time_lookups(Db* db, const std::vector<std::string>& ids, bool cold,
+                        std::vector<double>* times)
+{
+  for(std::vector<std::string>::const_iterator it = ids.begin();
+      it != ids.end(); ++it)
+  {
+    sized_buf key = { const_cast<char*>(it->data()), it->size() };
+    void* keys[1] = { &key };
+    sized_buf tmp;
+    size_t found = 0;
+    couchfile_lookup_request rq;
+    rq.cmp.arg = &tmp;
+    rq.cmp.compare = ebin_cmp;
+    rq.cmp.from_ext = ebin_from_ext;
+    rq.keys = keys;
+    rq.num_keys = 1;
+    rq.fold = 0;
+    rq.in_fold = 0;
+    rq.fd = db->fd;
+    rq.fetch_callback = count_found;
+    rq.callback_ctx = &found;
+    if(cold)
+      posix_fadvise(db->fd, 0, 0, POSIX_FADV_DONTNEED);
+    double start = now_us();
+    int error = btree_lookup(&rq, db->header.by_id_root->pointer);
+    times->push_back(now_us() - start);
+    if(error < 0) return error;
+    if(found != 1) return ERROR_READ;
+  }
+  return 0;
+}
+
+static double mean(const std::vector<double>& times)
+{
+  double total = 0;
+  for(size_t i = 0; i < times.size(); i++)
+    total += times[i];
+  return times.empty() ? 0 : total / times.size();
+}
+
+static double p99(std::vector<double> times)
+{
+  if(times.empty()) return 0;
+  std::sort(times.begin(), times.end());
+  return times[(times.size() - 1) * 99 / 100];
+}
+
+//Warm lookups are timed after one untimed pass over the same IDs.
+static int measure_lookups(std::string& path, std::vector<double>* warm,
+                           std::vector<double>* cold)
+{
+  DBHandle db(path, false);
+  if(!db.isValid()) return db.lastError();
+  if(db->header.by_id_root == NULL) return 0;
+  IdSampler sampler;
+  int error = db.changes(0, sampler);
+  if(!error)
+    error = time_lookups(db.get(), sampler.ids, false, warm);
+  warm->clear();
+  if(!error)
+    error = time_lookups(db.get(), sampler.ids, false, warm);
+  if(!error)
+    error = time_lookups(db.get(), sampler.ids, true, cold);
+  return error;
+}
+
+int sweep_node_sizing(std::string& filename, const CompactOptions& options,
+                      const std::vector<const char*>& specs)
+{
+  std::string path = filename + ".compact";
+  printf("%-32s %14s %10s %20s %20s\n", "sizing", "bytes", "build_ms",
+         "warm_us mean/p99", "cold_us mean/p99");
+  for(std::vector<const char*>::const_iterator it = specs.begin();
+      it != specs.end(); ++it)
+  {
+    CompactOptions run = options;
+    if(strcmp(*it, "default") != 0 && !parse_node_sizing(*it, &run))
+    {
+      fprintf(stderr, "Bad node sizing: %s\n", *it);
+      return 1;
+    }
+    //Each run builds its own file from scratch.
+    run.catch_up = false;
+    run.resume = false;
+    double start = now_us();
+    int error = compact(filename, run);
+    double build_ms = (now_us() - start) / 1e3;
+    struct stat st;
+    if(!error && stat(path.c_str(), &st) != 0)
+      error = ERROR_OPEN_FILE;
+    std::vector<double> warm, cold;
+    if(!error)
+      error = measure_lookups(path, &warm, &cold);
+    unlink(path.c_str());
+    if(error)
+    {
+      fprintf(stderr, "%s: error %d\n", *it, error);
+      return error;
+    }
+    printf("%-32s %14llu %10.0f %9.1f/%-10.1f %9.1f/%-10.1f\n", *it,
+           (unsigned long long) st.st_size, build_ms, mean(warm), p99(warm),
+           mean(cold), p99(cold));
+    fflush(stdout);
+  }
+  return 0;
+}
+}
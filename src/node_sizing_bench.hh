@@ -0,0 +1,18 @@
+#ifndef COUCH_NODE_SIZING_BENCH_H
+#define COUCH_NODE_SIZING_BENCH_H
+#include <string>
+#include <vector>
+#include "compactor.hh"
+//# Node sizing sweep
+//Compacts the same file once for each of a list of node sizing specs (as
+//taken by `parse_node_sizing`, or `default`), and reports for each one the
+//size of the new file, how long compacting took, and how long point lookups
+//by ID take in the result: with the file in the page cache, and with it
+//dropped from the cache before every lookup, as for a file that's rarely
+//read. Each new file is removed once it's been measured.
+namespace couchstore
+{
+int sweep_node_sizing(std::string& filename, const CompactOptions& options,
+                      const std::vector<const char*>& specs);
+}
+#endif
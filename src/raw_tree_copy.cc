@@ -0,0 +1,151 @@
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include <ei.h>
+#include <snappy-c.h>
+#include "raw_tree_copy.hh"
+#include "term_encode.hh"
+namespace couchstore
+{
+//One item of a pointer node, _{Key, {Pointer, Reduce, SubtreeSize}}_, as
+//offsets of its key and reduce terms in the node, which are kept as they are.
+struct PointerItem {
+  int key;
+  int key_end;
+  int reduce;
+  int reduce_end;
+  uint64_t pointer;
+  uint64_t subtreesize;
+};
+
+//Decode the items of the pointer node in `node`, whose list header ends at
+//`*pos`, leaving `*pos` at the list's tail.
+static int decode_pointers(const char* node, int* pos, int count,
+                           std::vector<PointerItem>& items)
+{
+  for(int i = 0; i < count; i++)
+  {
+    PointerItem item;
+    int arity;
+    unsigned long long pointer, subtreesize;
+    if(ei_decode_tuple_header(node, pos, &arity))
+      return ERROR_PARSE_TERM;
+    item.key = *pos;
+    if(ei_skip_term(node, pos))
+      return ERROR_PARSE_TERM;
+    item.key_end = *pos;
+    if(ei_decode_tuple_header(node, pos, &arity) ||
+       ei_decode_ulonglong(node, pos, &pointer))
+      return ERROR_PARSE_TERM;
+    item.reduce = *pos;
+    if(ei_skip_term(node, pos))
+      return ERROR_PARSE_TERM;
+    item.reduce_end = *pos;
+    if(ei_decode_ulonglong(node, pos, &subtreesize))
+      return ERROR_PARSE_TERM;
+    item.pointer = pointer;
+    item.subtreesize = subtreesize;
+    items.push_back(item);
+  }
+  return 0;
+}
+
+//Copy the children of the pointer node `node` (`size` bytes, uncompressed),
+//then the node itself, with its items pointing at the copies. How much the
+//subtrees under it grew is added to `*growth`.
+static int copy_pointer_node(int fd, const char* node, size_t size,
+                             ChunkWriter* writer, int list, int count,
+                             off_t* position, size_t* compressed_size,
+                             int64_t* growth)
+{
+  std::vector<PointerItem> items;
+  int pos = list;
+  int error = decode_pointers(node, &pos, count, items);
+  if(error) return error;
+  //The node's header, up to its items, and its list tail are kept as they
+  //are; only the pointers and subtree sizes change.
+  size_t new_size = list + (size - pos);
+  for(std::vector<PointerItem>::iterator it = items.begin();
+      it != items.end(); ++it)
+  {
+    int64_t child_growth = 0;
+    error = copy_subtree(fd, it->pointer, writer, &it->pointer,
+                         &child_growth);
+    if(error) return error;
+    it->subtreesize += child_growth;
+    *growth += child_growth;
+    new_size += term::Tuple<2>::size + (it->key_end - it->key) +
+                term::Tuple<3>::size + term::ulonglong_size(it->pointer) +
+                (it->reduce_end - it->reduce) +
+                term::ulonglong_size(it->subtreesize);
+  }
+  std::vector<char> rewritten(new_size);
+  char* out = &rewritten[0];
+  memcpy(out, node, list);
+  out += list;
+  for(std::vector<PointerItem>::iterator it = items.begin();
+      it != items.end(); ++it)
+  {
+    out = term::Tuple<2>::put(out);
+    memcpy(out, node + it->key, it->key_end - it->key);
+    out += it->key_end - it->key;
+    out = term::Tuple<3>::put(out);
+    out = term::put_ulonglong(out, it->pointer);
+    memcpy(out, node + it->reduce, it->reduce_end - it->reduce);
+    out += it->reduce_end - it->reduce;
+    out = term::put_ulonglong(out, it->subtreesize);
+  }
+  memcpy(out, node + pos, size - pos);
+  sized_buf buf = { &rewritten[0], new_size };
+  return writer->write_compressed(&buf, position, compressed_size);
+}
+
+//## Copying a node
+//Leaves are passed through still compressed. A pointer node is
+//uncompressed, to find its children, and written back out once they've been
+//copied.
+int copy_subtree(int fd, uint64_t root, ChunkWriter* writer,
+                 uint64_t* new_root, int64_t* growth)
+{
+  char* chunk;
+  int chunk_size = pread_bin(fd, root, &chunk);
+  if(chunk_size < 0)
+    return ERROR_READ;
+  size_t size;
+  char* node = NULL;
+  int error = 0;
+  if(snappy_uncompressed_length(chunk, chunk_size, &size) != SNAPPY_OK)
+    error = ERROR_READ;
+  else if((node = static_cast<char*>(malloc(size))) == NULL)
+    error = ERROR_ALLOC_FAIL;
+  else if(snappy_uncompress(chunk, chunk_size, node, &size) != SNAPPY_OK)
+    error = ERROR_READ;
+  int pos = 0;
+  int version, arity, count;
+  char atom[MAXATOMLEN + 1];
+  if(!error &&
+     (ei_decode_version(node, &pos, &version) ||
+      ei_decode_tuple_header(node, &pos, &arity) ||
+      ei_decode_atom(node, &pos, atom) ||
+      ei_decode_list_header(node, &pos, &count)))
+    error = ERROR_PARSE_TERM;
+  off_t position = 0;
+  if(!error && strcmp(atom, "kp_node") == 0)
+  {
+    size_t compressed_size;
+    error = copy_pointer_node(fd, node, size, writer, pos, count, &position,
+                              &compressed_size, growth);
+    if(!error)
+      *growth += (int64_t) compressed_size - chunk_size;
+  }
+  else if(!error)
+  {
+    sized_buf buf = { chunk, (size_t) chunk_size };
+    error = writer->write(&buf, &position);
+  }
+  free(node);
+  free(chunk);
+  *new_root = position;
+  return error;
+}
+}
@@ -0,0 +1,24 @@
+#ifndef COUCH_RAW_TREE_COPY_H
+#define COUCH_RAW_TREE_COPY_H
+#include <libcouchstore/couch_db.h>
+#include "chunk_writer.hh"
+//# Verbatim B-tree copy
+//For a tree whose items don't point anywhere else in the file (the local
+//docs tree, whose values are the docs themselves), there's nothing in a
+//leaf to fix up, so there's no need to decode and re-encode every item just
+//to write it out again. Each _kv\_node_ chunk is copied to the new file as it
+//is, still compressed, and only the _kp\_node_s are decoded, to point their
+//items at where their children went, and recompressed.
+//
+//Children are copied before their parents, so a copied tree is laid out just
+//as one built bottom-up would be. Each node's subtree size is adjusted by how
+//much the rewritten pointer nodes under it grew or shrank.
+namespace couchstore
+{
+//Copy the tree whose root node is at `root` in `fd` through `writer`,
+//setting `*new_root` to where its root went and adding the change in the
+//tree's size to `*growth`.
+int copy_subtree(int fd, uint64_t root, ChunkWriter* writer,
+                 uint64_t* new_root, int64_t* growth);
+}
+#endif
@@ -0,0 +1,237 @@
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <deque>
+#include <vector>
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+#include "read_engine.hh"
+#include "metrics.hh"
+namespace couchstore
+{
+//Most threads the `pread` pool will start, however deep the queue.
+static const unsigned kMaxReadThreads = 32;
+
+bool pread_all(int fd, char* buf, size_t len, uint64_t pos)
+{
+  while(len > 0)
+  {
+    ssize_t n = pread(fd, buf, len, pos);
+    if(n < 0 && errno == EINTR) continue;
+    if(n <= 0) return false;
+    Metrics::get().read(fd, n);
+    buf += n;
+    len -= n;
+    pos += n;
+  }
+  return true;
+}
+
+int ReadEngine::wait(ReadRequest* req)
+{
+  wait_for(req);
+  //A ring that doesn't know the read op (kernels before 5.6) fails it with
+  //EINVAL; just do those ourselves.
+  if(req->result == -EINVAL || req->result == -EOPNOTSUPP)
+    req->result = 0;
+  if(req->result < 0)
+    return ERROR_READ;
+  //Finish off a short read.
+  size_t got = req->result;
+  if(got < req->len &&
+     !pread_all(fd_, req->buf + got, req->len - got, req->pos + got))
+    return ERROR_READ;
+  return 0;
+}
+
+//## Thread pool engine
+class PreadPool : public ReadEngine {
+ public:
+  PreadPool(int fd, unsigned threads);
+  ~PreadPool();
+  int submit(ReadRequest* req);
+ protected:
+  void wait_for(ReadRequest* req);
+ private:
+  static void* worker_main(void* ctx);
+  void work();
+  std::deque<ReadRequest*> queue_;
+  std::vector<pthread_t> threads_;
+  bool stopping_;
+  pthread_mutex_t lock_;
+  pthread_cond_t work_;
+  pthread_cond_t done_;
+};
+
+PreadPool::PreadPool(int fd, unsigned threads) : stopping_(false)
+{
+  fd_ = fd;
+  pthread_mutex_init(&lock_, NULL);
+  pthread_cond_init(&work_, NULL);
+  pthread_cond_init(&done_, NULL);
+  for(unsigned i = 0; i < threads; i++)
+  {
+    pthread_t thread;
+    if(pthread_create(&thread, NULL, worker_main, this) != 0)
+      break;
+    threads_.push_back(thread);
+  }
+}
+
+PreadPool::~PreadPool()
+{
+  pthread_mutex_lock(&lock_);
+  stopping_ = true;
+  pthread_cond_broadcast(&work_);
+  pthread_mutex_unlock(&lock_);
+  for(std::vector<pthread_t>::iterator it = threads_.begin();
+      it != threads_.end(); ++it)
+    pthread_join(*it, NULL);
+  pthread_mutex_destroy(&lock_);
+  pthread_cond_destroy(&work_);
+  pthread_cond_destroy(&done_);
+}
+
+int PreadPool::submit(ReadRequest* req)
+{
+  req->done = false;
+  //With no threads at all, read it now.
+  if(threads_.empty())
+  {
+    req->result = pread_all(fd_, req->buf, req->len, req->pos) ?
+        (ssize_t) req->len : -EIO;
+    req->done = true;
+    return 0;
+  }
+  pthread_mutex_lock(&lock_);
+  queue_.push_back(req);
+  pthread_cond_signal(&work_);
+  pthread_mutex_unlock(&lock_);
+  return 0;
+}
+
+void PreadPool::wait_for(ReadRequest* req)
+{
+  pthread_mutex_lock(&lock_);
+  while(!req->done)
+    pthread_cond_wait(&done_, &lock_);
+  pthread_mutex_unlock(&lock_);
+}
+
+void* PreadPool::worker_main(void* ctx)
+{
+  static_cast<PreadPool*>(ctx)->work();
+  return NULL;
+}
+
+void PreadPool::work()
+{
+  pthread_mutex_lock(&lock_);
+  while(true)
+  {
+    while(queue_.empty() && !stopping_)
+      pthread_cond_wait(&work_, &lock_);
+    if(queue_.empty())
+      break;
+    ReadRequest* req = queue_.front();
+    queue_.pop_front();
+    pthread_mutex_unlock(&lock_);
+    ssize_t result = pread_all(fd_, req->buf, req->len, req->pos) ?
+        (ssize_t) req->len : -EIO;
+    pthread_mutex_lock(&lock_);
+    req->result = result;
+    req->done = true;
+    pthread_cond_broadcast(&done_);
+  }
+  pthread_mutex_unlock(&lock_);
+}
+
+#ifdef HAVE_LIBURING
+//## io\_uring engine
+class UringEngine : public ReadEngine {
+ public:
+  UringEngine(int fd) : pending_(0) { fd_ = fd; }
+  ~UringEngine();
+  int init(unsigned depth);
+  int submit(ReadRequest* req);
+ protected:
+  void wait_for(ReadRequest* req);
+ private:
+  io_uring ring_;
+  //Reads queued on the ring but not yet handed to the kernel.
+  unsigned pending_;
+  bool ready_;
+};
+
+int UringEngine::init(unsigned depth)
+{
+  ready_ = io_uring_queue_init(depth, &ring_, 0) == 0;
+  return ready_ ? 0 : ERROR_READ;
+}
+
+UringEngine::~UringEngine()
+{
+  if(ready_)
+    io_uring_queue_exit(&ring_);
+}
+
+int UringEngine::submit(ReadRequest* req)
+{
+  io_uring_sqe* sqe = io_uring_get_sqe(&ring_);
+  if(sqe == NULL)
+  {
+    //The submission queue is full; send this batch on its way.
+    io_uring_submit(&ring_);
+    pending_ = 0;
+    sqe = io_uring_get_sqe(&ring_);
+    if(sqe == NULL)
+      return ERROR_READ;
+  }
+  req->done = false;
+  io_uring_prep_read(sqe, fd_, req->buf, req->len, req->pos);
+  io_uring_sqe_set_data(sqe, req);
+  pending_++;
+  return 0;
+}
+
+void UringEngine::wait_for(ReadRequest* req)
+{
+  if(!req->done && pending_ > 0)
+  {
+    io_uring_submit(&ring_);
+    pending_ = 0;
+  }
+  while(!req->done)
+  {
+    io_uring_cqe* cqe;
+    int error = io_uring_wait_cqe(&ring_, &cqe);
+    if(error == -EINTR) continue;
+    if(error < 0)
+    {
+      req->result = error;
+      req->done = true;
+      break;
+    }
+    ReadRequest* done = static_cast<ReadRequest*>(io_uring_cqe_get_data(cqe));
+    done->result = cqe->res;
+    if(cqe->res > 0)
+      Metrics::get().read(fd_, cqe->res);
+    done->done = true;
+    io_uring_cqe_seen(&ring_, cqe);
+  }
+}
+#endif
+
+ReadEngine* ReadEngine::create(int fd, unsigned depth)
+{
+  if(depth == 0) depth = 1;
+#ifdef HAVE_LIBURING
+  UringEngine* uring = new UringEngine(fd);
+  if(uring->init(depth) == 0)
+    return uring;
+  delete uring;
+#endif
+  return new PreadPool(fd, depth < kMaxReadThreads ? depth : kMaxReadThreads);
+}
+}
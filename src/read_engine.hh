@@ -0,0 +1,49 @@
+#ifndef COUCH_READ_ENGINE_H
+#define COUCH_READ_ENGINE_H
+#include <stdint.h>
+#include <stddef.h>
+#include "wrap.hh"
+//# Asynchronous reads
+//Keeps many reads of one file in flight at once, so a scattered set of small
+//reads can use the queue depth of the device rather than waiting on each in
+//turn. Reads are queued with `submit` and collected with `wait`, in whatever
+//order suits the caller.
+//
+//With liburing, reads are queued on an io\_uring and submitted in batches: a
+//batch goes to the kernel when the caller first waits on one of its reads,
+//or when the ring fills. Otherwise, or if the kernel won't set up a ring, a
+//pool of threads does plain `pread`s.
+namespace couchstore
+{
+struct ReadRequest {
+  char* buf;
+  size_t len;
+  uint64_t pos;
+  //Set by the engine: bytes read, or a negative errno.
+  ssize_t result;
+  bool done;
+};
+
+//Read exactly `len` bytes at `pos`, retrying short reads.
+bool pread_all(int fd, char* buf, size_t len, uint64_t pos);
+
+class ReadEngine {
+ public:
+  //An engine for `fd`, able to keep up to `depth` reads in flight.
+  static ReadEngine* create(int fd, unsigned depth);
+  virtual ~ReadEngine() { }
+  //Start reading `req->len` bytes at `req->pos` into `req->buf`. The request
+  //must stay put until it has been waited for.
+  virtual int submit(ReadRequest* req) = 0;
+  //Wait for a submitted read to finish. Returns 0, or `ERROR_READ` if it
+  //failed or came up short.
+  int wait(ReadRequest* req);
+ protected:
+  ReadEngine() { }
+  virtual void wait_for(ReadRequest* req) = 0;
+  int fd_;
+ private:
+  DISALLOW_COPY_AND_ASSIGN(ReadEngine);
+};
+}
+#endif
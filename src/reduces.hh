@@ -1,60 +1,130 @@
 #ifndef REDUCES_HH
 #define REDUCES_HH
-#include "btree_copy.hh"
+#include <stdint.h>
+#include "term_encode.hh"
 namespace couchstore {
 //# Reduce Functions
+//Each is a small value type that `NodeBuilder` and `NodePointer` are
+//templated on (see btree_copy.hh for what one has to provide), so adding up a
+//node's reduce is a couple of inlined additions per item, and a node
+//pointer's reduce is kept by value alongside it.
 
 //## Counting reducer
 //Used for the `by_seq` index, is a count of documents below this node in
 //the B-tree.
-class CountingReduce : public Reduce {
+class CountingReduce {
  public:
-  CountingReduce();
-  void operator()(KVPair& kv_pair);
-  void operator()(Reduce* reduce);
-  Reduce* clone();
-  sized_buf* encode();
-  void reset();
-  ~CountingReduce();
- protected:
-  CountingReduce(uint64_t count);
+  //Every item counts the same, so there's nothing more to know about it.
+  struct Item { };
+  CountingReduce() : count_(0) { }
+  void add(const Item&) {
+    ++count_;
+  }
+  void add(const CountingReduce& reduce) {
+    count_ += reduce.count_;
+  }
+  void reset() {
+    count_ = 0;
+  }
+  size_t encodedSize() const {
+    return term::ulonglong_size(count_);
+  }
+  char* encode(char* buf) const {
+    return term::put_ulonglong(buf, count_);
+  }
+  //Read back an encoded reduce, as found in a node pointer. Returns false if
+  //it doesn't parse.
+  bool decode(const char* buf) {
+    int pos = 0;
+    unsigned long long count;
+    if(ei_decode_ulonglong(buf, &pos, &count))
+      return false;
+    count_ = count;
+    return true;
+  }
+ private:
   uint64_t count_;
-  char termbuf_[10];
-  sized_buf term_;
 };
+
 //## by_id reduce
 //Counts live and deleted docs, and adds up their size.
-class ByIDReduce : public Reduce {
+class ByIDReduce {
  public:
-  ByIDReduce();
-  void operator()(KVPair& kv_pair);
-  void operator()(Reduce* reduce);
-  void operator()(disk_docinfo* info);
-  Reduce* clone();
-  sized_buf* encode();
-  void reset();
-  ~ByIDReduce();
- protected:
-  ByIDReduce(uint64_t not_deleted, uint64_t deleted, uint64_t total_size);
+  //What the reduce needs of a doc, which its encoded item doesn't make easy
+  //to get at.
+  struct Item {
+    Item(bool deleted, uint64_t size) : deleted(deleted), size(size) { }
+    bool deleted;
+    uint64_t size;
+  };
+  ByIDReduce() : not_deleted_count_(0), deleted_count_(0), total_size_(0) { }
+  void add(const Item& item) {
+    if(item.deleted)
+      ++deleted_count_;
+    else
+      ++not_deleted_count_;
+    total_size_ += item.size;
+  }
+  void add(const ByIDReduce& reduce) {
+    not_deleted_count_ += reduce.not_deleted_count_;
+    deleted_count_ += reduce.deleted_count_;
+    total_size_ += reduce.total_size_;
+  }
+  void reset() {
+    not_deleted_count_ = 0;
+    deleted_count_ = 0;
+    total_size_ = 0;
+  }
+  //_{NotDeleted, Deleted, TotalSize}_
+  size_t encodedSize() const {
+    return term::Tuple<3>::size + term::ulonglong_size(not_deleted_count_) +
+           term::ulonglong_size(deleted_count_) +
+           term::ulonglong_size(total_size_);
+  }
+  char* encode(char* buf) const {
+    buf = term::Tuple<3>::put(buf);
+    buf = term::put_ulonglong(buf, not_deleted_count_);
+    buf = term::put_ulonglong(buf, deleted_count_);
+    return term::put_ulonglong(buf, total_size_);
+  }
+  bool decode(const char* buf) {
+    int pos = 0;
+    int arity;
+    unsigned long long not_deleted, deleted, total_size;
+    if(ei_decode_tuple_header(buf, &pos, &arity) || arity != 3 ||
+       ei_decode_ulonglong(buf, &pos, &not_deleted) ||
+       ei_decode_ulonglong(buf, &pos, &deleted) ||
+       ei_decode_ulonglong(buf, &pos, &total_size))
+      return false;
+    not_deleted_count_ = not_deleted;
+    deleted_count_ = deleted;
+    total_size_ = total_size;
+    return true;
+  }
+ private:
   uint64_t not_deleted_count_;
   uint64_t deleted_count_;
   uint64_t total_size_;
-  char termbuf_[32];
-  sized_buf term_;
 };
 
-static const char nil_buf[1] = { 0x6A };
-class NullReduce : public Reduce {
+//## Null reduce
+//For the local docs index, which has no reduce: always _[]_.
+class NullReduce {
  public:
-  NullReduce() { term_.buf = const_cast<char*>(nil_buf); term_.size = 1; }
-  void operator()(KVPair& kv_pair) { }
-  void operator()(Reduce* reduce) { }
-  Reduce* clone() { return new NullReduce; }
-  sized_buf* encode() { return &term_; }
+  struct Item { };
+  void add(const Item&) { }
+  void add(const NullReduce&) { }
   void reset() { }
-  ~NullReduce() { }
- protected:
-  sized_buf term_;
+  size_t encodedSize() const {
+    return 1;
+  }
+  char* encode(char* buf) const {
+    buf[0] = ERL_NIL_EXT;
+    return buf + 1;
+  }
+  bool decode(const char* buf) {
+    return true;
+  }
 };
 }
 #endif
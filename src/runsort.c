@@ -0,0 +1,204 @@
+/* In-memory run sorting for merge_sort.
+
+   A run is a block of records packed into one arena plus an array of
+   struct sort_entry describing them. Sorting only moves the 16-byte
+   entries, and most comparisons are settled by the integer prefix without
+   touching the arena at all.
+
+   Runs can be sorted either by comparison (sort_entries, a quicksort) or
+   by radix_sort_entries, an MSD radix sort that never compares keys in
+   buckets larger than RADIX_SORT_MIN. Which one wins depends on the run
+   size and key shape; see bench/run_sort_bench.c.
+*/
+
+#include <string.h>
+#include "runsort.h"
+
+/* below this many entries, insertion sort beats partitioning */
+#define INSERTION_SORT_MAX 16
+
+static int compare_entries(const struct sort_entry *a,
+  const struct sort_entry *b, char *arena,
+  int (*compare)(void *, void *, void *), void *pointer)
+{
+  if (a->prefix != b->prefix)
+    return a->prefix < b->prefix ? -1 : 1;
+  return (*compare)(arena + a->offset, arena + b->offset, pointer);
+}
+
+static void swap_entries(struct sort_entry *a, struct sort_entry *b)
+{
+  struct sort_entry t = *a;
+  *a = *b;
+  *b = t;
+}
+
+static void insertion_sort(struct sort_entry *entries, unsigned long n,
+  char *arena, int (*compare)(void *, void *, void *), void *pointer)
+{
+  unsigned long i, j;
+  for (i = 1; i < n; i++)
+  {
+    struct sort_entry t = entries[i];
+    for (j = i; j > 0 &&
+      compare_entries(&t, entries + j - 1, arena, compare, pointer) < 0; j--)
+      entries[j] = entries[j - 1];
+    entries[j] = t;
+  }
+}
+
+/* Quicksort with a median-of-three pivot. It recurses on the smaller */
+/* side and loops on the larger, so the stack stays O(log n).         */
+void sort_entries(struct sort_entry *entries, unsigned long n, char *arena,
+  int (*compare)(void *, void *, void *), void *pointer)
+{
+  while (n > INSERTION_SORT_MAX)
+  {
+    unsigned long mid = n / 2, i, j;
+    struct sort_entry *last = entries + n - 1;
+    struct sort_entry pivot;
+    if (compare_entries(entries + mid, entries, arena, compare, pointer) < 0)
+      swap_entries(entries + mid, entries);
+    if (compare_entries(last, entries + mid, arena, compare, pointer) < 0)
+    {
+      swap_entries(last, entries + mid);
+      if (compare_entries(entries + mid, entries, arena, compare, pointer) < 0)
+        swap_entries(entries + mid, entries);
+    }
+    pivot = entries[mid];
+    i = 0;
+    j = n - 1;
+    while (1)
+    {
+      while (compare_entries(entries + i, &pivot, arena, compare, pointer) < 0)
+        i++;
+      while (compare_entries(&pivot, entries + j, arena, compare, pointer) < 0)
+        j--;
+      if (i >= j)
+        break;
+      swap_entries(entries + i, entries + j);
+      i++;
+      j--;
+    }
+    /* entries[0..j] <= pivot <= entries[j+1..n-1] */
+    if (j + 1 < n - j - 1)
+    {
+      sort_entries(entries, j + 1, arena, compare, pointer);
+      entries += j + 1;
+      n -= j + 1;
+    }
+    else
+    {
+      sort_entries(entries + j + 1, n - j - 1, arena, compare, pointer);
+      n = j + 1;
+    }
+  }
+  insertion_sort(entries, n, arena, compare, pointer);
+}
+
+/* buckets smaller than this are finished by sort_entries, which itself */
+/* ends in insertion sort; setting up 257 buckets does not pay off below */
+/* about this size                                                       */
+#define RADIX_SORT_MIN 64
+
+/* key prefixes are this many bytes long */
+#define PREFIX_BYTES 8
+
+/* bucket 0 holds records whose key ends before depth */
+#define RADIX_BUCKETS 257
+
+struct radix_context
+{
+  char *arena;
+  int (*compare)(void *, void *, void *);
+  const unsigned char *(*key)(void *, unsigned *, void *);
+  void *pointer;
+};
+
+/* Bucket of an entry at byte position depth: the prefix byte while there  */
+/* is one (never bucket 0: the zero padding sorts like a zero byte, and    */
+/* the keys it could confuse end up tied in the same prefix group), then   */
+/* the key byte plus one, or 0 once the key has run out.                   */
+static unsigned radix_bucket(const struct radix_context *c,
+  const struct sort_entry *e, unsigned depth)
+{
+  const unsigned char *key;
+  unsigned length;
+  if (depth < PREFIX_BYTES)
+    return 1 + (unsigned) ((e->prefix >> (8 * (PREFIX_BYTES - 1 - depth))) &
+      0xFF);
+  key = (*c->key)(c->arena + e->offset, &length, c->pointer);
+  return depth < length ? 1 + key[depth] : 0;
+}
+
+static void radix_sort(struct sort_entry *entries, unsigned long n,
+  unsigned depth, const struct radix_context *c)
+{
+  unsigned long count[RADIX_BUCKETS];
+  unsigned long next[RADIX_BUCKETS];
+  unsigned long end[RADIX_BUCKETS];
+  unsigned long i;
+  unsigned b;
+  while (1)
+  {
+    if (n < RADIX_SORT_MIN || (depth >= PREFIX_BYTES && c->key == NULL))
+    {
+      sort_entries(entries, n, c->arena, c->compare, c->pointer);
+      return;
+    }
+    memset(count, 0, sizeof(count));
+    for (i = 0; i < n; i++)
+      count[radix_bucket(c, entries + i, depth)]++;
+    /* the common case for shared prefixes: everything in one bucket */
+    for (b = 0; b < RADIX_BUCKETS && count[b] == 0; b++)
+      ;
+    if (count[b] != n || b == 0)
+      break;
+    depth++;
+  }
+  next[0] = 0;
+  end[0] = count[0];
+  for (b = 1; b < RADIX_BUCKETS; b++)
+  {
+    next[b] = end[b - 1];
+    end[b] = next[b] + count[b];
+  }
+  /* permute the entries into their buckets in place */
+  for (b = 0; b < RADIX_BUCKETS; b++)
+  {
+    while (next[b] < end[b])
+    {
+      struct sort_entry t = entries[next[b]];
+      unsigned d = radix_bucket(c, &t, depth);
+      while (d != b)
+      {
+        struct sort_entry u = entries[next[d]];
+        entries[next[d]++] = t;
+        t = u;
+        d = radix_bucket(c, &t, depth);
+      }
+      entries[next[b]++] = t;
+    }
+  }
+  /* keys that have ended are equal up to depth and differ only in */
+  /* length, so compare finishes them                              */
+  if (count[0] > 1)
+    sort_entries(entries, count[0], c->arena, c->compare, c->pointer);
+  for (b = 1, i = count[0]; b < RADIX_BUCKETS; i += count[b], b++)
+  {
+    if (count[b] > 1)
+      radix_sort(entries + i, count[b], depth + 1, c);
+  }
+}
+
+void radix_sort_entries(struct sort_entry *entries, unsigned long n,
+  char *arena, int (*compare)(void *, void *, void *),
+  const unsigned char *(*key)(void *, unsigned *, void *), void *pointer)
+{
+  struct radix_context c;
+  c.arena = arena;
+  c.compare = compare;
+  c.key = key;
+  c.pointer = pointer;
+  radix_sort(entries, n, 0, &c);
+}
@@ -0,0 +1,36 @@
+#ifndef __RUNSORT_H
+#define __RUNSORT_H 1
+
+/* One record of an in-memory run: where the record lives in the run's  */
+/* arena, its size, and a key prefix that orders records the same way   */
+/* the full comparison does whenever two prefixes differ.               */
+struct sort_entry
+{
+  unsigned long long prefix;
+  unsigned offset;
+  unsigned size;
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Sort n entries by prefix, comparing the records themselves (found at */
+/* arena + offset) only when two prefixes are equal.                    */
+void sort_entries(struct sort_entry *entries, unsigned long n, char *arena,
+  int (*compare)(void *, void *, void *), void *pointer);
+
+/* MSD radix (American flag) sort of n entries: on the prefix bytes first,  */
+/* then, if key is not NULL, on the bytes it returns for each record. The  */
+/* key must order records exactly as compare does (bytewise, with a key    */
+/* that is a prefix of another sorting first). Small buckets, and records  */
+/* whose keys are exhausted, are finished with compare.                    */
+void radix_sort_entries(struct sort_entry *entries, unsigned long n,
+  char *arena, int (*compare)(void *, void *, void *),
+  const unsigned char *(*key)(void *, unsigned *, void *), void *pointer);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,438 @@
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <ei.h>
+#include <libcouchstore/couch_btree.h>
+#include "seq_copy.hh"
+#include "docinfo_term.hh"
+#include "metrics.hh"
+namespace couchstore
+{
+static const uint64_t kBlockSize = 4096;
+//Ranges to cut per worker, so that one slow range doesn't leave the others
+//idle at the end.
+static const size_t kRangesPerWorker = 4;
+//Docs we aim to have in a range at most. A range's docinfos are all held
+//between walking it and building its leaves.
+static const uint64_t kMaxRangeDocs = 64 * 1024;
+//And at least, so small trees aren't split into ranges that cost more to set
+//up (and to pad out to a block) than they save.
+static const uint64_t kMinRangeDocs = 1024;
+
+//A subtree of the source `by_seq` tree, and how many docs are in it.
+struct Subtree {
+  uint64_t pointer;
+  uint64_t count;
+};
+
+static uint64_t block_align(uint64_t pos)
+{
+  return (pos + kBlockSize - 1) / kBlockSize * kBlockSize;
+}
+
+//An unlinked temporary file in `dir`, or $TMPDIR, or /tmp.
+static int open_segment(const char* dir)
+{
+  char path[PATH_MAX];
+  if(dir == NULL)
+    dir = getenv("TMPDIR");
+  if(dir == NULL || *dir == '\0')
+    dir = "/tmp";
+  if(snprintf(path, sizeof(path), "%s/seqcopy.XXXXXX", dir) >=
+     (int) sizeof(path))
+    return -1;
+  int fd = mkstemp(path);
+  if(fd >= 0)
+  {
+    unlink(path);
+    Metrics::get().setFile(fd, Metrics::kSegmentFile);
+  }
+  return fd;
+}
+
+//## Reading the source tree
+//Add the children of the node at `pointer` to `children`. If it's a leaf
+//(a _kv\_node_) there's nothing to add, and `*leaf` is set instead.
+static int read_children(int fd, uint64_t pointer,
+                         std::vector<Subtree>& children, bool* leaf)
+{
+  char* buf;
+  if(pread_compressed(fd, pointer, &buf) < 0)
+    return ERROR_READ;
+  int error = 0;
+  int pos = 0;
+  int version, arity;
+  char atom[MAXATOMLEN + 1];
+  if(ei_decode_version(buf, &pos, &version) ||
+     ei_decode_tuple_header(buf, &pos, &arity) ||
+     ei_decode_atom(buf, &pos, atom) ||
+     ei_decode_list_header(buf, &pos, &arity))
+    error = ERROR_PARSE_TERM;
+  else if(strcmp(atom, "kp_node") != 0)
+    *leaf = true;
+  else
+  {
+    //Each item is _{Key, {Pointer, Reduce, SubtreeSize}}_, and a `by_seq`
+    //reduce is the count of docs below.
+    for(int i = 0; i < arity && !error; i++)
+    {
+      int tuple;
+      unsigned long long child, count;
+      if(ei_decode_tuple_header(buf, &pos, &tuple) ||
+         ei_skip_term(buf, &pos) ||
+         ei_decode_tuple_header(buf, &pos, &tuple) ||
+         ei_decode_ulonglong(buf, &pos, &child) ||
+         ei_decode_ulonglong(buf, &pos, &count) ||
+         ei_skip_term(buf, &pos))
+        error = ERROR_PARSE_TERM;
+      else
+      {
+        Subtree subtree = { child, count };
+        children.push_back(subtree);
+      }
+    }
+  }
+  free(buf);
+  return error;
+}
+
+static DocInfo* copy_docinfo(DocInfo* info)
+{
+  size_t extra = info->id.size + info->rev_meta.size;
+  DocInfo* copy = static_cast<DocInfo*>(malloc(sizeof(DocInfo) + extra));
+  if(copy == NULL)
+    return NULL;
+  *copy = *info;
+  copy->id.buf = reinterpret_cast<char*>(copy + 1);
+  copy->rev_meta.buf = copy->id.buf + info->id.size;
+  memcpy(copy->id.buf, info->id.buf, info->id.size);
+  memcpy(copy->rev_meta.buf, info->rev_meta.buf, info->rev_meta.size);
+  return copy;
+}
+
+SeqCopy::SeqCopy(Db* source, ChunkWriter* target, RangeSinks* sinks,
+                 DocSink* placed, unsigned workers, const char* spill_dir)
+    : source_(source), target_(target), sinks_(sinks), workers_(workers),
+      spill_dir_(spill_dir), positions_(placed), output_(NULL),
+      checkpoints_(NULL), appended_(0),
+      bodies_(NULL), next_(0), turn_(0), error_(0)
+{
+  pthread_mutex_init(&lock_, NULL);
+  pthread_cond_init(&turn_changed_, NULL);
+}
+
+SeqCopy::~SeqCopy()
+{
+  for(std::vector<Range>::iterator it = ranges_.begin(); it != ranges_.end();
+      ++it)
+    for(size_t i = 0; i < it->docs.size(); i++)
+      free_docinfo(it->docs[i]);
+  for(std::vector<int>::iterator it = segments_.begin();
+      it != segments_.end(); ++it)
+  {
+    Metrics::get().setFile(*it, Metrics::kOtherFile);
+    close(*it);
+  }
+  delete bodies_;
+  pthread_mutex_destroy(&lock_);
+  pthread_cond_destroy(&turn_changed_);
+}
+
+//## Cutting the tree into ranges
+//Go down the tree a level at a time until there are enough subtrees to go
+//round the workers, each small enough to hold in memory, then group them
+//into ranges of about the same number of docs.
+int SeqCopy::plan(bool* split)
+{
+  *split = false;
+  node_pointer* root = source_->header.by_seq_root;
+  if(root == NULL || workers_ < 2)
+    return 0;
+  Subtree top = { root->pointer, 0 };
+  std::vector<Subtree> level(1, top);
+  uint64_t total = 0;
+  size_t wanted = workers_ * kRangesPerWorker;
+  while(level.size() < wanted || total > level.size() * kMaxRangeDocs)
+  {
+    std::vector<Subtree> next;
+    bool leaf = false;
+    for(size_t i = 0; i < level.size() && !leaf; i++)
+    {
+      int error = read_children(source_->fd, level[i].pointer, next, &leaf);
+      if(error) return error;
+    }
+    if(leaf) break;
+    level.swap(next);
+    total = 0;
+    for(size_t i = 0; i < level.size(); i++)
+      total += level[i].count;
+  }
+  size_t count = wanted;
+  if(total / kMaxRangeDocs + 1 > count)
+    count = total / kMaxRangeDocs + 1;
+  uint64_t per_range = total / count;
+  if(per_range < kMinRangeDocs) per_range = kMinRangeDocs;
+  Range range;
+  range.segment = -1;
+  range.segment_start = range.segment_end = 0;
+  range.last_seq = 0;
+  range.built = false;
+  uint64_t docs = 0;
+  for(size_t i = 0; i < level.size(); i++)
+  {
+    range.roots.push_back(level[i].pointer);
+    docs += level[i].count;
+    if(docs >= per_range || i + 1 == level.size())
+    {
+      ranges_.push_back(range);
+      range.roots.clear();
+      docs = 0;
+    }
+  }
+  *split = ranges_.size() > 1;
+  if(!*split)
+    ranges_.clear();
+  return 0;
+}
+
+//## Copying the ranges
+int SeqCopy::run(NodeBuilder<CountingReduce>& output,
+                 Checkpoints* checkpoints)
+{
+  output_ = &output;
+  checkpoints_ = checkpoints;
+  bodies_ = new ChunkCopier(source_, target_, &positions_);
+  std::vector<pthread_t> threads;
+  for(unsigned i = 0; i < workers_ && i < ranges_.size(); i++)
+  {
+    pthread_t thread;
+    if(pthread_create(&thread, NULL, worker_main, this) != 0)
+      break;
+    threads.push_back(thread);
+  }
+  //Without any threads, do it all here.
+  if(threads.empty())
+    work();
+  for(std::vector<pthread_t>::iterator it = threads.begin();
+      it != threads.end(); ++it)
+    pthread_join(*it, NULL);
+  if(error_) return error_;
+  return append_segments(ranges_.size());
+}
+
+void* SeqCopy::worker_main(void* ctx)
+{
+  static_cast<SeqCopy*>(ctx)->work();
+  return NULL;
+}
+
+void SeqCopy::work()
+{
+  Db segment;
+  memset(&segment, 0, sizeof(segment));
+  segment.fd = open_segment(spill_dir_);
+  if(segment.fd < 0)
+  {
+    fail(ERROR_OPEN_FILE);
+    return;
+  }
+  ChunkWriter writer(&segment);
+  pthread_mutex_lock(&lock_);
+  segments_.push_back(segment.fd);
+  while(!error_ && next_ < ranges_.size())
+  {
+    Range* range = &ranges_[next_++];
+    pthread_mutex_unlock(&lock_);
+    int error = process(range, &writer);
+    if(error) fail(error);
+    pthread_mutex_lock(&lock_);
+  }
+  pthread_mutex_unlock(&lock_);
+}
+
+int SeqCopy::process(Range* range, ChunkWriter* segment)
+{
+  int error = read_range(range);
+  if(error) return error;
+  //Wait for every range before this one to have its bodies placed.
+  size_t index = range - &ranges_[0];
+  pthread_mutex_lock(&lock_);
+  while(turn_ != index && !error_)
+    pthread_cond_wait(&turn_changed_, &lock_);
+  bool stopping = error_ != 0;
+  pthread_mutex_unlock(&lock_);
+  if(stopping) return 0;
+  //The turn is also the only time the new file is written, so the leaves
+  //finished since the last one go in now.
+  error = append_built();
+  if(!error)
+    error = copy_bodies(range);
+  pthread_mutex_lock(&lock_);
+  turn_++;
+  pthread_cond_broadcast(&turn_changed_);
+  pthread_mutex_unlock(&lock_);
+  if(error) return error;
+  error = build_leaves(range, segment);
+  if(error) return error;
+  pthread_mutex_lock(&lock_);
+  range->built = true;
+  pthread_mutex_unlock(&lock_);
+  return 0;
+}
+
+//Where `collect_docinfo` puts what it decodes.
+struct RangeWalk {
+  std::vector<DocInfo*>* docs;
+  int error;
+};
+
+static int collect_docinfo(couchfile_lookup_request* rq, void* k,
+                           sized_buf* v)
+{
+  RangeWalk* walk = static_cast<RangeWalk*>(rq->callback_ctx);
+  if(walk->error)
+    return walk->error;
+  DocInfo* info = decode_docinfo(static_cast<sized_buf*>(k), v);
+  if(info == NULL)
+    return walk->error = ERROR_PARSE_TERM;
+  walk->docs->push_back(info);
+  return 0;
+}
+
+//Walk the range's subtrees, collecting their docinfos in seq order.
+int SeqCopy::read_range(Range* range)
+{
+  uint64_t key_buf;
+  uint64_t start = 0;
+  void* keys[1] = { &start };
+  RangeWalk walk = { &range->docs, 0 };
+  couchfile_lookup_request rq;
+  rq.cmp.arg = &key_buf;
+  rq.cmp.compare = seq_cmp;
+  rq.cmp.from_ext = seq_from_ext;
+  rq.keys = keys;
+  rq.num_keys = 1;
+  rq.fold = 1;
+  rq.in_fold = 0;
+  rq.fd = source_->fd;
+  rq.fetch_callback = collect_docinfo;
+  rq.callback_ctx = &walk;
+  for(size_t i = 0; i < range->roots.size() && !walk.error; i++)
+  {
+    int error = btree_lookup(&rq, range->roots[i]);
+    if(error < 0) return error;
+  }
+  return walk.error;
+}
+
+//Copy the range's bodies through the shared `ChunkCopier`, after the last
+//range's, note where each one went, and pass each doc on to `placed`.
+int SeqCopy::copy_bodies(Range* range)
+{
+  int error = 0;
+  positions_.positions = &range->positions;
+  for(size_t i = 0; i < range->docs.size() && !error; i++)
+  {
+    DocInfo* copy = copy_docinfo(range->docs[i]);
+    if(copy == NULL)
+      error = ERROR_ALLOC_FAIL;
+    else
+      error = bodies_->push(copy);
+  }
+  int finish_error = bodies_->finish();
+  if(!error) error = finish_error;
+  positions_.positions = NULL;
+  if(!error && range->positions.size() != range->docs.size())
+    error = ERROR_WRITE;
+  return error;
+}
+
+//Build the range's leaf nodes into the worker's segment, starting at a block
+//boundary, and hand its docs to its sink. The segment is flushed at the end,
+//ready to be copied from.
+int SeqCopy::build_leaves(Range* range, ChunkWriter* segment)
+{
+  int error = segment->pad(block_align(segment->position()) -
+                           segment->position());
+  if(error) return error;
+  range->segment = segment->db()->fd;
+  range->segment_start = segment->position();
+  NodeBuilder<CountingReduce> leaves(segment);
+  leaves.setSizing(sizing_);
+  DocSink* sink = sinks_->create(&leaves);
+  if(!range->docs.empty())
+    range->last_seq = range->docs.back()->db_seq;
+  for(size_t i = 0; i < range->docs.size(); i++)
+  {
+    range->docs[i]->bp = range->positions[i];
+    if(!error)
+      error = sink->add(range->docs[i]);
+    free_docinfo(range->docs[i]);
+  }
+  std::vector<DocInfo*>().swap(range->docs);
+  std::vector<uint64_t>().swap(range->positions);
+  delete sink;
+  if(!error)
+    error = leaves.flush();
+  if(!error)
+    error = segment->flush();
+  range->segment_end = segment->position();
+  range->leaves.swap(*leaves.pointers());
+  return error;
+}
+
+//## Putting the leaves in place
+//Append the leaves of the ranges that are done, up to the first that isn't.
+int SeqCopy::append_built()
+{
+  pthread_mutex_lock(&lock_);
+  size_t end = appended_;
+  while(end < ranges_.size() && ranges_[end].built)
+    end++;
+  pthread_mutex_unlock(&lock_);
+  return append_segments(end);
+}
+
+//Copy the leaves of the ranges from `appended_` up to `end` from their
+//segments to the end of the new file, at the start of a block as they were
+//in the segment, and pass their pointers on.
+int SeqCopy::append_segments(size_t end)
+{
+  for(; appended_ < end; appended_++)
+  {
+    Range* range = &ranges_[appended_];
+    if(range->leaves.empty())
+      continue;
+    uint64_t length = range->segment_end - range->segment_start;
+    uint64_t start;
+    int error = target_->pad(block_align(target_->position()) -
+                             target_->position());
+    if(!error)
+      error = target_->claim(length, &start);
+    if(!error)
+      error = copy_range(range->segment, range->segment_start, target_->db()->fd,
+                         start, length);
+    if(error) return error;
+    for(size_t i = 0; i < range->leaves.size() && !error; i++)
+    {
+      range->leaves[i]->rebase(range->segment_start, start);
+      error = output_->adoptPointer(range->leaves[i]);
+    }
+    range->leaves.clear();
+    if(!error && checkpoints_ && checkpoints_->due())
+      error = checkpoints_->write(*output_, range->last_seq);
+    if(error) return error;
+  }
+  return 0;
+}
+
+void SeqCopy::fail(int error)
+{
+  pthread_mutex_lock(&lock_);
+  if(!error_) error_ = error;
+  pthread_cond_broadcast(&turn_changed_);
+  pthread_mutex_unlock(&lock_);
+}
+}
@@ -0,0 +1,131 @@
+#ifndef COUCH_SEQ_COPY_H
+#define COUCH_SEQ_COPY_H
+#include <libcouchstore/couch_db.h>
+#include <pthread.h>
+#include <vector>
+#include "wrap.hh"
+#include "btree_copy.hh"
+#include "reduces.hh"
+#include "chunk_copy.hh"
+#include "doc_pipeline.hh"
+#include "checkpoint.hh"
+//# Parallel `by_seq` copy
+//Splits the old file's `by_seq` tree into ranges of seqs along the key
+//pointers near its root, and copies the ranges on a pool of workers. Each
+//range goes through three steps:
+//
+// 1. Its subtrees are walked and their docinfos decoded, in parallel with
+//    every other range.
+// 2. Its bodies are copied, in range order, straight after the previous
+//    range's. This is the one step that waits its turn, since a range's new
+//    `bp`s (which go into its leaf nodes) aren't known until everything
+//    before it has been placed. The copy itself is mostly the kernel's work.
+//    Each doc is handed on as soon as its body is placed, so whatever takes
+//    them all (the `by_id` index) gets them in seq order, one at a time.
+// 3. Its `by_seq` leaf nodes are built and compressed, in parallel again, into
+//    a segment file of the worker's own.
+//
+//As the ranges' leaves are done, in seq order, they are appended from the
+//segments to the new file, each range at a block boundary so the block
+//markers written into it stay in the right places, and the leaf pointers,
+//moved to where their nodes ended up, are handed back for the pointer nodes
+//to be built over. That's done by whichever worker has the next turn to copy
+//bodies, before it does, and for the last ranges once the workers are
+//finished. A checkpoint can be taken after any range appended.
+namespace couchstore
+{
+//Gives each range the `DocSink` its docs go to, in seq order, once their
+//bodies are copied. `leaves` is the builder for the range's leaf nodes.
+//Called on the worker threads, so sinks for different ranges run at the same
+//time; anything they share must be locked.
+class RangeSinks {
+ public:
+  virtual ~RangeSinks() { }
+  virtual DocSink* create(NodeBuilder<CountingReduce>* leaves) = 0;
+};
+
+class SeqCopy {
+ public:
+  //`placed` gets every doc, in seq order, once its body is copied, from
+  //whichever worker has the turn; it may write to `target`. `spill_dir` is
+  //where the segment files go (NULL means $TMPDIR, or /tmp).
+  SeqCopy(Db* source, ChunkWriter* target, RangeSinks* sinks, DocSink* placed,
+          unsigned workers, const char* spill_dir);
+  ~SeqCopy();
+  //How full to make the leaf nodes.
+  void setSizing(const NodeSizing& sizing) {
+    sizing_ = sizing;
+  }
+  //Split the source tree into ranges. Returns 0 with `*split` false if the
+  //tree is too small to be worth splitting, in which case it should be copied
+  //in one pass instead.
+  int plan(bool* split);
+  //Copy every range. On success the new leaf nodes' pointers, in seq order,
+  //have been handed to `output` with `adoptPointer`. If there are
+  //`checkpoints`, one is taken after a range's leaves whenever it's due.
+  int run(NodeBuilder<CountingReduce>& output,
+          Checkpoints* checkpoints = NULL);
+ private:
+  struct Range {
+    //Subtrees of the source tree, in seq order.
+    std::vector<uint64_t> roots;
+    std::vector<DocInfo*> docs;
+    //New `bp` for each of `docs`.
+    std::vector<uint64_t> positions;
+    //Where the range's leaf nodes are in its worker's segment.
+    int segment;
+    uint64_t segment_start;
+    uint64_t segment_end;
+    std::vector<shared_ptr<NodePointer<CountingReduce> > > leaves;
+    //The range's last seq, and whether its leaves are done.
+    uint64_t last_seq;
+    bool built;
+  };
+  //Records the new `bp` of each doc the body copier hands on, and passes the
+  //doc on to `placed`.
+  class PositionSink : public DocSink {
+   public:
+    PositionSink(DocSink* placed) : positions(NULL), placed_(placed) { }
+    int add(DocInfo* info) {
+      positions->push_back(info->bp);
+      return placed_->add(info);
+    }
+    std::vector<uint64_t>* positions;
+   private:
+    DocSink* placed_;
+  };
+  static void* worker_main(void* ctx);
+  void work();
+  int process(Range* range, ChunkWriter* segment);
+  int read_range(Range* range);
+  int copy_bodies(Range* range);
+  int build_leaves(Range* range, ChunkWriter* segment);
+  int append_built();
+  int append_segments(size_t end);
+  void fail(int error);
+  Db* source_;
+  ChunkWriter* target_;
+  RangeSinks* sinks_;
+  NodeSizing sizing_;
+  unsigned workers_;
+  const char* spill_dir_;
+  std::vector<Range> ranges_;
+  std::vector<int> segments_;
+  PositionSink positions_;
+  NodeBuilder<CountingReduce>* output_;
+  Checkpoints* checkpoints_;
+  //Ranges whose leaves have been appended to the new file.
+  size_t appended_;
+  //Copies every range's bodies, one range at a time.
+  ChunkCopier* bodies_;
+  //Next range a worker will take, and the range whose bodies are next to be
+  //copied.
+  size_t next_;
+  size_t turn_;
+  int error_;
+  pthread_mutex_t lock_;
+  pthread_cond_t turn_changed_;
+  DISALLOW_COPY_AND_ASSIGN(SeqCopy);
+};
+}
+#endif
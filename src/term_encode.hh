@@ -0,0 +1,107 @@
+#ifndef COUCH_TERM_ENCODE_H
+#define COUCH_TERM_ENCODE_H
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <ei.h>
+//# Inline term encoding
+//The handful of Erlang external term encodings written for every doc, done
+//inline rather than through `ei_encode_*` calls, and with each term's size
+//known before it's written, so an item can be given exactly the room it
+//needs. Every encoder writes the same bytes its `ei` counterpart would.
+//
+//Each `put_` function writes at `buf` and returns the end of what it wrote.
+namespace couchstore
+{
+namespace term
+{
+//Largest integer `ei` encodes as an _INTEGER\_EXT_; bigger ones are bignums.
+#ifdef ERL_MAX
+static const uint64_t kMaxInteger = ERL_MAX;
+#else
+static const uint64_t kMaxInteger = (1 << 27) - 1;
+#endif
+
+inline char* put_be32(char* buf, uint32_t n)
+{
+  buf[0] = (char) (n >> 24);
+  buf[1] = (char) (n >> 16);
+  buf[2] = (char) (n >> 8);
+  buf[3] = (char) n;
+  return buf + 4;
+}
+
+//### Unsigned integers
+//As `ei_encode_ulonglong`: a small integer below 256, a 4 byte integer up to
+//`kMaxInteger`, and otherwise a small bignum, least significant byte first.
+inline size_t ulonglong_size(uint64_t n)
+{
+  if(n < 256) return 2;
+  if(n <= kMaxInteger) return 5;
+  size_t size = 3;
+  for(; n; n >>= 8)
+    size++;
+  return size;
+}
+
+inline char* put_ulonglong(char* buf, uint64_t n)
+{
+  if(n < 256)
+  {
+    buf[0] = ERL_SMALL_INTEGER_EXT;
+    buf[1] = (char) n;
+    return buf + 2;
+  }
+  if(n <= kMaxInteger)
+  {
+    buf[0] = ERL_INTEGER_EXT;
+    return put_be32(buf + 1, (uint32_t) n);
+  }
+  char* arity = buf + 1;
+  buf[0] = ERL_SMALL_BIG_EXT;
+  buf[2] = 0;
+  buf += 3;
+  for(; n; n >>= 8)
+    *buf++ = (char) (n & 0xff);
+  *arity = (char) (buf - arity - 2);
+  return buf;
+}
+
+//### Binaries
+inline size_t binary_size(size_t len)
+{
+  return 5 + len;
+}
+
+inline char* put_binary(char* buf, const void* data, size_t len)
+{
+  buf[0] = ERL_BINARY_EXT;
+  buf = put_be32(buf + 1, (uint32_t) len);
+  memcpy(buf, data, len);
+  return buf + len;
+}
+
+//### Tuple headers
+//The arity is always known where a tuple is written, so the choice between a
+//small and a large tuple is made at compile time.
+template<unsigned Arity, bool Small = (Arity < 256)>
+struct Tuple {
+  static const size_t size = 2;
+  static char* put(char* buf) {
+    buf[0] = ERL_SMALL_TUPLE_EXT;
+    buf[1] = (char) Arity;
+    return buf + 2;
+  }
+};
+
+template<unsigned Arity>
+struct Tuple<Arity, false> {
+  static const size_t size = 5;
+  static char* put(char* buf) {
+    buf[0] = ERL_LARGE_TUPLE_EXT;
+    return put_be32(buf + 1, Arity);
+  }
+};
+}
+}
+#endif
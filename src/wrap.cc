@@ -6,6 +6,12 @@ DocInfo* DocumentInfo::get()
   return docinfo_;
 }
 
+DocInfo* DocumentInfo::release()
+{
+  couchstore_allocated = false;
+  return docinfo_;
+}
+
 DocumentInfo::~DocumentInfo()
 {
   if(couchstore_allocated)
@@ -63,7 +69,7 @@ int do_callback(Db* db, DocInfo* info, void* ctxptr)
   return NO_FREE_DOCINFO;
 }
 
-int DBHandle::changes(int seq, InfoCallback &cb)
+int DBHandle::changes(uint64_t seq, InfoCallback &cb)
 {
   cs_callback_ctx ctx (&cb);
   last_error_ = changes_since(db_handle_, seq, 0, do_callback, static_cast<void*>(&ctx));
@@ -17,6 +17,9 @@ class DocumentInfo {
   DocInfo* operator->() {
     return get();
   }
+  //Take ownership of the DocInfo, which must then be freed with
+  //`free_docinfo`.
+  DocInfo* release();
   ~DocumentInfo();
  protected:
   friend int do_callback(Db*, DocInfo*, void*);
@@ -31,6 +34,7 @@ class DocumentInfo {
 
 class InfoCallback {
  public:
+  virtual ~InfoCallback() { }
   virtual int callback(DocumentInfo &info) = 0;
 };
 
@@ -41,7 +45,7 @@ class DBHandle {
   bool isValid();
   int lastError();
   std::string describeLastError();
-  int changes(int seq, InfoCallback& cb);
+  int changes(uint64_t seq, InfoCallback& cb);
   Db* get();
   Db* operator->() {
     return get();